@@ -1,7 +1,34 @@
 ﻿#include <iostream>             // cout, cerr
 #include <cstdlib>              // EXIT_FAILURE
+#include <vector>               // vector
+#include <algorithm>            // fill, sort
+#include <cstdint>              // uint32_t, uint64_t
+#include <string>               // string
+#include <unordered_map>        // unordered_map
+#include <unordered_set>        // unordered_set
+#include <thread>               // thread
+#include <mutex>                // mutex, unique_lock
+#include <condition_variable>   // condition_variable
+#include <atomic>               // atomic
+#include <functional>           // function
+#include <deque>                // deque
+#include <memory>               // shared_ptr
+#include <chrono>               // steady_clock
+#include <fstream>              // ofstream, ifstream
+#include <cstring>              // memcpy, memcmp
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>          // SSE/AVX intrinsics for frustum culling and normal matrices
+#define IMAGE_SIMD_SSE2 1       // Image kernels use SSE2, plus AVX2/SSSE3 where the compiler allows
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>           // NEON intrinsics for the image kernels
+#define IMAGE_SIMD_NEON 1
+#endif
 #include <GL/glew.h>            // GLEW library
 #include <GLFW/glfw3.h>         // GLFW library
+#if defined(__linux__)
+#include <EGL/egl.h>            // Surfaceless context for headless rendering
+#include <EGL/eglext.h>
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
@@ -19,6 +46,23 @@ using namespace std; // Standard namespace
 #ifndef GLSL
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
 #endif
+// Shared shader code without a #version line, for splicing into several programs
+#define GLSL_CHUNK(Source) #Source "\n"
+
+/*CPU profiling zones: build with ENABLE_PROFILING=0 to compile them and their per-thread rings out entirely*/
+#ifndef ENABLE_PROFILING
+#define ENABLE_PROFILING 1
+#endif
+
+#if ENABLE_PROFILING
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_THREAD_NAME(name) USetProfileThreadName(name)
+#else
+#define PROFILE_ZONE(name) ((void)0)
+#define PROFILE_THREAD_NAME(name) ((void)0)
+#endif
 
 // Unnamed namespace
 namespace
@@ -26,38 +70,789 @@ namespace
 	const double M_PI = 3.14159265358979323846f;
     const char* const WINDOW_TITLE = "Daniel Dobbs"; // Macro for window title
 
+    // Levels of detail of a generated shape, finest first: the generator's detail parameter and the
+    // smallest projected diameter, in pixels, the level is drawn at
+    struct MeshLodSpec
+    {
+        int detail;
+        float minPixels;
+    };
+
+    // The first SPHERE_UV_LEVELS are UV spheres (detail = slices, half as many stacks), the rest are
+    // icospheres (detail = subdivisions), whose even triangles keep the outline round at low counts.
+    // Flat-faced shapes look the same at any tessellation under per-pixel lighting, so the box, plane
+    // and pyramid are generated once at their coarsest.
+    const MeshLodSpec SPHERE_LODS[] = {
+        { 48, 300.0f },
+        { 24, 100.0f },
+        { 2, 30.0f },
+        { 1, 0.0f },
+    };
+    const int SPHERE_UV_LEVELS = 2;
+
     // Variables for window width and height
     const int WINDOW_WIDTH = 800;
     const int WINDOW_HEIGHT = 600;
 
-    // Stores the GL data relative to a given mesh
+    // Stores where a given mesh lives inside the shared mesh arena
     struct GLMesh
     {
-        GLuint vao;         // Handle for the vertex array object
-        GLuint vbos[2];         // Handle for the vertex buffer object
-        GLuint nVertices; // Number of indices of the mesh
+        GLuint id;          // Slot of the mesh within the arena
+        GLuint baseVertex;  // First vertex of the mesh in the arena vertex buffer
+        GLuint firstIndex;  // First index of the mesh in the arena index buffer
+        GLuint nVertices; // Number of vertices of the mesh
         GLuint nIndices;
+        glm::vec3 boundsMin;    // Object-space bounding box
+        glm::vec3 boundsMax;
+        float lodMinPixels;     // Smallest projected diameter, in pixels, this level is drawn at
+        std::vector<GLMesh> lods;   // Coarser levels of detail, finest first (base mesh only)
+    };
+
+    // Compact arena vertex (--compact-vertices), 16 bytes instead of 32: position as 16-bit unorm within
+    // the mesh bounds, octahedral normal as two 16-bit snorms and texture coords as half floats
+    struct CompactVertex
+    {
+        uint16_t position[4];   // w is padding
+        int16_t normal[2];
+        uint16_t uv[2];
+    };
+
+    // How the vertex shaders rebuild one mesh's positions, laid out to match the std430 MeshBuffer block:
+    // position = offset + stored position * scale. Identity for float vertices.
+    struct MeshDequantization
+    {
+        glm::vec4 offset;
+        glm::vec4 scale;
+    };
+
+    // Shader storage binding point of the MeshBuffer block
+    const GLuint MESH_DATA_BINDING = 7;
+
+    // One vertex layout (position, normal, texture coords) and one VAO shared by every mesh.
+    // Meshes are appended on the CPU and the whole arena is uploaded once by UUploadMeshArena.
+    // The float vertices stay on the CPU for the occlusion rasterizer even when the GPU gets compact ones.
+    struct MeshArena
+    {
+        GLuint vao = 0;
+        GLuint vbos[2] = {};    // Vertex buffer and index buffer
+        GLuint meshBuffer = 0;  // Dequantization per mesh id
+        std::vector<GLfloat> vertices;
+        std::vector<CompactVertex> compactVertices;
+        std::vector<GLuint> indices;
+        std::vector<MeshDequantization> dequantization;
+        GLuint meshCount = 0;
+        GLuint maxMeshVertices = 0;     // Decides whether 16-bit indices reach every vertex of every mesh
+        GLenum indexType = GL_UNSIGNED_INT;
+        GLuint indexSize = sizeof(GLuint);
+        size_t triangleCount = 0;       // Simulated vertex cache misses over all meshes, for the ACMR report
+        size_t cacheMissesBefore = 0;
+        size_t cacheMissesAfter = 0;
+        std::mutex mutex;       // Mesh generators may run on several threads at once
+    };
+
+    const GLuint FLOATS_PER_ARENA_VERTEX = 8;
+
+    // Post-transform vertex cache the index optimizer orders for and the ACMR report simulates (FIFO)
+    const int VERTEX_CACHE_SIZE = 16;
+    // Overdraw clusters end once their own ACMR is within this factor of the whole mesh's
+    const float OVERDRAW_CLUSTER_LAMBDA = 1.05f;
+
+    // Matches the layout glMultiDrawElementsIndirect reads from the indirect buffer
+    struct DrawElementsIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    // A run of indirect commands that share program and material texture array, issued with one multi-draw call
+    struct IndirectRange
+    {
+        GLuint programId;
+        GLuint textureId;       // Texture array of the range's materials (0 for none)
+        GLuint firstCommand;
+        GLuint commandCount;
+    };
+
+    // Scene nodes stored as a structure of arrays: one entry per node in every array.
+    // Transforms are only rebuilt for nodes flagged dirty, so static objects reuse
+    // their cached world matrix every frame after the first.
+    struct SceneNodes
+    {
+        // Local transform components (applied as translation * rotation * scale)
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec4> rotations;   // xyz = rotation axis, w = angle in radians
+        std::vector<glm::vec3> scales;
+        std::vector<int> parents;           // Index of the parent node, -1 for root nodes
+
+        // Cached results
+        std::vector<glm::mat4> worldMatrices;
+        std::vector<glm::mat4> normalMatrices;  // Inverse-transpose of the upper 3x3 (up to scale), column 3 unused
+        std::vector<unsigned char> uniformScale; // World transform is rotation and uniform scale only
+        std::vector<int> cofactorScratch;       // Dirty nodes that need the full normal matrix this update
+        std::vector<unsigned char> dirty;
+        size_t dirtyCount = 0;
+
+        // World-space bounding boxes as center/half-extent, one array per component so the
+        // frustum test can load several nodes per SIMD register
+        std::vector<float> centerX, centerY, centerZ;
+        std::vector<float> extentX, extentY, extentZ;
+        std::vector<unsigned char> visible;     // Result of the last frustum and occlusion tests
+        std::vector<unsigned char> occluders;   // Nodes rasterized into the software occlusion buffer
+        std::vector<unsigned char> shadowCasters; // SHADOW_CASTER_NONE, _STATIC or _DYNAMIC
+        bool staticShadowsChanged = true;       // A static caster moved since the shadow cache was built
+
+        // Draw data (mesh is nullptr for pure grouping nodes)
+        std::vector<const GLMesh*> meshes;
+        std::vector<GLuint> programs;
+        std::vector<GLuint> materials;      // Index into the material table, or MATERIAL_NONE
+    };
+
+    // One queued draw: the key packs program, VAO, texture and depth so that
+    // sorting by key groups draws sharing GL state and orders them front to back
+    struct DrawItem
+    {
+        uint64_t key;
+        uint32_t node;      // Scene node supplying material and world matrix
+        const GLMesh* mesh; // Level of detail of the node's mesh picked for this frame
+    };
+
+    // Draw items collected for the current frame (scratch is the radix sort ping-pong buffer)
+    struct RenderQueue
+    {
+        std::vector<DrawItem> items;
+        std::vector<DrawItem> scratch;
+        std::vector<DrawElementsIndirectCommand> commands;
+        std::vector<IndirectRange> ranges;
+    };
+
+    // Sort key layout, most significant bits first
+    const int SORT_PROGRAM_BITS = 10;
+    const int SORT_VAO_BITS = 10;
+    const int SORT_TEXTURE_BITS = 12;
+    const int SORT_MESH_BITS = 8;
+    const int SORT_DEPTH_BITS = 24;
+
+    // A linked shader program together with its active uniforms and uniform blocks,
+    // reflected once at link time so nothing is looked up by name while rendering
+    struct ShaderProgram
+    {
+        GLuint id = 0;
+        std::unordered_map<std::string, GLint> uniforms;   // Uniform name -> location
+        std::unordered_map<std::string, GLuint> blocks;    // Uniform block name -> block index
+        std::unordered_map<std::string, GLuint> storageBlocks; // Shader storage block name -> block index
+        GLuint vertexShader = 0;    // Held between UBeginShaderProgram and UFinishShaderProgram
+        GLuint fragmentShader = 0;
+    };
+
+    // One shader stage's source: its GLSL body and the shared chunks spliced in after the #version line
+    struct ShaderSource
+    {
+        const GLchar* body;
+        std::vector<const GLchar*> chunks;
+    };
+
+    // Camera and light data shared by every program through one std140 uniform buffer.
+    // Every member is a vec4 or mat4 so the C++ layout matches std140 without padding rules.
+    struct FrameData
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec4 viewPosition;     // xyz used
+        glm::vec4 lightPosition;    // xyz used
+        glm::vec4 lightColor;       // rgb used
+        glm::vec4 objectColor;      // rgb used
+        glm::vec4 uvScale;          // xy used
+        glm::vec4 clusterScale;     // xy = clusters per pixel, z/w = scale/bias mapping log(view depth) to a slice
+        glm::uvec4 clusterGrid;     // xyz = cluster counts, w = point light count
+        glm::mat4 lightViewProjection;  // Shadow map projection of the shadowed light
+        glm::vec4 shadowParams;     // x = shadowed light index, y = depth bias, z = shadow texel size, w = 1 when enabled
+    };
+
+    // Uniform buffer binding point of the FrameData block
+    const GLuint FRAME_DATA_BINDING = 0;
+
+    // Per-object data read by the vertex shader, laid out to match the std430 ObjectBuffer block
+    struct ObjectData
+    {
+        glm::mat4 model;
+        glm::mat4 normal;           // Only the upper 3x3 is read
+        glm::uvec4 material;        // x = texture array layer, y = wrap mode, z = material index, w = arena mesh id
+    };
+
+    // Shader storage binding point of the ObjectBuffer block
+    const GLuint OBJECT_DATA_BINDING = 1;
+
+    // Number of frames the CPU may run ahead of the GPU
+    const int FRAMES_IN_FLIGHT = 3;
+
+    // Persistently mapped ring of per-object data, split into one region per frame in flight.
+    // The CPU fills region N+1 while the GPU still reads region N; a fence per region keeps the
+    // CPU from overwriting data the GPU has not consumed yet.
+    struct ObjectRing
+    {
+        GLuint buffer = 0;
+        GLuint idBuffer = 0;                // Static 0..capacity-1 ramp feeding the objectId attribute
+        unsigned char* mapped = nullptr;    // Start of the persistent mapping
+        GLsizeiptr regionSize = 0;          // Bytes per frame region, rounded to the SSBO offset alignment
+        GLuint capacity = 0;                // Objects per frame region
+        GLsync fences[FRAMES_IN_FLIGHT] = {};
+        int region = 0;                     // Region written this frame
+    };
+
+    // Frustum and occlusion culling counters for the last frame
+    struct CullStats
+    {
+        size_t tested = 0;
+        size_t rejected = 0;
+        size_t occluded = 0;
+    };
+
+    // Fixed set of worker threads fed from a shared task queue
+    struct ThreadPool
+    {
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping = false;
+    };
+
+    // Assets decoded on the thread pool wait here for the GL thread. Each entry is the GL half of a load
+    // (an upload, or a failure report); UPumpAssetUploads runs them a few milliseconds per frame.
+    struct AssetLoader
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> uploads;
+        std::atomic<int> pending{ 0 };  // Submitted loads whose GL half has not run yet
+        double startTime = 0.0;
+    };
+
+    // Time each frame may spend uploading decoded assets
+    const double ASSET_UPLOAD_BUDGET = 0.004;
+
+    // Texture with its full mip chain, ready for upload: block-compressed when produced by the texture
+    // cooker (cooked once and cached on disk under the hash of the source file), RGBA8 otherwise.
+    struct TextureLevel
+    {
+        int width = 0;
+        int height = 0;
+        size_t offset = 0;      // Byte offset into CookedTexture::data
+        size_t size = 0;
+    };
+
+    struct CookedTexture
+    {
+        GLenum format = 0;      // GL_COMPRESSED_RGB_S3TC_DXT1_EXT, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT or GL_RGBA8
+        std::vector<TextureLevel> levels;
+        std::vector<unsigned char> data;
+    };
+
+    // KTX2 file header, followed by one KtxLevelIndex per mip level (all little-endian)
+    struct KtxHeader
+    {
+        unsigned char identifier[12];
+        uint32_t vkFormat;
+        uint32_t typeSize;
+        uint32_t pixelWidth;
+        uint32_t pixelHeight;
+        uint32_t pixelDepth;
+        uint32_t layerCount;
+        uint32_t faceCount;
+        uint32_t levelCount;
+        uint32_t supercompressionScheme;
+        uint32_t dfdByteOffset;
+        uint32_t dfdByteLength;
+        uint32_t kvdByteOffset;
+        uint32_t kvdByteLength;
+        uint64_t sgdByteOffset;
+        uint64_t sgdByteLength;
+    };
+    static_assert(sizeof(KtxHeader) == 80, "KTX2 header must match the file layout");
+
+    struct KtxLevelIndex
+    {
+        uint64_t byteOffset;
+        uint64_t byteLength;
+        uint64_t uncompressedByteLength;
+    };
+
+    const unsigned char KTX2_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    const uint32_t KTX_FORMAT_BC1_RGB = 131;    // VK_FORMAT_BC1_RGB_UNORM_BLOCK
+    const uint32_t KTX_FORMAT_BC3_RGBA = 137;   // VK_FORMAT_BC3_UNORM_BLOCK
+
+    // Cache files live next to the source images, named by the 64-bit hash of the source bytes
+    const char* const TEXTURE_CACHE_DIRECTORY = "../resources/textures/";
+    // Mixed into the hash; bump it whenever the encoder or the file layout changes
+    const uint64_t TEXTURE_COOK_VERSION = 3;
+    const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+    const uint64_t FNV_PRIME = 1099511628211ull;
+
+    // One level of an RGBA8 mip chain built on the CPU
+    struct ImageLevel
+    {
+        int width = 0;
+        int height = 0;
+        std::vector<unsigned char> pixels;
+    };
+
+    // Mip reduction filters. Both filter in linear light, so sRGB images do not darken as they shrink.
+    const int MIP_FILTER_BOX = 0;
+    const int MIP_FILTER_KAISER = 1;   // Kaiser-windowed sinc: sharper distant textures than the box
+    const int TEXTURE_MIP_FILTER = MIP_FILTER_KAISER;
+
+    // sRGB <-> linear conversion tables; linear values are quantized to 12 bits on the way back
+    const int SRGB_ENCODE_STEPS = 4096;
+    struct SrgbTables
+    {
+        float toLinear[256];
+        unsigned char toSrgb[SRGB_ENCODE_STEPS];
+    };
+
+    // Texture wrap modes a material can use. Layers of a texture array share one sampler, so the
+    // mode travels with the object data and the fragment shader applies it to the coordinate.
+    const GLuint MATERIAL_WRAP_REPEAT = 0;
+    const GLuint MATERIAL_WRAP_MIRRORED_REPEAT = 1;
+    const GLuint MATERIAL_WRAP_CLAMP_TO_EDGE = 2;
+    const GLuint MATERIAL_WRAP_CLAMP_TO_BORDER = 3;
+
+    // Material textures of one size and format share a GL_TEXTURE_2D_ARRAY, one layer per material,
+    // so a scene whose materials match draws with a single texture binding
+    struct MaterialArray
+    {
+        GLuint texture = 0;
+        GLenum format = 0;
+        GLsizei width = 0;
+        GLsizei height = 0;
+        GLsizei levels = 0;
+        GLsizei layerCount = 0;
+        GLsizei capacity = 0;   // Allocated layers; a full array is reallocated at twice the size
+        GLsizei droppedLevels = 0;  // Top mips released under the texture budget; storage starts at this level
+        uint64_t lastUsed = 0;      // TextureManager frame the array was last drawn in
+        bool restoring = false;     // Dropped levels are being reloaded
+        uint64_t retryFrame = 0;    // After a failed reload, no new attempt before this frame
+    };
+
+    struct Material
+    {
+        GLuint array = 0;       // Index into MaterialLibrary::arrays; array 0 is the loading placeholder
+        GLuint layer = 0;
+        GLuint wrapMode = MATERIAL_WRAP_REPEAT;
+        std::string file;       // Source image, reloaded when dropped levels come back
+    };
+
+    struct MaterialLibrary
+    {
+        std::vector<MaterialArray> arrays;
+        std::vector<Material> materials;
+    };
+
+    const GLsizei MATERIAL_ARRAY_INITIAL_LAYERS = 4;
+
+    // Texture memory accounting. Every texture is registered with the bytes of all its levels; over the
+    // budget (--texture-budget), material arrays not drawn for a while give up their top mip levels,
+    // least recently used first, and reload them from the texture cache once they are drawn again.
+    struct TextureRestore
+    {
+        GLuint array = 0;
+        std::vector<std::pair<GLuint, CookedTexture>> layers;     // Layer and its full mip chain
+        bool failed = false;
+    };
+
+    struct TextureManager
+    {
+        size_t budgetBytes = (size_t)512 << 20;
+        size_t residentBytes = 0;
+        size_t peakBytes = 0;
+        uint64_t frame = 0;
+        std::unordered_map<GLuint, size_t> textures;    // Texture name to bytes
+        size_t droppedLevels = 0;
+        size_t restoredLevels = 0;
+        std::mutex mutex;                               // Guards restores, filled by the thread pool
+        std::vector<TextureRestore> restores;
+    };
+
+    const uint64_t TEXTURE_IDLE_FRAMES = 30;        // Undrawn frames before an array may lose levels
+    const GLsizei TEXTURE_MIN_RESIDENT_SIZE = 64;   // Arrays keep their top level at least this large
+    const GLuint MATERIAL_NONE = 0xFFFFFFFFu;   // Nodes drawn without a texture (the lamp)
+
+    // The scene's material table; indices match MATERIAL_FILES
+    const GLuint MATERIAL_INNER_MONITOR = 0;
+    const GLuint MATERIAL_MONITOR = 1;
+    const GLuint MATERIAL_WOOD = 2;
+    const GLuint MATERIAL_FABRIC = 3;
+    const GLuint MATERIAL_KEYBOARD = 4;
+    const char* const MATERIAL_FILES[] = {
+        "../resources/textures/innermonitor.jpg",
+        "../resources/textures/monitor.jpg",
+        "../resources/textures/wood.jpg",
+        "../resources/textures/fabric.jpg",
+        "../resources/textures/keyboardt.jpg",
+    };
+    const GLuint MATERIAL_COUNT = sizeof(MATERIAL_FILES) / sizeof(MATERIAL_FILES[0]);
+
+    // Virtual texturing (--virtual-texturing). Each material's mip chain is cut into tiles on disk; a
+    // low-resolution feedback pass reports the tiles the screen samples and only those are streamed into
+    // a fixed physical atlas, so resident texture memory follows the screen instead of the materials.
+    const GLuint VT_TILE_SIZE = 128;           // Payload texels per tile side
+    const GLuint VT_TILE_BORDER = 1;           // Neighbour texels around the payload for bilinear filtering
+    const GLuint VT_SLOT_SIZE = VT_TILE_SIZE + 2 * VT_TILE_BORDER;
+    const size_t VT_TILE_BYTES = (size_t)VT_SLOT_SIZE * VT_SLOT_SIZE * 4;
+    const GLuint VT_ATLAS_SLOTS = 16;          // Atlas slots per side
+    const GLuint VT_MAX_LEVELS = 16;
+    const int VT_FEEDBACK_DIVISOR = 8;         // Feedback target is the window size over this
+    const size_t VT_MAX_UPLOADS_PER_FRAME = 16;
+    const uint32_t VT_NO_FEEDBACK = 0xFFFFFFFFu;
+    const char VT_TILE_FILE_MAGIC[4] = { 'V', 'T', 'E', 'X' };
+    const GLuint PAGE_TABLE_BINDING = 5;
+    const GLuint VIRTUAL_MATERIAL_BINDING = 6;
+    const GLuint VT_ATLAS_UNIT = 4;            // Texture unit of uPageAtlas, bound once at startup
+
+    // Tile file: this header, then every tile of every level, finest level first, rows top to bottom.
+    // A tile is VT_SLOT_SIZE squared RGBA8 texels, its border wrapping around the level's edges.
+    struct VirtualTileHeader
+    {
+        char magic[4];
+        uint32_t width;
+        uint32_t height;
+        uint32_t levelCount;
+    };
+
+    // Layout of one material's tiles, shared by the tile file and the page table
+    struct VirtualMaterial
+    {
+        std::string tileFile;
+        GLuint width = 0;
+        GLuint height = 0;
+        std::vector<glm::uvec2> levelTiles;     // Tiles per side of each level
+        std::vector<GLuint> levelFirstTile;     // Index of each level's first tile in the file
+        GLuint tileCount = 0;
+        GLuint firstEntry = 0;                  // Offset of the material's tiles in the page table
+        bool registered = false;
+    };
+
+    // Per-material lookup data for the shaders, same layout as the VirtualMaterialBuffer block
+    struct VirtualMaterialData
+    {
+        glm::uvec4 size;                        // x, y = texels, z = level count (0 until registered)
+        glm::uvec4 levels[VT_MAX_LEVELS];       // x = first page table entry, y, z = tiles per side
+    };
+
+    struct VirtualPage
+    {
+        uint32_t tile = VT_NO_FEEDBACK;         // Key of the tile in this atlas slot
+        uint64_t lastUsed = 0;                  // Feedback generation that last needed it
+        bool pinned = false;                    // A material's coarsest tile, never evicted
+    };
+
+    struct VirtualTileRequest
+    {
+        uint32_t tile;
+        std::string file;
+        GLuint index;                           // Tile index in the file
+    };
+
+    struct LoadedTile
+    {
+        uint32_t tile;
+        std::vector<unsigned char> pixels;      // Empty when the read failed
+    };
+
+    struct VirtualTexturing
+    {
+        GLuint atlas = 0;
+        GLuint pageTableBuffer = 0;
+        GLuint materialBuffer = 0;
+        GLuint feedbackFbo = 0;
+        GLuint feedbackColor = 0;
+        GLuint feedbackDepth = 0;
+        int feedbackWidth = 0;
+        int feedbackHeight = 0;
+        GLuint readbackBuffers[FRAMES_IN_FLIGHT] = {};
+        GLsync readbackFences[FRAMES_IN_FLIGHT] = {};
+        int readbackSlot = 0;                   // Next slot to read back into; also the oldest pending one
+        uint64_t generation = 0;                // Feedback buffers processed so far
+        std::vector<VirtualMaterial> materials;
+        std::vector<VirtualMaterialData> materialData;
+        std::vector<GLuint> pageTable;          // CPU copy: slot x | slot y << 8 | resident level << 16
+        std::vector<VirtualPage> pages;         // One per atlas slot
+        std::unordered_map<uint32_t, GLuint> residentTiles;    // Tile key to atlas slot
+        std::unordered_set<uint32_t> requestedTiles;          // Streaming or waiting for upload
+        std::vector<bool> dirtyMaterials;       // Page table entries out of date
+        std::mutex mutex;                       // Guards loadedTiles, filled by the streaming tasks
+        std::vector<LoadedTile> loadedTiles;
+        size_t uploads = 0;
+        size_t evictions = 0;
+    };
+
+    // Low-resolution CPU depth buffer of the designated occluders and its hierarchical-Z pyramid.
+    // Level 0 holds the nearest occluder depth per pixel; each further level holds the farthest
+    // depth of the 2x2 texels below it, so a box nearer than a HiZ texel may be visible.
+    struct OcclusionBuffer
+    {
+        std::vector<std::vector<float>> levels;     // levels[0] is OCCLUSION_WIDTH x OCCLUSION_HEIGHT
+        std::vector<glm::ivec2> levelSizes;
+        std::vector<glm::vec3> triangles;           // Screen-space occluder vertices (x, y in pixels, z in [0,1])
+        std::vector<std::vector<uint32_t>> tileBins; // Triangle indices overlapping each tile
+    };
+
+    const int OCCLUSION_WIDTH = 256;
+    const int OCCLUSION_HEIGHT = 192;
+    const int OCCLUSION_TILE_SIZE = 64;
+
+    // Camera clip planes, shared by the projection and the light clusters
+    const float NEAR_PLANE = 0.1f;
+    const float FAR_PLANE = 100.0f;
+
+    // Point light as read by the fragment shader (std430)
+    struct PointLight
+    {
+        glm::vec4 positionRadius;   // xyz = world position, w = radius of influence
+        glm::vec4 color;            // rgb = color, a = intensity
+    };
+
+    // Clustered light assignment: the view frustum is split into a screen-tile grid with logarithmic
+    // depth slices, and each cluster stores the lights whose sphere of influence overlaps it
+    struct LightClusters
+    {
+        GLuint buffers[3] = {};                 // Lights, per-cluster (offset, count), light indices
+        glm::mat4 projection;                   // Projection the cluster bounds were built for
+        std::vector<glm::vec3> boundsMin;       // View-space AABB of each cluster
+        std::vector<glm::vec3> boundsMax;
+        std::vector<glm::vec4> viewLights;      // xyz = view-space position, w = radius
+        std::vector<GLuint> counts;             // Lights per cluster, filled in parallel
+        std::vector<GLuint> slots;              // MAX_LIGHTS_PER_CLUSTER entries per cluster
+        std::vector<GLuint> grid;               // Compacted (offset, count) per cluster
+        std::vector<GLuint> indices;            // Compacted light indices
+    };
+
+    const int CLUSTER_COUNT_X = 16;
+    const int CLUSTER_COUNT_Y = 9;
+    const int CLUSTER_COUNT_Z = 24;
+    const int MAX_LIGHTS_PER_CLUSTER = 64;
+
+    // Shader storage binding points of the clustered lighting blocks
+    const GLuint LIGHT_DATA_BINDING = 2;
+    const GLuint CLUSTER_DATA_BINDING = 3;
+    const GLuint LIGHT_INDEX_BINDING = 4;
+
+    // How a node takes part in shadow rendering
+    const unsigned char SHADOW_CASTER_NONE = 0;
+    const unsigned char SHADOW_CASTER_STATIC = 1;     // Rendered into the cached map
+    const unsigned char SHADOW_CASTER_DYNAMIC = 2;    // Rendered on top of the cached map every frame
+
+    const int SHADOW_MAP_SIZE = 1024;
+    const int SHADOW_CACHE_SLOTS = 24;
+    const int SHADOW_ORBIT_STEPS = 24;         // Orbit positions the lamp's shadow snaps to, one cache slot each
+    const GLuint SHADOW_MAP_UNIT = 3;          // Texture unit of uShadowMap in the lit programs
+
+    // One cached static-caster depth map, keyed by the quantized light position it was rendered from
+    struct ShadowCacheSlot
+    {
+        GLuint texture = 0;
+        uint64_t key = 0;
+        uint64_t lastUsed = 0;
+        bool valid = false;
+    };
+
+    // Shadow maps of the lamp light. Static casters are rendered once per light position into a cache
+    // slot; when dynamic casters exist, the slot is copied into the composite map and they are drawn on top.
+    struct ShadowMaps
+    {
+        GLuint fbo = 0;
+        GLuint composite = 0;
+        GLuint objectBuffer = 0;            // Caster model matrices, separate from the per-frame object ring
+        ShadowCacheSlot slots[SHADOW_CACHE_SLOTS];
+        uint64_t frame = 0;
+        glm::mat4 lightViewProjection;
+        GLuint current = 0;                 // Map sampled by the lit programs this frame
+        size_t staticRenders = 0;
+        size_t cacheHits = 0;
+    };
+
+    // Deferred shading targets: albedo, octahedral-encoded normal and depth, 12 bytes per pixel
+    struct GBuffer
+    {
+        GLuint fbo = 0;
+        GLuint albedo = 0;      // RGBA8
+        GLuint normal = 0;      // RG16_SNORM, octahedral
+        GLuint depth = 0;       // DEPTH24_STENCIL8, matches the default framebuffer for the depth blit
+        int width = 0;
+        int height = 0;
     };
 
     // Main GLFW window
     GLFWwindow* gWindow = nullptr;
+
+    // Headless mode (--headless): a surfaceless EGL context renders into an offscreen framebuffer
+    // for a fixed number of frames (--frames) or seconds (--seconds), then exits
+    struct HeadlessContext
+    {
+#if defined(__linux__)
+        EGLDisplay display = EGL_NO_DISPLAY;
+        EGLContext context = EGL_NO_CONTEXT;
+#endif
+        GLuint fbo = 0;
+        GLuint color = 0;
+        GLuint depth = 0;
+    };
+
+    bool gHeadless = false;
+    bool gImageBenchmark = false;   // --image-benchmark: time the texture image kernels and exit
+    int gFrameLimit = 120;              // Frames rendered by headless and benchmark runs
+    double gHeadlessSeconds = 0.0;      // Overrides the frame count when positive
+    std::string gHeadlessOutput;        // PPM file receiving the last frame, if set
+    HeadlessContext gHeadlessContext;
+
+    // Framebuffer that final passes render to: the window's, or the headless target
+    GLuint gOutputFramebuffer = 0;
+
+    // One camera sample of a recorded path
+    struct CameraKeyframe
+    {
+        float time;
+        glm::vec3 position;
+        glm::vec3 front;
+        float zoom;
+    };
+
+    // Benchmark mode (--benchmark): the camera follows a recorded (--camera-path) or scripted path with a
+    // fixed time step for gFrameLimit frames. CPU render time and GPU frame time are collected per frame.
+    // GPU times come from timestamp pairs read back BENCHMARK_QUERY_LATENCY frames later, so the
+    // measurement never waits on the GPU.
+    const int BENCHMARK_QUERY_LATENCY = FRAMES_IN_FLIGHT + 1;
+    const int BENCHMARK_WARMUP_FRAMES = 10;
+    const float BENCHMARK_TIME_STEP = 1.0f / 60.0f;
+
+    struct Benchmark
+    {
+        bool enabled = false;
+        std::string pathFile;                   // Recorded camera path to replay; empty = scripted orbit
+        std::string reportFile = "benchmark.json";
+        std::vector<CameraKeyframe> path;
+        std::vector<double> cpuMilliseconds;
+        std::vector<double> gpuMilliseconds;
+        GLuint queries[BENCHMARK_QUERY_LATENCY][2] = {};    // Start and end timestamps per slot
+        int frame = 0;
+    };
+    Benchmark gBenchmark;
+
+    // GPU pass timing. Each named scope owns a GL_TIME_ELAPSED query and, where
+    // ARB_pipeline_statistics_query exists, one query per statistic. Query sets alternate between
+    // frames and are read back GPU_QUERY_FRAMES frames later only if already available, so the CPU
+    // never waits on them.
+    const int GPU_QUERY_FRAMES = 2;
+    const int GPU_MAX_SCOPES = 16;
+    const int GPU_TRACE_HISTORY = 4096;    // Resolved scopes kept for trace export
+    const int PIPELINE_STATISTIC_COUNT = 4;
+    const GLenum PIPELINE_STATISTIC_TARGETS[PIPELINE_STATISTIC_COUNT] = {
+        GL_VERTICES_SUBMITTED_ARB,
+        GL_PRIMITIVES_SUBMITTED_ARB,
+        GL_VERTEX_SHADER_INVOCATIONS_ARB,
+        GL_FRAGMENT_SHADER_INVOCATIONS_ARB,
+    };
+    const char* const PIPELINE_STATISTIC_NAMES[PIPELINE_STATISTIC_COUNT] = {
+        "vertices", "primitives", "vertexInvocations", "fragmentInvocations",
+    };
+
+    struct GpuScopeQueries
+    {
+        const char* name = nullptr;
+        GLuint timer = 0;
+        GLuint statistics[PIPELINE_STATISTIC_COUNT] = {};
+        double cpuBegin = 0.0;      // Trace clock, microseconds
+        double cpuEnd = 0.0;
+        uint64_t frame = 0;
+    };
+
+    struct GpuScopeResult
+    {
+        const char* name;
+        uint64_t frame;
+        double cpuBegin;            // Trace clock, microseconds
+        double cpuMicroseconds;
+        double gpuMicroseconds;
+        GLuint64 statistics[PIPELINE_STATISTIC_COUNT];
+    };
+
+    struct GpuProfiler
+    {
+        bool statisticsSupported = false;
+        GpuScopeQueries scopes[GPU_QUERY_FRAMES][GPU_MAX_SCOPES];
+        int scopeCount[GPU_QUERY_FRAMES] = {};
+        int open = -1;              // Scope currently recording, scopes cannot nest
+        uint64_t frame = 0;
+        size_t dropped = 0;         // Results not yet available when their set was reused
+        std::deque<GpuScopeResult> history;
+        std::vector<GpuScopeResult> lastFrame;
+    };
+    GpuProfiler gGpuProfiler;
+
+#if ENABLE_PROFILING
+    // CPU profiling. Each thread records zones into its own ring: only the owning thread writes and it
+    // publishes with a release store of the event count, so recording takes no locks. A flush copies the
+    // newest events of every ring and drops any the owner may have overwritten during the copy.
+    const uint64_t PROFILE_RING_SIZE = 16384;  // Power of two
+
+    struct ProfileEvent
+    {
+        const char* name;
+        double begin;               // Trace clock, microseconds
+        double end;
+    };
+
+    struct ProfileThreadBuffer
+    {
+        ProfileEvent events[PROFILE_RING_SIZE];
+        std::atomic<uint64_t> written{ 0 };
+        int id = 0;
+        const char* name = "Thread";
+    };
+
+    // Rings outlive their threads so a flush still sees the events of finished workers
+    struct ProfileRegistry
+    {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ProfileThreadBuffer>> threads;
+    };
+    ProfileRegistry gProfileRegistry;
+
+    // Records the enclosing scope as one event; see PROFILE_ZONE
+    struct ProfileZone
+    {
+        explicit ProfileZone(const char* zoneName);
+        ~ProfileZone();
+
+        const char* name;
+        double begin;
+    };
+#endif
+    std::string gTraceFile = "trace.json";     // F9 and --trace write here
+    bool gTraceOnExit = false;
+
+    // Interactive runs can record the camera for later benchmarks (--record-camera)
+    std::ofstream gCameraRecording;
+    // Shared storage for all mesh geometry
+    MeshArena gMeshArena;
     // Triangle mesh data
     GLMesh gMesh;
     GLMesh gPlaneMesh;
     GLMesh gBoxMesh;
 	GLMesh gSphereMesh;
     // Texture id
-    GLuint gTextureId;
-    GLuint gTextureId2;
-    GLuint gTextureId3;
-    GLuint gTextureId4;
-    GLuint gTextureId5;
+    MaterialLibrary gMaterials;
+    TextureManager gTextureManager;
     glm::vec2 gUVScale(1.0f, 1.0f);
     GLint gTexWrapMode = GL_REPEAT;
 
     // Shader program
-    GLuint gProgramId;
-    GLuint gLampProgramId;
+    ShaderProgram gProgram;
+    ShaderProgram gLampProgram;
+
+    // Per-frame uniform buffer backing the FrameData block
+    GLuint gFrameUniformBuffer = 0;
 
     // camera
     Camera gCamera(glm::vec3(0.0f, 0.0f, 3.0f));
@@ -77,6 +872,59 @@ namespace
     glm::vec3 gLightPosition(-1.0f, 0.5f, 1.0f);
     glm::vec3 gLightScale(0.4);
 
+    // Point lights and their cluster assignment; the desk lamp is one of them
+    std::vector<PointLight> gPointLights;
+    int gLampLight = -1;
+    LightClusters gLightClusters;
+
+    // Render path chosen at startup with --deferred
+    bool gDeferredShading = false;
+
+    // The GPU arena holds 16-byte quantized vertices instead of 32-byte float ones (--compact-vertices)
+    bool gCompactVertices = false;
+
+    // Materials stream through the virtual texture atlas instead of texture arrays (--virtual-texturing)
+    bool gVirtualTexturing = false;
+    VirtualTexturing gVirtualTextures;
+    ShaderProgram gFeedbackProgram;
+
+    // Shadows of the lamp light
+    ShadowMaps gShadowMaps;
+    ShaderProgram gShadowProgram;
+    const glm::vec3 SHADOW_TARGET(0.0f, -0.5f, 0.3f);  // Desk surface center, where the shadow frustum points
+
+    // Lamp orbit around the Y axis, toggled with L
+    bool gIsLampOrbiting = false;
+    float gLampOrbitAngle = 0.0f;
+    glm::vec3 gLampOrbitOrigin;         // Lamp position at orbit angle 0
+    GBuffer gGBuffer;
+    ShaderProgram gDeferredLightingProgram;
+    GLuint gFullscreenVao = 0;  // Attribute-less VAO for the full-screen triangle
+
+    // Scene graph and the node that tracks the light position
+    SceneNodes gScene;
+    int gLampNode = -1;
+
+    // Per-frame draw submissions
+    RenderQueue gRenderQueue;
+    CullStats gCullStats;
+
+    // Worker threads shared by CPU-side frame work
+    ThreadPool gThreadPool;
+    AssetLoader gAssetLoader;
+
+    // Software occlusion culling
+    OcclusionBuffer gOcclusionBuffer;
+    bool gOcclusionCulling = true;
+
+    // Per-object data ring; the arena VAO's objectId attribute (location 3) indexes into it
+    ObjectRing gObjectRing;
+    const GLuint OBJECT_ID_LOCATION = 3;
+    const GLuint INITIAL_OBJECT_CAPACITY = 1024;
+
+    // Indirect draw commands for the frame, rebuilt by USubmitRenderQueue
+    GLuint gIndirectBuffer = 0;
+
 	bool isPerspective = true;
 }
 
@@ -86,6 +934,29 @@ namespace
  * and render graphics on the screen
  */
 bool UInitialize(int, char* [], GLFWwindow** window);
+void UParseCommandLine(int argc, char* argv[]);
+bool UInitializeHeadless(HeadlessContext& headless);
+void UDestroyHeadless(HeadlessContext& headless);
+bool USaveFramebuffer(const std::string& path, int width, int height);
+void UGetFramebufferSize(int& width, int& height);
+double UGetTime();
+bool ULoadCameraPath(const std::string& path, std::vector<CameraKeyframe>& keyframes);
+void URecordCamera(std::ofstream& recording, float time);
+void UApplyBenchmarkCamera(const Benchmark& benchmark, int frame);
+void URunBenchmarkFrame(Benchmark& benchmark);
+void UFinishBenchmark(Benchmark& benchmark);
+double UGetTraceMicroseconds();
+#if ENABLE_PROFILING
+ProfileThreadBuffer* UGetProfileThreadBuffer();
+void USetProfileThreadName(const char* name);
+void URecordProfileEvent(const char* name, double begin, double end);
+#endif
+void UCreateGpuProfiler(GpuProfiler& profiler);
+void UDestroyGpuProfiler(GpuProfiler& profiler);
+void UBeginGpuFrame(GpuProfiler& profiler);
+void UBeginGpuScope(GpuProfiler& profiler, const char* name);
+void UEndGpuScope(GpuProfiler& profiler);
+bool UWriteChromeTrace(const std::string& path, const GpuProfiler& profiler);
 void UResizeWindow(GLFWwindow* window, int width, int height);
 void UProcessInput(GLFWwindow* window);
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
@@ -95,86 +966,406 @@ void UCreateBoxMesh(GLMesh& mesh);
 void UCreateSphereMesh(GLMesh& mesh);
 void UCreatePyramidMesh(GLMesh& mesh);
 void UCreatePlaneMesh(GLMesh& mesh);
-void UDestroyMesh(GLMesh& mesh);
+void UAddMeshToArena(MeshArena& arena, const GLfloat* verts, GLuint vertexCount, const GLuint* indices, GLuint indexCount, GLMesh& mesh);
+void UAddGeneratedMesh(const std::vector<GLfloat>& verts, const std::vector<GLuint>& indices, GLMesh& mesh);
+GLfloat* UWriteVertex(GLfloat* out, const glm::vec3& position, const glm::vec3& normal, float u, float v);
+void UWriteGrid(const glm::vec3& origin, const glm::vec3& uAxis, const glm::vec3& vAxis, const glm::vec3& normal, int segments,
+    GLuint baseVertex, GLfloat*& vertex, GLuint*& index);
+void UGenerateUVSphere(int slices, int stacks, std::vector<GLfloat>& verts, std::vector<GLuint>& indices);
+void UGenerateIcosphere(int subdivisions, std::vector<GLfloat>& verts, std::vector<GLuint>& indices);
+void UGenerateBox(int segments, std::vector<GLfloat>& verts, std::vector<GLuint>& indices);
+void UGeneratePlane(int segments, std::vector<GLfloat>& verts, std::vector<GLuint>& indices);
+void UGeneratePyramid(int sides, std::vector<GLfloat>& verts, std::vector<GLuint>& indices);
+size_t UCountDegenerateTriangles(const std::vector<GLfloat>& verts, const std::vector<GLuint>& indices);
+const GLMesh* USelectMeshLod(const GLMesh& mesh, float pixels);
+void UUploadMeshArena(MeshArena& arena);
+void UDestroyMeshArena(MeshArena& arena);
+uint16_t UFloatToHalf(float value);
+glm::vec2 UOctahedralEncode(const glm::vec3& normal);
+size_t USimulateVertexCache(const GLuint* indices, size_t indexCount, GLuint vertexCount);
+void UTipsifyIndices(const GLuint* indices, size_t indexCount, GLuint vertexCount, std::vector<GLuint>& out, std::vector<size_t>& hardBoundaries);
+void UOrderClustersForOverdraw(const GLfloat* verts, GLuint vertexCount, std::vector<GLuint>& indices, const std::vector<size_t>& hardBoundaries);
+void UReorderVertexFetch(std::vector<GLfloat>& verts, std::vector<GLuint>& indices);
+void UOptimizeMesh(std::vector<GLfloat>& verts, std::vector<GLuint>& indices);
+void UQuantizeVertices(const GLfloat* verts, GLuint vertexCount, const glm::vec3& boundsMin, const glm::vec3& boundsMax, CompactVertex* out);
+int UAddSceneNode(SceneNodes& nodes, int parent, const GLMesh* mesh, GLuint programId, GLuint material,
+    const glm::vec3& position, float angle, const glm::vec3& axis, const glm::vec3& scale);
+void USetNodePosition(SceneNodes& nodes, int node, const glm::vec3& position);
+void UUpdateSceneTransforms(SceneNodes& nodes);
+void UComputeNormalMatrices(const glm::mat4* worldMatrices, glm::mat4* normalMatrices, const int* nodes, size_t count);
+void UExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6]);
+void UCullScene(SceneNodes& nodes, const glm::mat4& viewProjection, CullStats& stats);
+void USetNodeOccluder(SceneNodes& nodes, int node, bool occluder);
+void USetNodeShadowCaster(SceneNodes& nodes, int node, unsigned char mode);
+bool UCreateShadowMaps(ShadowMaps& shadows);
+void UDestroyShadowMaps(ShadowMaps& shadows);
+void UDrawShadowCasters(ShadowMaps& shadows, const SceneNodes& nodes, unsigned char mode);
+void URenderShadows(ShadowMaps& shadows, SceneNodes& nodes, const glm::vec3& lightPosition);
+void UStartThreadPool(ThreadPool& pool, unsigned workerCount);
+void USubmitTask(ThreadPool& pool, std::function<void()> task);
+void UParallelFor(ThreadPool& pool, size_t count, const std::function<void(size_t)>& body);
+void UStopThreadPool(ThreadPool& pool);
+void URasterizeOccluders(OcclusionBuffer& buffer, const SceneNodes& nodes, const glm::mat4& viewProjection);
+bool UIsBoxOccluded(const OcclusionBuffer& buffer, const glm::vec3& center, const glm::vec3& extent, const glm::mat4& viewProjection);
+void UOcclusionCullScene(SceneNodes& nodes, const glm::mat4& viewProjection, CullStats& stats);
+void UCreateScene(SceneNodes& nodes);
+uint64_t UMakeSortKey(GLuint programId, GLuint vao, GLuint textureId, GLuint meshId, float depth);
+void UBuildRenderQueue(RenderQueue& queue, const SceneNodes& nodes, const glm::vec3& cameraPosition, float farPlane, const glm::mat4& projection);
+void USortRenderQueue(RenderQueue& queue);
+void UCreateObjectRing(ObjectRing& ring, GLuint capacity);
+void UReserveObjectRing(ObjectRing& ring, GLuint count);
+void UBindObjectIdAttribute(const ObjectRing& ring, GLuint vao);
+ObjectData* UBeginObjectRingFrame(ObjectRing& ring);
+void UEndObjectRingFrame(ObjectRing& ring);
+void UDestroyObjectRing(ObjectRing& ring);
+void UCreateIndirectBuffer();
+void UPrepareRenderQueue(RenderQueue& queue, const SceneNodes& nodes);
+void UDrawRenderQueue(const RenderQueue& queue, GLuint programId);
+bool UCreateGBuffer(GBuffer& gbuffer, int width, int height);
+void UDestroyGBuffer(GBuffer& gbuffer);
+void URenderDeferred(const glm::mat4& viewProjection);
+void UReportFrameTime(float deltaTime);
 bool UCreateTexture(const char* filename, GLuint& textureId);
+bool ULoadTextureData(const std::string& filename, CookedTexture& texture);
+void UCreateMaterialLibrary(MaterialLibrary& library, GLuint materialCount);
+void UResizeMaterialArray(MaterialArray& array, GLsizei capacity, GLsizei droppedLevels);
+void UUploadMaterialLevels(const MaterialArray& array, GLint layer, const CookedTexture& texture, GLsizei firstLevel, GLsizei endLevel);
+void UAddMaterialLayer(MaterialLibrary& library, GLuint material, const CookedTexture& texture);
+GLuint UGetMaterialTexture(const MaterialLibrary& library, GLuint material);
+void UCreateMaterialAsync(AssetLoader& loader, MaterialLibrary& library, GLuint material, const char* filename);
+void UDestroyMaterialLibrary(MaterialLibrary& library);
+uint32_t UMakeVirtualTileKey(GLuint material, GLuint level, GLuint tileX, GLuint tileY);
+void UComputeVirtualLayout(VirtualMaterial& material, GLuint width, GLuint height);
+bool UCookVirtualTexture(const std::string& filename, VirtualMaterial& material);
+bool UReadVirtualTile(std::ifstream& file, GLuint tileIndex, std::vector<unsigned char>& pixels);
+void UCreateVirtualTexturing(VirtualTexturing& vt, GLuint materialCount);
+bool UCreateVirtualFeedback(VirtualTexturing& vt, int width, int height);
+void UCreateVirtualMaterialAsync(AssetLoader& loader, VirtualTexturing& vt, GLuint material, const char* filename);
+void URegisterVirtualMaterial(VirtualTexturing& vt, GLuint material, const VirtualMaterial& layout, const unsigned char* rootTile);
+int UAllocateVirtualPage(VirtualTexturing& vt);
+void UPlaceVirtualTile(VirtualTexturing& vt, uint32_t tile, int slot, const unsigned char* pixels, bool pinned);
+void URefreshPageTable(VirtualTexturing& vt, GLuint material);
+void URenderVirtualFeedback(VirtualTexturing& vt, const RenderQueue& queue);
+void UProcessVirtualFeedback(VirtualTexturing& vt, const GLuint* feedback, size_t count);
+void UUpdateVirtualTexturing(VirtualTexturing& vt);
+void UDestroyVirtualTexturing(VirtualTexturing& vt);
+void UPumpAssetUploads(AssetLoader& loader, double budgetSeconds);
+void UFinishAssetLoads(AssetLoader& loader);
+uint64_t UHashBytes(const unsigned char* bytes, size_t size, uint64_t hash);
+bool UReadFile(const std::string& path, std::vector<unsigned char>& bytes);
+void UEncodeBC1Block(const unsigned char* block, unsigned char* out);
+void UEncodeBC3Block(const unsigned char* block, unsigned char* out);
+void UCookTexture(const unsigned char* pixels, int width, int height, int channels, CookedTexture& cooked);
+bool USaveTextureCache(const std::string& path, const CookedTexture& cooked);
+bool ULoadTextureCache(const std::string& path, CookedTexture& cooked);
+std::string UTextureCachePath(const std::vector<unsigned char>& source, const char* extension);
+bool UCookTextureFile(const std::string& filename, CookedTexture& cooked);
+void UUploadCookedTexture(GLuint textureId, const CookedTexture& cooked);
+void UFlipImageBytewise(unsigned char* image, int width, int height, int channels);
+void UExpandRGBToRGBA(const unsigned char* rgb, unsigned char* rgba, size_t pixelCount);
+void UPremultiplyAlpha(unsigned char* rgba, size_t pixelCount);
+const SrgbTables& UGetSrgbTables();
+void UImageToLinear(const unsigned char* rgba, size_t pixelCount, float* linear);
+void ULinearToImage(const float* linear, size_t pixelCount, unsigned char* rgba);
+void UDownsampleLinear(const std::vector<float>& source, int width, int height, int filter, std::vector<float>& destination);
+void UBuildMipChain(const unsigned char* pixels, int width, int height, int channels, int filter, std::vector<ImageLevel>& levels);
+void UBenchmarkImageKernels();
+size_t UTextureBytes(GLenum format, GLsizei width, GLsizei height, GLsizei layers, GLsizei levels);
+void UTrackTexture(TextureManager& manager, GLuint texture, size_t bytes);
+void UUntrackTexture(TextureManager& manager, GLuint texture);
+bool UShedTextureLevels(TextureManager& manager, MaterialLibrary& library, size_t targetBytes);
+void URequestTextureRestore(TextureManager& manager, MaterialLibrary& library, GLuint index);
+void UApplyTextureRestore(TextureManager& manager, MaterialLibrary& library, const TextureRestore& restore);
+void UUpdateTextureBudget(TextureManager& manager, MaterialLibrary& library);
 void UDestroyTexture(GLuint textureId);
 void URender();
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
-void UDestroyShaderProgram(GLuint programId);
+void UBeginShaderProgram(const ShaderSource& vertexSource, const ShaderSource& fragmentSource, ShaderProgram& program);
+void UShaderSource(GLuint shader, const ShaderSource& source);
+bool UFinishShaderProgram(ShaderProgram& program);
+void UReflectShaderProgram(ShaderProgram& program);
+GLint UGetUniformLocation(const ShaderProgram& program, const std::string& name);
+void UDestroyShaderProgram(ShaderProgram& program);
+void UCreateFrameUniformBuffer();
+void UUpdateFrameUniforms(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightPosition);
+int UAddPointLight(const glm::vec3& position, const glm::vec3& color, float intensity, float radius);
+void UCreateLightClusters(LightClusters& clusters);
+void UBuildClusterBounds(LightClusters& clusters, const glm::mat4& projection);
+void UAssignLightsToClusters(LightClusters& clusters, const std::vector<PointLight>& lights, const glm::mat4& view, const glm::mat4& projection);
+void UDestroyLightClusters(LightClusters& clusters);
+
+
+// Shader code shared between programs. UBeginShaderProgram splices the chunks a shader lists right after
+// its #version line, in the order given, so every program compiles the same declarations.
+
+// Per-frame camera, light and shadow data, filled by UUpdateFrameUniforms
+const GLchar* frameDataShaderChunk = GLSL_CHUNK(
+    layout(std140) uniform FrameData
+    {
+        mat4 view;
+        mat4 projection;
+        vec4 viewPosition;
+        vec4 lightPos;
+        vec4 lightColor;
+        vec4 objectColor;
+        vec4 uvScale;
+        vec4 clusterScale;
+        uvec4 clusterGrid;
+        mat4 lightViewProjection;
+        vec4 shadowParams;
+    };
+);
 
+// Per-object matrices and material, and the per-mesh dequantization of the arena positions
+const GLchar* objectDataShaderChunk = GLSL_CHUNK(
+    // Per-object data written by the CPU into the persistently mapped ring or the shadow caster buffer
+    struct ObjectData
+    {
+        mat4 model;
+        mat4 normal;
+        uvec4 material;
+    };
+    layout(std430) readonly buffer ObjectBuffer
+    {
+        ObjectData objects[];
+    };
 
-/* Vertex Shader Source Code*/
-const GLchar* vertexShaderSource = GLSL(440,
+    // Per-mesh dequantization of the arena positions
+    struct MeshData
+    {
+        vec4 offset;
+        vec4 scale;
+    };
+    layout(std430) readonly buffer MeshBuffer
+    {
+        MeshData meshes[];
+    };
+);
 
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-    layout(location = 1) in vec3 normal; // VAP position 1 for normals
-    layout(location = 2) in vec2 textureCoordinate;
+// Octahedral normal packing used by the G-buffer and the compact vertex format
+const GLchar* octahedralShaderChunk = GLSL_CHUNK(
+    // Folds the unit sphere onto an octahedron and unfolds it into the [-1, 1] square
+    vec2 octEncode(vec3 n)
+    {
+        n /= abs(n.x) + abs(n.y) + abs(n.z);
+        vec2 signs = vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+        return n.z >= 0.0f ? n.xy : (1.0f - abs(n.yx)) * signs;
+    }
 
-    out vec3 vertexNormal; // For outgoing normals to fragment shader
-    out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
-    out vec2 vertexTextureCoordinate;
+    // Inverse of octEncode
+    vec3 octDecode(vec2 e)
+    {
+        vec3 n = vec3(e.xy, 1.0f - abs(e.x) - abs(e.y));
+        vec2 signs = vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+        n.xy = n.z >= 0.0f ? n.xy : (1.0f - abs(n.yx)) * signs;
+        return normalize(n);
+    }
+);
 
-    //Uniform / Global variables for the  transform matrices
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+// Material sampling from the texture arrays or the virtual texture atlas. Needs the frame data.
+const GLchar* materialShaderChunk = GLSL_CHUNK(
+    flat in uvec3 vertexMaterial; // Texture array layer, wrap mode and material index
+    uniform sampler2DArray uTexture;
 
-    void main()
+    // Virtual texturing: the page table maps every tile of a material's mip chain to the atlas slot
+    // holding it, or to the slot of its finest resident ancestor until it streams in
+    uniform bool uVirtualTexturing;
+    uniform sampler2D uPageAtlas;
+    struct VirtualMaterial
     {
-        gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-
-        vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+        uvec4 size; // x, y = texels, z = level count (0 until registered)
+        uvec4 levels[16]; // x = first page table entry, y, z = tiles per side
+    };
+    layout(std430) readonly buffer VirtualMaterialBuffer
+    {
+        VirtualMaterial virtualMaterials[];
+    };
+    layout(std430) readonly buffer PageTableBuffer
+    {
+        uint pageTable[]; // slot x | slot y << 8 | resident level << 16
+    };
 
-        vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-        vertexTextureCoordinate = textureCoordinate;
+    // Samples the finest resident tile at the level the texel footprint asks for. Tiles hold 128 texels
+    // plus a one-texel border in 130-texel atlas slots.
+    vec4 sampleVirtual(vec2 uv, vec2 uvDx, vec2 uvDy)
+    {
+        uint material = vertexMaterial.z;
+        uvec4 size = virtualMaterials[material].size;
+        if (size.z == 0u)
+            return vec4(0.5f, 0.5f, 0.5f, 1.0f); // Still cooking
+
+        vec2 texel = fract(uv) * vec2(size.xy);
+        vec2 texelDx = uvDx * vec2(size.xy);
+        vec2 texelDy = uvDy * vec2(size.xy);
+        float lod = 0.5f * log2(max(max(dot(texelDx, texelDx), dot(texelDy, texelDy)), 1e-8f));
+        uint level = uint(clamp(lod, 0.0f, float(size.z - 1u)));
+        uvec4 info = virtualMaterials[material].levels[level];
+        uvec2 tile = min(uvec2(texel / float(128u << level)), info.yz - 1u);
+
+        uint entry = pageTable[info.x + tile.y * info.y + tile.x];
+        uint resident = entry >> 16u;
+        uvec4 residentInfo = virtualMaterials[material].levels[resident];
+        vec2 residentTexel = texel / float(1u << resident);
+        vec2 inTile = residentTexel - vec2(min(uvec2(residentTexel / 128.0f), residentInfo.yz - 1u)) * 128.0f;
+        vec2 atlasTexel = vec2(uvec2(entry & 0xFFu, (entry >> 8u) & 0xFFu)) * 130.0f + 1.0f + inTile;
+        return textureLod(uPageAtlas, atlasTexel / vec2(textureSize(uPageAtlas, 0)), 0.0f);
     }
-);
 
+    // Layers share one sampler, so each material's wrap mode is applied to the coordinate here
+    vec4 sampleMaterial(vec2 uv)
+    {
+        // Gradients are taken before the wrap folds the coordinate, so the virtual path sees them unbroken
+        vec2 uvDx = dFdx(uv);
+        vec2 uvDy = dFdy(uv);
+        vec2 size = uVirtualTexturing ? vec2(virtualMaterials[vertexMaterial.z].size.xy) : vec2(textureSize(uTexture, 0).xy);
+
+        if (vertexMaterial.y == 1u)
+            uv = 1.0f - abs(mod(uv, 2.0f) - 1.0f);
+        else if (vertexMaterial.y == 2u)
+        {
+            vec2 halfTexel = 0.5f / size;
+            uv = clamp(uv, halfTexel, 1.0f - halfTexel);
+        }
+        else if (vertexMaterial.y == 3u && (any(lessThan(uv, vec2(0.0f))) || any(greaterThan(uv, vec2(1.0f)))))
+            return vec4(1.0f, 0.0f, 1.0f, 1.0f);
 
-/* Fragment Shader Source Code*/
-const GLchar* fragmentShaderSource = GLSL(440,
-    in vec3 vertexNormal; // For incoming normals
-    in vec3 vertexFragmentPos; // For incoming fragment position
-    in vec2 vertexTextureCoordinate;
+        if (uVirtualTexturing)
+            return sampleVirtual(uv, uvDx, uvDy);
+        return texture(uTexture, vec3(uv, float(vertexMaterial.x)));
+    }
+);
 
-    out vec4 fragmentColor; // For outgoing cube color to the GPU
+// Lamp shadow lookup and the clustered point lights. Needs the frame data.
+const GLchar* lightingShaderChunk = GLSL_CHUNK(
+    uniform sampler2DShadow uShadowMap;
 
-    // Uniform or Global variables for object color, light color, light position, and camera/view position
-    uniform vec3 objectColor;
-    uniform vec3 lightColor;
-    uniform vec3 lightPos;
-    uniform vec3 viewPosition;
-    uniform sampler2D uTexture;
-    uniform vec2 uvScale;
+    // 3x3 percentage-closer filtered visibility of a world position from the shadowed light
+    float shadowVisibility(vec3 worldPos)
+    {
+        vec4 lightClip = lightViewProjection * vec4(worldPos, 1.0f);
+        vec3 coord = lightClip.xyz / lightClip.w * 0.5f + 0.5f;
+        if (lightClip.w <= 0.0f || any(lessThan(coord, vec3(0.0f))) || any(greaterThan(coord, vec3(1.0f))))
+            return 1.0f;
+
+        float visibility = 0.0f;
+        for (int y = -1; y <= 1; ++y)
+            for (int x = -1; x <= 1; ++x)
+                visibility += texture(uShadowMap, vec3(coord.xy + vec2(x, y) * shadowParams.z, coord.z - shadowParams.y));
+        return visibility / 9.0f;
+    }
+
+    // Point lights, binned into view-space clusters on the CPU every frame
+    struct PointLight
+    {
+        vec4 positionRadius; // xyz = world position, w = radius of influence
+        vec4 color; // rgb = color, a = intensity
+    };
+    layout(std430) readonly buffer LightBuffer
+    {
+        PointLight lights[];
+    };
+    layout(std430) readonly buffer ClusterBuffer
+    {
+        uvec2 clusters[]; // x = first entry in lightIndices, y = light count
+    };
+    layout(std430) readonly buffer LightIndexBuffer
+    {
+        uint lightIndices[];
+    };
+);
+
+
+/* Vertex Shader Source Code*/
+const GLchar* vertexShaderSource = GLSL(440,
+
+    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+    layout(location = 1) in vec3 normal; // VAP position 1 for normals
+    layout(location = 2) in vec2 textureCoordinate;
+    layout(location = 3) in uint objectId; // Per-instance: the draw's base instance plus the instance index
+
+    // Compact vertices carry the normal octahedral-encoded in xy
+    uniform bool uCompactVertices;
+
+    out vec3 vertexNormal; // For outgoing normals to fragment shader
+    out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
+    out vec2 vertexTextureCoordinate;
+    flat out uvec3 vertexMaterial; // Texture array layer, wrap mode and material index
+
+    void main()
+    {
+        mat4 model = objects[objectId].model;
+        MeshData mesh = meshes[objects[objectId].material.w];
+        vec3 localPosition = mesh.offset.xyz + position * mesh.scale.xyz;
+        vec3 localNormal = uCompactVertices ? octDecode(normal.xy) : normal;
+
+        gl_Position = projection * view * model * vec4(localPosition, 1.0f); // Transforms vertices into clip coordinates
+
+        vertexFragmentPos = vec3(model * vec4(localPosition, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+
+        vertexNormal = mat3(objects[objectId].normal) * localNormal; // World-space normal; the matrix is precomputed per object on the CPU
+        vertexTextureCoordinate = textureCoordinate;
+        vertexMaterial = objects[objectId].material.xyz;
+    }
+);
 
-void main()
-{
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
+
+/* Fragment Shader Source Code*/
+const GLchar* fragmentShaderSource = GLSL(440,
+    in vec3 vertexNormal; // For incoming normals
+    in vec3 vertexFragmentPos; // For incoming fragment position
+    in vec2 vertexTextureCoordinate;
+
+    out vec4 fragmentColor; // For outgoing cube color to the GPU
+
+void main()
+{
+    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
 
     //Calculate Ambient lighting*/
     float ambientStrength = 0.1f; // Set ambient or global lighting strength.
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color.
+    vec3 ambient = ambientStrength * lightColor.rgb; // Generate ambient light color.
 
-    //Calculate Diffuse lighting*/
     vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit.
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube.
-    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light.
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color.
-
-    //Calculate Specular lighting*/
     float specularIntensity = 0.8f; // Set specular light strength.
     float highlightSize = 16.0f; // Set specular highlight size.
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction.
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector.
-    //Calculate specular component.
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
+    vec3 viewDir = normalize(viewPosition.xyz - vertexFragmentPos); // Calculate view direction.
+
+    // Find this fragment's cluster: screen tile from the pixel position, slice from the logarithmic view depth
+    float viewDepth = max(-(view * vec4(vertexFragmentPos, 1.0f)).z, 1e-4f);
+    uvec3 cluster = uvec3(uvec2(gl_FragCoord.xy * clusterScale.xy), uint(max(log(viewDepth) * clusterScale.z + clusterScale.w, 0.0f)));
+    cluster = min(cluster, clusterGrid.xyz - uvec3(1u));
+    uvec2 range = clusters[cluster.x + clusterGrid.x * (cluster.y + clusterGrid.y * cluster.z)];
+
+    // Only the lights overlapping the cluster contribute, so the cost stays bounded as lights are added
+    vec3 lighting = ambient;
+    for (uint i = 0u; i < range.y; ++i)
+    {
+        uint lightIndex = lightIndices[range.x + i];
+        PointLight light = lights[lightIndex];
+        vec3 toLight = light.positionRadius.xyz - vertexFragmentPos;
+        float distance = length(toLight);
+        vec3 lightDirection = toLight / max(distance, 1e-4f);
+
+        // Smooth falloff reaching zero at the light's radius
+        float falloff = clamp(1.0f - (distance * distance) / (light.positionRadius.w * light.positionRadius.w), 0.0f, 1.0f);
+        falloff *= falloff;
+
+        //Calculate Diffuse lighting*/
+        float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light.
+
+        //Calculate Specular lighting*/
+        vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector.
+        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+
+        float shadow = (shadowParams.w > 0.5f && lightIndex == uint(shadowParams.x)) ? shadowVisibility(vertexFragmentPos) : 1.0f;
+
+        lighting += (impact + specularIntensity * specularComponent) * light.color.rgb * (light.color.a * falloff * shadow);
+    }
 
     //Texutre holds the color
-    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+    vec4 textureColor = sampleMaterial(vertexTextureCoordinate * uvScale.xy);
 
     // Calculate Phong result.
-    vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
+    vec3 phong = lighting * textureColor.xyz;
     //fragmentColor = texture(uTexture, vertexTextureCoordinate);
     fragmentColor = vec4(phong, 1.0f); // Send lighting results to GPU.
 }
@@ -184,15 +1375,12 @@ void main()
 const GLchar* lampVertexShaderSource = GLSL(440,
 
     layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-
-//Uniform / Global variables for the  transform matrices
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    layout(location = 3) in uint objectId; // Per-instance: the draw's base instance plus the instance index
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    MeshData mesh = meshes[objects[objectId].material.w];
+    gl_Position = projection * view * objects[objectId].model * vec4(mesh.offset.xyz + position * mesh.scale.xyz, 1.0f); // Transforms vertices into clip coordinates
 }
 );
 
@@ -208,123 +1396,513 @@ void main()
 }
 );
 
-// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
+/* Shadow Map Shader Source Code*/
+const GLchar* shadowVertexShaderSource = GLSL(440,
+
+    layout(location = 0) in vec3 position;
+    layout(location = 3) in uint objectId;
+
+    uniform mat4 uLightViewProjection;
+
+    void main()
+    {
+        MeshData mesh = meshes[objects[objectId].material.w];
+        gl_Position = uLightViewProjection * objects[objectId].model * vec4(mesh.offset.xyz + position * mesh.scale.xyz, 1.0f);
+    }
+);
+
+// Depth only
+const GLchar* shadowFragmentShaderSource = GLSL(440,
+void main()
+{
+}
+);
+
+/* Deferred Geometry Pass Fragment Shader Source Code*/
+const GLchar* gBufferFragmentShaderSource = GLSL(440,
+    in vec3 vertexNormal; // For incoming normals
+    in vec3 vertexFragmentPos; // Unused here; the lighting pass rebuilds positions from depth
+    in vec2 vertexTextureCoordinate;
+
+    layout(location = 0) out vec4 gAlbedo;
+    layout(location = 1) out vec2 gNormal; // Octahedral-encoded world-space normal
+
+void main()
+{
+    gAlbedo = sampleMaterial(vertexTextureCoordinate * uvScale.xy);
+    gNormal = octEncode(normalize(vertexNormal));
+}
+);
+
+/* Virtual Texture Feedback Fragment Shader Source Code*/
+const GLchar* feedbackFragmentShaderSource = GLSL(440,
+    in vec2 vertexTextureCoordinate;
+
+    layout(location = 0) out uint feedback; // material << 24 | level << 20 | tile y << 10 | tile x
+
+    uniform float uFeedbackLodBias; // log2 of the feedback target's downscale
+
+// Writes the tile sampleVirtual will want for this pixel, using the same level selection
+void main()
+{
+    uint material = vertexMaterial.z;
+    uvec4 size = virtualMaterials[material].size;
+    vec2 uv = vertexTextureCoordinate * uvScale.xy;
+    vec2 texelDx = dFdx(uv) * vec2(size.xy);
+    vec2 texelDy = dFdy(uv) * vec2(size.xy);
+    if (size.z == 0u)
+    {
+        feedback = 0xFFFFFFFFu;
+        return;
+    }
+
+    if (vertexMaterial.y == 1u)
+        uv = 1.0f - abs(mod(uv, 2.0f) - 1.0f);
+    else if (vertexMaterial.y == 2u)
+        uv = clamp(uv, 0.5f / vec2(size.xy), 1.0f - 0.5f / vec2(size.xy));
+
+    float lod = 0.5f * log2(max(max(dot(texelDx, texelDx), dot(texelDy, texelDy)), 1e-8f)) - uFeedbackLodBias;
+    uint level = uint(clamp(lod, 0.0f, float(size.z - 1u)));
+    uvec4 info = virtualMaterials[material].levels[level];
+    uvec2 tile = min(uvec2(fract(uv) * vec2(size.xy) / float(128u << level)), info.yz - 1u);
+    feedback = (material << 24u) | (level << 20u) | (tile.y << 10u) | tile.x;
+}
+);
+
+/* Deferred Lighting Pass Shader Source Code*/
+const GLchar* deferredLightingVertexShaderSource = GLSL(440,
+
+    out vec2 screenCoordinate;
+
+    // One triangle covering the screen, generated from the vertex index
+    void main()
+    {
+        vec2 corner = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+        screenCoordinate = corner;
+        gl_Position = vec4(corner * 2.0f - 1.0f, 0.0f, 1.0f);
+    }
+);
+
+const GLchar* deferredLightingFragmentShaderSource = GLSL(440,
+    in vec2 screenCoordinate;
+
+    out vec4 fragmentColor;
+
+    uniform sampler2D uAlbedo;
+    uniform sampler2D uNormal;
+    uniform sampler2D uDepth;
+    uniform mat4 uInverseViewProjection;
+
+void main()
+{
+    float depth = texture(uDepth, screenCoordinate).r;
+    if (depth >= 1.0f)
+        discard; // Background keeps the clear color
+
+    // Rebuild the world position from depth
+    vec4 world = uInverseViewProjection * vec4(vec3(screenCoordinate, depth) * 2.0f - 1.0f, 1.0f);
+    vec3 fragmentPos = world.xyz / world.w;
+
+    vec3 albedo = texture(uAlbedo, screenCoordinate).rgb;
+    vec3 norm = octDecode(texture(uNormal, screenCoordinate).xy);
+
+    // Same Phong terms as the forward path
+    float ambientStrength = 0.1f;
+    float specularIntensity = 0.8f;
+    float highlightSize = 16.0f;
+    vec3 viewDir = normalize(viewPosition.xyz - fragmentPos);
+
+    float viewDepth = max(-(view * vec4(fragmentPos, 1.0f)).z, 1e-4f);
+    uvec3 cluster = uvec3(uvec2(gl_FragCoord.xy * clusterScale.xy), uint(max(log(viewDepth) * clusterScale.z + clusterScale.w, 0.0f)));
+    cluster = min(cluster, clusterGrid.xyz - uvec3(1u));
+    uvec2 range = clusters[cluster.x + clusterGrid.x * (cluster.y + clusterGrid.y * cluster.z)];
+
+    vec3 lighting = ambientStrength * lightColor.rgb;
+    for (uint i = 0u; i < range.y; ++i)
+    {
+        uint lightIndex = lightIndices[range.x + i];
+        PointLight light = lights[lightIndex];
+        vec3 toLight = light.positionRadius.xyz - fragmentPos;
+        float distance = length(toLight);
+        vec3 lightDirection = toLight / max(distance, 1e-4f);
+
+        float falloff = clamp(1.0f - (distance * distance) / (light.positionRadius.w * light.positionRadius.w), 0.0f, 1.0f);
+        falloff *= falloff;
+
+        float impact = max(dot(norm, lightDirection), 0.0);
+        vec3 reflectDir = reflect(-lightDirection, norm);
+        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+
+        float shadow = (shadowParams.w > 0.5f && lightIndex == uint(shadowParams.x)) ? shadowVisibility(fragmentPos) : 1.0f;
+
+        lighting += (impact + specularIntensity * specularComponent) * light.color.rgb * (light.color.a * falloff * shadow);
+    }
+
+    fragmentColor = vec4(lighting * albedo, 1.0f);
+}
+);
+
+// Each shader body with the shared chunks it includes
+const ShaderSource sceneVertexShader = { vertexShaderSource, { frameDataShaderChunk, objectDataShaderChunk, octahedralShaderChunk } };
+const ShaderSource sceneFragmentShader = { fragmentShaderSource, { frameDataShaderChunk, materialShaderChunk, lightingShaderChunk } };
+const ShaderSource gBufferFragmentShader = { gBufferFragmentShaderSource, { frameDataShaderChunk, materialShaderChunk, octahedralShaderChunk } };
+const ShaderSource feedbackFragmentShader = { feedbackFragmentShaderSource, { frameDataShaderChunk, materialShaderChunk } };
+const ShaderSource lampVertexShader = { lampVertexShaderSource, { frameDataShaderChunk, objectDataShaderChunk } };
+const ShaderSource lampFragmentShader = { lampFragmentShaderSource, {} };
+const ShaderSource shadowVertexShader = { shadowVertexShaderSource, { objectDataShaderChunk } };
+const ShaderSource shadowFragmentShader = { shadowFragmentShaderSource, {} };
+const ShaderSource deferredLightingVertexShader = { deferredLightingVertexShaderSource, {} };
+const ShaderSource deferredLightingFragmentShader = { deferredLightingFragmentShaderSource, { frameDataShaderChunk, lightingShaderChunk, octahedralShaderChunk } };
+
+// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it.
+// Rows are swapped through a small stack buffer, a memcpy-sized chunk at a time.
 void flipImageVertically(unsigned char* image, int width, int height, int channels)
 {
+    const size_t rowBytes = (size_t)width * channels;
+    unsigned char chunk[4096];
+
     for (int j = 0; j < height / 2; ++j)
     {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
+        unsigned char* top = image + (size_t)j * rowBytes;
+        unsigned char* bottom = image + (size_t)(height - 1 - j) * rowBytes;
 
-        for (int i = width * channels; i > 0; --i)
+        for (size_t offset = 0; offset < rowBytes; offset += sizeof(chunk))
         {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
+            size_t count = std::min(sizeof(chunk), rowBytes - offset);
+            memcpy(chunk, top + offset, count);
+            memcpy(top + offset, bottom + offset, count);
+            memcpy(bottom + offset, chunk, count);
         }
     }
 }
 
-
 int main(int argc, char* argv[])
 {
-    if (!UInitialize(argc, argv, &gWindow))
-        return EXIT_FAILURE;
+    PROFILE_THREAD_NAME("Main");
+    UParseCommandLine(argc, argv);
 
-    // Create the mesh
-    UCreatePyramidMesh(gMesh); // Calls the function to create the Vertex Buffer Object
-    UCreatePlaneMesh(gPlaneMesh);
-    UCreateBoxMesh(gBoxMesh);
-	UCreateSphereMesh(gSphereMesh);
+    // The image kernels run on the CPU alone, so no window or context is needed
+    if (gImageBenchmark)
+    {
+        UBenchmarkImageKernels();
+        return EXIT_SUCCESS;
+    }
 
-    // Create the shader program
-    if (!UCreateShaderProgram(vertexShaderSource, fragmentShaderSource, gProgramId))
+    if (!UInitialize(argc, argv, &gWindow))
         return EXIT_FAILURE;
 
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
-        return EXIT_FAILURE;
+    UCreateGpuProfiler(gGpuProfiler);
 
-    // Load texture (relative to project's directory)
-    const char* texFilename = "../resources/textures/innermonitor.jpg";
-    if (!UCreateTexture(texFilename, gTextureId))
+    if (gBenchmark.enabled)
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
+        if (!gBenchmark.pathFile.empty() && !ULoadCameraPath(gBenchmark.pathFile, gBenchmark.path))
+        {
+            cout << "Failed to load camera path " << gBenchmark.pathFile << endl;
+            return EXIT_FAILURE;
+        }
+        glGenQueries(BENCHMARK_QUERY_LATENCY * 2, &gBenchmark.queries[0][0]);
+
+        // Measure the renderer, not the display's refresh rate
+        if (!gHeadless)
+            glfwSwapInterval(0);
     }
-    const char* texFilename2 = "../resources/textures/monitor.jpg";
-    if (!UCreateTexture(texFilename2, gTextureId2))
+
+    // Keep one core for the render thread
+    unsigned hardwareThreads = std::thread::hardware_concurrency();
+    UStartThreadPool(gThreadPool, hardwareThreads > 1 ? hardwareThreads - 1 : 1);
+
+    // The object ring must exist before the arena VAO so its objectId attribute can point at the ring's ID buffer
+    UCreateObjectRing(gObjectRing, INITIAL_OBJECT_CAPACITY);
+    UCreateIndirectBuffer();
+
+    // Hand every program to the driver first; with parallel compilation they build while the CPU loads assets
+    if (GLEW_KHR_parallel_shader_compile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    // In deferred mode the scene program only fills the G-buffer
+    UBeginShaderProgram(sceneVertexShader, gDeferredShading ? gBufferFragmentShader : sceneFragmentShader, gProgram);
+    if (gDeferredShading)
+        UBeginShaderProgram(deferredLightingVertexShader, deferredLightingFragmentShader, gDeferredLightingProgram);
+    UBeginShaderProgram(lampVertexShader, lampFragmentShader, gLampProgram);
+    UBeginShaderProgram(shadowVertexShader, shadowFragmentShader, gShadowProgram);
+    if (gVirtualTexturing)
+        UBeginShaderProgram(sceneVertexShader, feedbackFragmentShader, gFeedbackProgram);
+
+    // Load the material textures (relative to project's directory). They decode on the thread pool and
+    // show a placeholder until the render loop uploads them into their texture arrays.
+    // With virtual texturing the workers cook tile files instead, and only the coarsest tiles load up front.
+    gAssetLoader.startTime = UGetTime();
+    UCreateMaterialLibrary(gMaterials, MATERIAL_COUNT);
+    if (gVirtualTexturing)
+        UCreateVirtualTexturing(gVirtualTextures, MATERIAL_COUNT);
+    for (GLuint material = 0; material < MATERIAL_COUNT; ++material)
     {
-        cout << "Failed to load texture " << texFilename2 << endl;
-        return EXIT_FAILURE;
+        if (gVirtualTexturing)
+            UCreateVirtualMaterialAsync(gAssetLoader, gVirtualTextures, material, MATERIAL_FILES[material]);
+        else
+            UCreateMaterialAsync(gAssetLoader, gMaterials, material, MATERIAL_FILES[material]);
     }
-    const char* texFilename3 = "../resources/textures/wood.jpg";
-    if (!UCreateTexture(texFilename3, gTextureId3))
+
+    // Create the meshes. Generation only touches the CPU-side arena, so the generators run in parallel.
+    UParallelFor(gThreadPool, 4, [](size_t i)
     {
-        cout << "Failed to load texture " << texFilename3 << endl;
+        switch (i)
+        {
+        case 0: UCreatePyramidMesh(gMesh); break;
+        case 1: UCreatePlaneMesh(gPlaneMesh); break;
+        case 2: UCreateBoxMesh(gBoxMesh); break;
+        default: UCreateSphereMesh(gSphereMesh); break;
+        }
+    });
+
+    // Send every mesh to the GPU in one vertex buffer and one index buffer
+    UUploadMeshArena(gMeshArena);
+
+    if (!UFinishShaderProgram(gProgram))
         return EXIT_FAILURE;
-    }
-    const char* texFilename4 = "../resources/textures/fabric.jpg";
-    if (!UCreateTexture(texFilename4, gTextureId4))
+
+    if (gDeferredShading)
     {
-        cout << "Failed to load texture " << texFilename4 << endl;
+        if (!UFinishShaderProgram(gDeferredLightingProgram))
+            return EXIT_FAILURE;
+
+        glUniform1i(UGetUniformLocation(gDeferredLightingProgram, "uAlbedo"), 0);
+        glUniform1i(UGetUniformLocation(gDeferredLightingProgram, "uNormal"), 1);
+        glUniform1i(UGetUniformLocation(gDeferredLightingProgram, "uDepth"), 2);
+        glGenVertexArrays(1, &gFullscreenVao);
+    }
+
+    if (!UFinishShaderProgram(gLampProgram))
+        return EXIT_FAILURE;
+
+    if (!UFinishShaderProgram(gShadowProgram))
         return EXIT_FAILURE;
+
+    if (gVirtualTexturing)
+    {
+        if (!UFinishShaderProgram(gFeedbackProgram))
+            return EXIT_FAILURE;
+        glUniform1f(UGetUniformLocation(gFeedbackProgram, "uFeedbackLodBias"), log2f((float)VT_FEEDBACK_DIVISOR));
+        glUniform1i(UGetUniformLocation(gFeedbackProgram, "uCompactVertices"), gCompactVertices ? 1 : 0);
     }
-   const char* texFilename5 = "../resources/textures/keyboardt.jpg";
-    if (!UCreateTexture(texFilename5, gTextureId5))
+
+    // The scene program samples the lamp's shadow map; so does the deferred lighting pass
+    glUseProgram(gProgram.id);
+    glUniform1i(UGetUniformLocation(gProgram, "uShadowMap"), SHADOW_MAP_UNIT);
+    if (gDeferredShading)
     {
-        cout << "Failed to load texture " << texFilename5 << endl;
-        return EXIT_FAILURE;
+        glUseProgram(gDeferredLightingProgram.id);
+        glUniform1i(UGetUniformLocation(gDeferredLightingProgram, "uShadowMap"), SHADOW_MAP_UNIT);
     }
-    
+
+    if (!UCreateShadowMaps(gShadowMaps))
+        return EXIT_FAILURE;
+
+    // Camera and light data are uploaded once per frame into a buffer both programs read
+    UCreateFrameUniformBuffer();
+    UCreateLightClusters(gLightClusters);
+
     // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
-    glUseProgram(gProgramId);
-    // We set the texture as texture unit 0
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture"), 0);
+    glUseProgram(gProgram.id);
+    // We set the material texture arrays as texture unit 0
+    glUniform1i(UGetUniformLocation(gProgram, "uTexture"), 0);
+    glUniform1i(UGetUniformLocation(gProgram, "uVirtualTexturing"), gVirtualTexturing ? 1 : 0);
+    glUniform1i(UGetUniformLocation(gProgram, "uCompactVertices"), gCompactVertices ? 1 : 0);
+    glUniform1i(UGetUniformLocation(gProgram, "uPageAtlas"), VT_ATLAS_UNIT);
+
+    // Build the scene graph now that meshes, shaders and texture names exist
+    UCreateScene(gScene);
+
+    // Timed and headless runs must not measure or capture placeholder textures
+    if (gBenchmark.enabled || gHeadless)
+        UFinishAssetLoads(gAssetLoader);
 
     // Sets the background color of the window to black (it will be implicitely used by glClear)
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
     // render loop
     // -----------
-    while (!glfwWindowShouldClose(gWindow))
+    const double startTime = UGetTime();
+    int framesRendered = 0;
+    for (;;)
     {
+        PROFILE_ZONE("Frame");
+
+        // Benchmarks stop after a fixed frame count, headless runs after the requested frames or duration
+        if (gBenchmark.enabled)
+        {
+            if (framesRendered >= gFrameLimit)
+                break;
+        }
+        else if (gHeadless)
+        {
+            if (gHeadlessSeconds > 0.0 ? UGetTime() - startTime >= gHeadlessSeconds : framesRendered >= gFrameLimit)
+                break;
+        }
+        else if (glfwWindowShouldClose(gWindow))
+            break;
+
+        // Swap in any textures the workers have finished decoding, then fit texture memory to the budget
+        UPumpAssetUploads(gAssetLoader, ASSET_UPLOAD_BUDGET);
+        UUpdateTextureBudget(gTextureManager, gMaterials);
+
+        // Benchmark frames are timed and replay the camera path with a fixed time step
+        if (gBenchmark.enabled)
+        {
+            gDeltaTime = BENCHMARK_TIME_STEP;
+            URunBenchmarkFrame(gBenchmark);
+            ++framesRendered;
+            if (!gHeadless)
+                glfwPollEvents();
+            continue;
+        }
+
         // per-frame timing
         // --------------------
-        float currentFrame = glfwGetTime();
+        float currentFrame = (float)UGetTime();
         gDeltaTime = currentFrame - gLastFrame;
         gLastFrame = currentFrame;
 
         // input
         // -----
-        UProcessInput(gWindow);
+        if (!gHeadless)
+            UProcessInput(gWindow);
+
+        if (gCameraRecording.is_open())
+            URecordCamera(gCameraRecording, currentFrame);
 
         // Render this frame
         URender();
+        UReportFrameTime(gDeltaTime);
+        ++framesRendered;
 
-        glfwPollEvents();
+        if (!gHeadless)
+            glfwPollEvents();
+    }
+
+    if (gBenchmark.enabled)
+        UFinishBenchmark(gBenchmark);
+
+    if (gTraceOnExit && !UWriteChromeTrace(gTraceFile, gGpuProfiler))
+        cout << "Failed to write " << gTraceFile << endl;
+    UDestroyGpuProfiler(gGpuProfiler);
+
+    if (gHeadless)
+    {
+        cout << "Headless: rendered " << framesRendered << " frames in " << UGetTime() - startTime << " s" << endl;
+        if (!gHeadlessOutput.empty() && !USaveFramebuffer(gHeadlessOutput, WINDOW_WIDTH, WINDOW_HEIGHT))
+            cout << "Failed to write " << gHeadlessOutput << endl;
     }
 
     // Release mesh data
-    UDestroyMesh(gMesh);
-    UDestroyMesh(gPlaneMesh);
-    UDestroyMesh(gBoxMesh);
-	UDestroyMesh(gSphereMesh);
+    UDestroyMeshArena(gMeshArena);
+    UDestroyObjectRing(gObjectRing);
+    glDeleteBuffers(1, &gIndirectBuffer);
 
-    // Release texture
-    UDestroyTexture(gTextureId);
+    // Release the material textures
+    cout << "Texture memory peak: " << gTextureManager.peakBytes / 1048576.0 << " MB" << endl;
+    UDestroyMaterialLibrary(gMaterials);
 
     // Release shader program
-    UDestroyShaderProgram(gProgramId);
+    UDestroyShaderProgram(gProgram);
+    UDestroyShaderProgram(gLampProgram);
+    UDestroyShaderProgram(gShadowProgram);
+    UDestroyShadowMaps(gShadowMaps);
+
+    if (gDeferredShading)
+    {
+        UDestroyShaderProgram(gDeferredLightingProgram);
+        UDestroyGBuffer(gGBuffer);
+        glDeleteVertexArrays(1, &gFullscreenVao);
+    }
+
+    // Workers finish any decode still queued before they exit
+    UStopThreadPool(gThreadPool);
+
+    // Tile streaming tasks hold a reference to the virtual texture state, so it goes after the workers
+    if (gVirtualTexturing)
+    {
+        UDestroyVirtualTexturing(gVirtualTextures);
+        UDestroyShaderProgram(gFeedbackProgram);
+    }
+    glDeleteBuffers(1, &gFrameUniformBuffer);
+    UDestroyLightClusters(gLightClusters);
+
+    if (gHeadless)
+        UDestroyHeadless(gHeadlessContext);
 
     exit(EXIT_SUCCESS); // Terminates the program successfully
 }
 
 
+// Reads the render path and headless options:
+//   --deferred            G-buffer path instead of forward shading
+//   --virtual-texturing   stream material tiles on demand into a fixed atlas instead of texture arrays
+//   --compact-vertices    quantize the GPU vertex buffer to 16 bytes per vertex
+//   --headless            no window; render offscreen and exit
+//   --image-benchmark     time the texture image kernels on a synthetic image and exit
+//   --frames N            headless and benchmark frame count
+//   --seconds S           headless duration, overrides --frames
+//   --output file.ppm     headless: save the last frame
+//   --benchmark           replay a camera path for --frames frames and report frame-time percentiles
+//   --camera-path file    benchmark: recorded path to replay instead of the scripted orbit
+//   --report file.json    benchmark: report location
+//   --record-camera file  interactive: record the camera path
+//   --trace file.json     write the recent pass timings as a Chrome trace at exit (F9 writes one any time)
+//   --texture-budget MB   texture memory above which idle material arrays drop their top mip levels
+void UParseCommandLine(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string argument = argv[i];
+        const bool hasValue = i + 1 < argc;
+
+        if (argument == "--deferred")
+            gDeferredShading = true;
+        else if (argument == "--virtual-texturing")
+            gVirtualTexturing = true;
+        else if (argument == "--compact-vertices")
+            gCompactVertices = true;
+        else if (argument == "--headless")
+            gHeadless = true;
+        else if (argument == "--image-benchmark")
+            gImageBenchmark = true;
+        else if (argument == "--frames" && hasValue)
+            gFrameLimit = std::max(1, atoi(argv[++i]));
+        else if (argument == "--seconds" && hasValue)
+            gHeadlessSeconds = atof(argv[++i]);
+        else if (argument == "--output" && hasValue)
+            gHeadlessOutput = argv[++i];
+        else if (argument == "--benchmark")
+            gBenchmark.enabled = true;
+        else if (argument == "--camera-path" && hasValue)
+            gBenchmark.pathFile = argv[++i];
+        else if (argument == "--report" && hasValue)
+            gBenchmark.reportFile = argv[++i];
+        else if (argument == "--texture-budget" && hasValue)
+            gTextureManager.budgetBytes = (size_t)std::max(1, atoi(argv[++i])) << 20;
+        else if (argument == "--trace" && hasValue)
+        {
+            gTraceFile = argv[++i];
+            gTraceOnExit = true;
+        }
+        else if (argument == "--record-camera" && hasValue)
+        {
+            gCameraRecording.open(argv[++i]);
+            if (!gCameraRecording)
+                cout << "Cannot record the camera to " << argv[i] << endl;
+        }
+        else
+            cout << "Ignoring unknown argument " << argument << endl;
+    }
+}
+
+
 // Initialize GLFW, GLEW, and create a window
 bool UInitialize(int argc, char* argv[], GLFWwindow** window)
 {
+    if (gHeadless)
+        return UInitializeHeadless(gHeadlessContext);
+
     // GLFW: initialize and configure
     // ------------------------------
     glfwInit();
@@ -378,103 +1956,489 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
 }
 
 
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
-void UProcessInput(GLFWwindow* window)
+// Creates a surfaceless EGL context (works on Mesa llvmpipe without a display or GPU) and an offscreen
+// framebuffer of the window's size that takes the place of the default framebuffer
+bool UInitializeHeadless(HeadlessContext& headless)
 {
-	static bool isPPressedLastFrame = false; // define this static variable outside your game loop
-    static const float cameraSpeed = 2.5f;
-
-	if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS)
-	{
-		if (!isPPressedLastFrame) {
-			isPerspective = !isPerspective;
-			isPPressedLastFrame = true;
-		}
-	}
-	else {
-		isPPressedLastFrame = false;
-	}
-
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
-
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(UP, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(DOWN, gDeltaTime);
-
-    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS && gTexWrapMode != GL_REPEAT)
+#if defined(__linux__)
+    // Prefer Mesa's surfaceless platform; fall back to the default display
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay != nullptr)
+        headless.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (headless.display == EGL_NO_DISPLAY)
+        headless.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (headless.display == EGL_NO_DISPLAY || !eglInitialize(headless.display, &major, &minor))
     {
-        glBindTexture(GL_TEXTURE_2D, gTextureId5);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glBindTexture(GL_TEXTURE_2D, 0);
-
-        gTexWrapMode = GL_REPEAT;
-
-        cout << "Current Texture Wrapping Mode: REPEAT" << endl;
+        cout << "Failed to initialize EGL" << endl;
+        return false;
     }
-    else if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS && gTexWrapMode != GL_MIRRORED_REPEAT)
-    {
-        glBindTexture(GL_TEXTURE_2D, gTextureId5);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-        glBindTexture(GL_TEXTURE_2D, 0);
-
-        gTexWrapMode = GL_MIRRORED_REPEAT;
+    eglBindAPI(EGL_OPENGL_API);
 
-        cout << "Current Texture Wrapping Mode: MIRRORED REPEAT" << endl;
-    }
-    else if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_EDGE)
+    const EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(headless.display, configAttributes, &config, 1, &configCount) || configCount == 0)
     {
-        glBindTexture(GL_TEXTURE_2D, gTextureId5);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glBindTexture(GL_TEXTURE_2D, 0);
-
-        gTexWrapMode = GL_CLAMP_TO_EDGE;
-
-        cout << "Current Texture Wrapping Mode: CLAMP TO EDGE" << endl;
+        cout << "No EGL config supports desktop OpenGL" << endl;
+        return false;
     }
-    else if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_BORDER)
-    {
-        float color[] = { 1.0f, 0.0f, 1.0f, 1.0f };
-        glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, color);
-
-        glBindTexture(GL_TEXTURE_2D, gTextureId5);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-        glBindTexture(GL_TEXTURE_2D, 0);
 
-        gTexWrapMode = GL_CLAMP_TO_BORDER;
-
-        cout << "Current Texture Wrapping Mode: CLAMP TO BORDER" << endl;
+    const EGLint contextAttributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 4,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    headless.context = eglCreateContext(headless.display, config, EGL_NO_CONTEXT, contextAttributes);
+    if (headless.context == EGL_NO_CONTEXT || !eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, headless.context))
+    {
+        cout << "Failed to create a surfaceless OpenGL 4.4 context" << endl;
+        return false;
     }
 
-    if (glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS)
-    {
+    // GLEW builds without GLX report a missing display, which is expected here
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    if (GlewInitResult == GLEW_ERROR_NO_GLX_DISPLAY)
+        GlewInitResult = GLEW_OK;
+#endif
+    if (GLEW_OK != GlewInitResult)
+    {
+        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        return false;
+    }
+    glGetError(); // GLEW may leave an error behind on core contexts
+
+    cout << "INFO: Headless OpenGL Version: " << glGetString(GL_VERSION) << endl;
+
+    glGenTextures(1, &headless.color);
+    glBindTexture(GL_TEXTURE_2D, headless.color);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, WINDOW_WIDTH, WINDOW_HEIGHT);
+    glGenTextures(1, &headless.depth);
+    glBindTexture(GL_TEXTURE_2D, headless.depth);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH24_STENCIL8, WINDOW_WIDTH, WINDOW_HEIGHT);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    UTrackTexture(gTextureManager, headless.color, UTextureBytes(GL_RGBA8, WINDOW_WIDTH, WINDOW_HEIGHT, 1, 1));
+    UTrackTexture(gTextureManager, headless.depth, UTextureBytes(GL_DEPTH24_STENCIL8, WINDOW_WIDTH, WINDOW_HEIGHT, 1, 1));
+
+    glGenFramebuffers(1, &headless.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, headless.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, headless.color, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, headless.depth, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << "Headless framebuffer incomplete" << endl;
+        return false;
+    }
+
+    // Without a surface the viewport starts empty
+    gOutputFramebuffer = headless.fbo;
+    glViewport(0, 0, WINDOW_WIDTH, WINDOW_HEIGHT);
+    return true;
+#else
+    cout << "Headless mode needs EGL and is only available on Linux" << endl;
+    return false;
+#endif
+}
+
+
+void UDestroyHeadless(HeadlessContext& headless)
+{
+    glDeleteFramebuffers(1, &headless.fbo);
+    UDestroyTexture(headless.color);
+    UDestroyTexture(headless.depth);
+    gOutputFramebuffer = 0;
+
+#if defined(__linux__)
+    eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(headless.display, headless.context);
+    eglTerminate(headless.display);
+#endif
+    headless = HeadlessContext();
+}
+
+
+// Writes the output framebuffer to a binary PPM, top row first
+bool USaveFramebuffer(const std::string& path, int width, int height)
+{
+    std::vector<unsigned char> pixels((size_t)width * height * 3);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, gOutputFramebuffer);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+
+    file << "P6\n" << width << " " << height << "\n255\n";
+    for (int y = height - 1; y >= 0; --y)
+        file.write((const char*)pixels.data() + (size_t)y * width * 3, (std::streamsize)width * 3);
+    return (bool)file;
+}
+
+
+// Size of the framebuffer passes render to
+void UGetFramebufferSize(int& width, int& height)
+{
+    if (gHeadless)
+    {
+        width = WINDOW_WIDTH;
+        height = WINDOW_HEIGHT;
+        return;
+    }
+    glfwGetFramebufferSize(gWindow, &width, &height);
+}
+
+
+// Seconds since startup; GLFW's timer is unavailable when no window system is initialized
+double UGetTime()
+{
+    if (gHeadless)
+    {
+        static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return glfwGetTime();
+}
+
+
+// Reads a camera path written by URecordCamera: one "time px py pz fx fy fz zoom" line per sample
+bool ULoadCameraPath(const std::string& path, std::vector<CameraKeyframe>& keyframes)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    CameraKeyframe keyframe;
+    while (file >> keyframe.time >> keyframe.position.x >> keyframe.position.y >> keyframe.position.z
+        >> keyframe.front.x >> keyframe.front.y >> keyframe.front.z >> keyframe.zoom)
+        keyframes.push_back(keyframe);
+
+    return keyframes.size() >= 2;
+}
+
+
+void URecordCamera(std::ofstream& recording, float time)
+{
+    recording << time << " " << gCamera.Position.x << " " << gCamera.Position.y << " " << gCamera.Position.z << " "
+        << gCamera.Front.x << " " << gCamera.Front.y << " " << gCamera.Front.z << " " << gCamera.Zoom << "\n";
+}
+
+
+// Places the camera for a benchmark frame: interpolated from the recorded path (looping past its end),
+// or on a scripted orbit around the desk that completes one revolution over the run
+void UApplyBenchmarkCamera(const Benchmark& benchmark, int frame)
+{
+    glm::vec3 position;
+    glm::vec3 front;
+    float zoom = 45.0f;
+
+    if (!benchmark.path.empty())
+    {
+        const std::vector<CameraKeyframe>& path = benchmark.path;
+        const float duration = path.back().time - path.front().time;
+        float time = path.front().time + (duration > 0.0f ? fmodf(frame * BENCHMARK_TIME_STEP, duration) : 0.0f);
+
+        size_t next = 1;
+        while (next + 1 < path.size() && path[next].time < time)
+            ++next;
+        const CameraKeyframe& a = path[next - 1];
+        const CameraKeyframe& b = path[next];
+        float t = b.time > a.time ? glm::clamp((time - a.time) / (b.time - a.time), 0.0f, 1.0f) : 0.0f;
+
+        position = a.position + (b.position - a.position) * t;
+        front = glm::normalize(a.front + (b.front - a.front) * t);
+        zoom = a.zoom + (b.zoom - a.zoom) * t;
+    }
+    else
+    {
+        const glm::vec3 target(-0.4f, -0.3f, 0.3f);
+        const float angle = glm::radians(360.0f) * frame / std::max(gFrameLimit, 1);
+        position = target + glm::vec3(sinf(angle) * 3.0f, 0.8f + 0.4f * sinf(angle * 2.0f), cosf(angle) * 3.0f);
+        front = glm::normalize(target - position);
+    }
+
+    gCamera.Position = position;
+    gCamera.Front = front;
+    gCamera.Right = glm::normalize(glm::cross(front, gCamera.WorldUp));
+    gCamera.Up = glm::normalize(glm::cross(gCamera.Right, front));
+    gCamera.Zoom = zoom;
+}
+
+
+// Renders one benchmark frame between two GPU timestamps, and collects the timestamps issued
+// BENCHMARK_QUERY_LATENCY frames ago from the slot about to be reused
+void URunBenchmarkFrame(Benchmark& benchmark)
+{
+    const int slot = benchmark.frame % BENCHMARK_QUERY_LATENCY;
+    if (benchmark.frame >= BENCHMARK_QUERY_LATENCY)
+    {
+        GLuint64 start, end;
+        glGetQueryObjectui64v(benchmark.queries[slot][0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(benchmark.queries[slot][1], GL_QUERY_RESULT, &end);
+        benchmark.gpuMilliseconds.push_back((end - start) / 1.0e6);
+    }
+
+    UApplyBenchmarkCamera(benchmark, benchmark.frame);
+
+    glQueryCounter(benchmark.queries[slot][0], GL_TIMESTAMP);
+    const std::chrono::steady_clock::time_point cpuStart = std::chrono::steady_clock::now();
+
+    URender();
+
+    const std::chrono::steady_clock::time_point cpuEnd = std::chrono::steady_clock::now();
+    glQueryCounter(benchmark.queries[slot][1], GL_TIMESTAMP);
+
+    benchmark.cpuMilliseconds.push_back(std::chrono::duration<double, std::milli>(cpuEnd - cpuStart).count());
+    ++benchmark.frame;
+}
+
+
+// Drains the outstanding queries, prints p50/p95/p99/max and writes the JSON report. Warm-up
+// frames are left out of the statistics but kept in the per-frame arrays.
+void UFinishBenchmark(Benchmark& benchmark)
+{
+    const int pending = std::min(benchmark.frame, BENCHMARK_QUERY_LATENCY);
+    for (int i = benchmark.frame - pending; i < benchmark.frame; ++i)
+    {
+        const int slot = i % BENCHMARK_QUERY_LATENCY;
+        GLuint64 start, end;
+        glGetQueryObjectui64v(benchmark.queries[slot][0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(benchmark.queries[slot][1], GL_QUERY_RESULT, &end);
+        benchmark.gpuMilliseconds.push_back((end - start) / 1.0e6);
+    }
+    glDeleteQueries(BENCHMARK_QUERY_LATENCY * 2, &benchmark.queries[0][0]);
+
+    struct Summary
+    {
+        double mean = 0.0, p50 = 0.0, p95 = 0.0, p99 = 0.0, max = 0.0;
+    };
+    auto summarize = [](const std::vector<double>& samples)
+    {
+        Summary summary;
+        if (samples.size() <= (size_t)BENCHMARK_WARMUP_FRAMES)
+            return summary;
+
+        std::vector<double> sorted(samples.begin() + BENCHMARK_WARMUP_FRAMES, samples.end());
+        std::sort(sorted.begin(), sorted.end());
+        auto percentile = [&sorted](double p) { return sorted[std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5))]; };
+
+        for (double sample : sorted)
+            summary.mean += sample;
+        summary.mean /= sorted.size();
+        summary.p50 = percentile(0.50);
+        summary.p95 = percentile(0.95);
+        summary.p99 = percentile(0.99);
+        summary.max = sorted.back();
+        return summary;
+    };
+    const Summary cpu = summarize(benchmark.cpuMilliseconds);
+    const Summary gpu = summarize(benchmark.gpuMilliseconds);
+
+    const char* renderer = (const char*)glGetString(GL_RENDERER);
+    cout << "Benchmark: " << benchmark.frame << " frames, " << (gDeferredShading ? "deferred" : "forward") << " shading, "
+        << (benchmark.path.empty() ? "scripted orbit" : benchmark.pathFile) << endl;
+    cout << "  CPU ms  p50 " << cpu.p50 << "  p95 " << cpu.p95 << "  p99 " << cpu.p99 << "  max " << cpu.max << endl;
+    cout << "  GPU ms  p50 " << gpu.p50 << "  p95 " << gpu.p95 << "  p99 " << gpu.p99 << "  max " << gpu.max << endl;
+
+    std::ofstream report(benchmark.reportFile);
+    if (!report)
+    {
+        cout << "Cannot write " << benchmark.reportFile << endl;
+        return;
+    }
+
+    auto writeSummary = [&report](const char* name, const Summary& summary)
+    {
+        report << "    \"" << name << "\": { \"mean\": " << summary.mean << ", \"p50\": " << summary.p50 << ", \"p95\": " << summary.p95
+            << ", \"p99\": " << summary.p99 << ", \"max\": " << summary.max << " }";
+    };
+    auto writeSamples = [&report](const char* name, const std::vector<double>& samples)
+    {
+        report << "    \"" << name << "\": [";
+        for (size_t i = 0; i < samples.size(); ++i)
+            report << (i ? ", " : "") << samples[i];
+        report << "]";
+    };
+
+    std::string rendererName = renderer != nullptr ? renderer : "unknown";
+    rendererName.erase(std::remove(rendererName.begin(), rendererName.end(), '"'), rendererName.end());
+
+    report << "{\n";
+    report << "  \"renderer\": \"" << rendererName << "\",\n";
+    report << "  \"shading\": \"" << (gDeferredShading ? "deferred" : "forward") << "\",\n";
+    report << "  \"headless\": " << (gHeadless ? "true" : "false") << ",\n";
+    report << "  \"frames\": " << benchmark.frame << ",\n";
+    report << "  \"warmupFrames\": " << BENCHMARK_WARMUP_FRAMES << ",\n";
+    report << "  \"summaryMilliseconds\": {\n";
+    writeSummary("cpu", cpu);
+    report << ",\n";
+    writeSummary("gpu", gpu);
+    report << "\n  },\n";
+    report << "  \"frameMilliseconds\": {\n";
+    writeSamples("cpu", benchmark.cpuMilliseconds);
+    report << ",\n";
+    writeSamples("gpu", benchmark.gpuMilliseconds);
+    report << "\n  }\n";
+    report << "}\n";
+
+    cout << "  Report written to " << benchmark.reportFile << endl;
+}
+
+
+// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
+void UProcessInput(GLFWwindow* window)
+{
+    PROFILE_ZONE("UProcessInput");
+	static bool isPPressedLastFrame = false; // define this static variable outside your game loop
+    static bool isCPressedLastFrame = false;
+    static bool isOPressedLastFrame = false;
+    static bool isLPressedLastFrame = false;
+    static bool isF9PressedLastFrame = false;
+    static const float cameraSpeed = 2.5f;
+
+	if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS)
+	{
+		if (!isPPressedLastFrame) {
+			isPerspective = !isPerspective;
+			isPPressedLastFrame = true;
+		}
+	}
+	else {
+		isPPressedLastFrame = false;
+	}
+
+    // Report the frustum culling counters of the last frame
+    if (glfwGetKey(window, GLFW_KEY_C) == GLFW_PRESS)
+    {
+        if (!isCPressedLastFrame)
+        {
+            cout << "Culling: " << gCullStats.tested << " tested, " << gCullStats.rejected << " rejected, "
+                << gCullStats.occluded << " occluded" << endl;
+            cout << "Shadow cache: " << gShadowMaps.staticRenders << " static renders, " << gShadowMaps.cacheHits << " hits" << endl;
+
+            // Last resolved GPU pass timings
+            for (const GpuScopeResult& scope : gGpuProfiler.lastFrame)
+            {
+                cout << "GPU " << scope.name << ": " << scope.gpuMicroseconds / 1000.0 << " ms";
+                if (gGpuProfiler.statisticsSupported)
+                {
+                    for (int i = 0; i < PIPELINE_STATISTIC_COUNT; ++i)
+                        cout << ", " << PIPELINE_STATISTIC_NAMES[i] << " " << scope.statistics[i];
+                }
+                cout << endl;
+            }
+            isCPressedLastFrame = true;
+        }
+    }
+    else {
+        isCPressedLastFrame = false;
+    }
+
+    // Export the recent CPU/GPU pass timings
+    if (glfwGetKey(window, GLFW_KEY_F9) == GLFW_PRESS)
+    {
+        if (!isF9PressedLastFrame)
+        {
+            if (UWriteChromeTrace(gTraceFile, gGpuProfiler))
+                cout << "Trace written to " << gTraceFile << endl;
+            isF9PressedLastFrame = true;
+        }
+    }
+    else {
+        isF9PressedLastFrame = false;
+    }
+
+    // Start or stop the lamp orbit
+    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS)
+    {
+        if (!isLPressedLastFrame)
+        {
+            gIsLampOrbiting = !gIsLampOrbiting;
+            isLPressedLastFrame = true;
+        }
+    }
+    else {
+        isLPressedLastFrame = false;
+    }
+
+    // Toggle software occlusion culling
+    if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS)
+    {
+        if (!isOPressedLastFrame)
+        {
+            gOcclusionCulling = !gOcclusionCulling;
+            cout << "Occlusion culling: " << (gOcclusionCulling ? "ON" : "OFF") << endl;
+            isOPressedLastFrame = true;
+        }
+    }
+    else {
+        isOPressedLastFrame = false;
+    }
+
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, true);
+
+    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(UP, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(DOWN, gDeltaTime);
+
+    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS && gTexWrapMode != GL_REPEAT)
+    {
+        gMaterials.materials[MATERIAL_KEYBOARD].wrapMode = MATERIAL_WRAP_REPEAT;
+
+        gTexWrapMode = GL_REPEAT;
+
+        cout << "Current Texture Wrapping Mode: REPEAT" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS && gTexWrapMode != GL_MIRRORED_REPEAT)
+    {
+        gMaterials.materials[MATERIAL_KEYBOARD].wrapMode = MATERIAL_WRAP_MIRRORED_REPEAT;
+
+        gTexWrapMode = GL_MIRRORED_REPEAT;
+
+        cout << "Current Texture Wrapping Mode: MIRRORED REPEAT" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_EDGE)
+    {
+        gMaterials.materials[MATERIAL_KEYBOARD].wrapMode = MATERIAL_WRAP_CLAMP_TO_EDGE;
+
+        gTexWrapMode = GL_CLAMP_TO_EDGE;
+
+        cout << "Current Texture Wrapping Mode: CLAMP TO EDGE" << endl;
+    }
+    else if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_BORDER)
+    {
+        // The shader returns the border colour (magenta) outside [0, 1]
+        gMaterials.materials[MATERIAL_KEYBOARD].wrapMode = MATERIAL_WRAP_CLAMP_TO_BORDER;
+
+        gTexWrapMode = GL_CLAMP_TO_BORDER;
+
+        cout << "Current Texture Wrapping Mode: CLAMP TO BORDER" << endl;
+    }
+
+    if (glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS)
+    {
         gUVScale += 0.1f;
         cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
-        glUseProgram(gProgramId);
-        GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-        glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
     }
     else if (glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS)
     {
         gUVScale -= 0.1f;
         cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
-        glUseProgram(gProgramId);
-        GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-        glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
     }
 }
 
@@ -557,31 +2521,42 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 // Function called to render a frame
 void URender()
 {
-
-    glm::mat4 scale;
-    glm::mat4 rotation;
-    glm::mat4 translation;
-    glm::mat4 model;
+    PROFILE_ZONE("URender");
     glm::mat4 view;
     glm::mat4 projection;
-    GLint modelLoc;
-    GLint viewLoc;
-    GLint projLoc;
-    GLint objectColorLoc;
-
-    GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-/*
+
+    // The orbit angle is absolute rather than accumulated rotations, so positions repeat every revolution
     const float angularVelocity = glm::radians(45.0f);
+    const glm::vec3 rotationAxis(0.0f, 1.0f, 0.0f);
     if (gIsLampOrbiting) {
-        float angle = angularVelocity * gDeltaTime;
-        glm::vec3 rotationAxis(0.0f, 1.0f, 0.0f);
-        glm::vec4 newPosition = glm::rotate(angle, rotationAxis) * glm::vec4(gLightPosition, 1.0f);
+        gLampOrbitAngle = fmodf(gLampOrbitAngle + angularVelocity * gDeltaTime, glm::radians(360.0f));
+        glm::vec4 newPosition = glm::rotate(gLampOrbitAngle, rotationAxis) * glm::vec4(gLampOrbitOrigin, 1.0f);
         gLightPosition.x = newPosition.x;
         gLightPosition.y = newPosition.y;
         gLightPosition.z = newPosition.z;
+        USetNodePosition(gScene, gLampNode, gLightPosition);
+    }
+
+    // While orbiting, shadows follow the lamp in fixed angle steps so every step hits a cached map. The
+    // lighting uses the same snapped position so shading and shadows always agree; only the lamp mesh
+    // moves smoothly.
+    glm::vec3 shadowLightPosition = gLightPosition;
+    if (gIsLampOrbiting) {
+        const float step = glm::radians(360.0f) / SHADOW_ORBIT_STEPS;
+        glm::vec4 snapped = glm::rotate(floorf(gLampOrbitAngle / step) * step, rotationAxis) * glm::vec4(gLampOrbitOrigin, 1.0f);
+        shadowLightPosition = glm::vec3(snapped.x, snapped.y, snapped.z);
     }
-    */
+
+    // Rebuild world matrices for nodes whose transform changed (none for a static scene)
+    UUpdateSceneTransforms(gScene);
+
+    // Collect the GPU pass timings that have finished since last time
+    UBeginGpuFrame(gGpuProfiler);
+
+    // Act on finished feedback readbacks and upload streamed tiles before anything samples the atlas
+    if (gVirtualTexturing)
+        UUpdateVirtualTexturing(gVirtualTextures);
+
     // Enable z-depth
     glEnable(GL_DEPTH_TEST);
 
@@ -595,1374 +2570,4322 @@ void URender()
 
 	if (isPerspective) {
 		// Creates a perspective projection
-		projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+		projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, NEAR_PLANE, FAR_PLANE);
 	}
 	else {
 		float scale = 1.0f; // you can adjust this value to zoom in or out in orthographic view
 		float aspectRatio = (float)WINDOW_WIDTH / (float)WINDOW_HEIGHT;
-		projection = glm::ortho(-scale * aspectRatio, scale * aspectRatio, -scale, scale, 0.1f, 100.0f);
+		projection = glm::ortho(-scale * aspectRatio, scale * aspectRatio, -scale, scale, NEAR_PLANE, FAR_PLANE);
 	}
 
 
-    glUseProgram(gProgramId);
+    // Static casters come from the cache; only dynamic casters are redrawn each frame
+    UBeginGpuScope(gGpuProfiler, "Shadows");
+    URenderShadows(gShadowMaps, gScene, shadowLightPosition);
+    UEndGpuScope(gGpuProfiler);
+
+    // The desk lamp light follows the lamp, at the position its shadow was rendered from
+    gPointLights[gLampLight].positionRadius = glm::vec4(shadowLightPosition, gPointLights[gLampLight].positionRadius.w);
+
+    // Bin the point lights into clusters, then upload camera and light data once for every program that draws this frame
+    UAssignLightsToClusters(gLightClusters, gPointLights, view, projection);
+    UUpdateFrameUniforms(view, projection, shadowLightPosition);
+
+    const glm::vec3 cameraPosition = gCamera.Position;
+
+    // Flag the nodes whose bounds intersect the view frustum and are not hidden behind occluders
+    const glm::mat4 viewProjection = projection * view;
+    UCullScene(gScene, viewProjection, gCullStats);
+    if (gOcclusionCulling)
+        UOcclusionCullScene(gScene, viewProjection, gCullStats);
+
+    // Queue every visible node, sort by GL state and submit with the fewest binds
+    UBuildRenderQueue(gRenderQueue, gScene, cameraPosition, FAR_PLANE, projection);
+    USortRenderQueue(gRenderQueue);
+    if (gDeferredShading)
+        URenderDeferred(viewProjection);
+    else if (!gRenderQueue.items.empty())
+    {
+        // Lit objects and the lamp are timed as separate passes
+        UPrepareRenderQueue(gRenderQueue, gScene);
+        if (gVirtualTexturing)
+            URenderVirtualFeedback(gVirtualTextures, gRenderQueue);
+
+        UBeginGpuScope(gGpuProfiler, "Main pass");
+        UDrawRenderQueue(gRenderQueue, gProgram.id);
+        UEndGpuScope(gGpuProfiler);
+
+        UBeginGpuScope(gGpuProfiler, "Lamp pass");
+        UDrawRenderQueue(gRenderQueue, gLampProgram.id);
+        UEndGpuScope(gGpuProfiler);
+
+        UEndObjectRingFrame(gObjectRing);
+    }
+
+    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+    if (!gHeadless)
+        glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+}
+
+
+// Packs draw state into a sort key. GL object names and mesh slots are small integers, so their low bits
+// identify them; depth is the camera distance normalized against the far plane, so nearer draws sort first
+// within a state group. Texture sorts above mesh so each texture's draws form one multi-draw run.
+uint64_t UMakeSortKey(GLuint programId, GLuint vao, GLuint textureId, GLuint meshId, float depth)
+{
+    const uint64_t depthMax = (1ull << SORT_DEPTH_BITS) - 1;
+    uint64_t depthBits = (uint64_t)(glm::clamp(depth, 0.0f, 1.0f) * (float)depthMax);
+
+    uint64_t key = programId & ((1u << SORT_PROGRAM_BITS) - 1);
+    key = (key << SORT_VAO_BITS) | (vao & ((1u << SORT_VAO_BITS) - 1));
+    key = (key << SORT_TEXTURE_BITS) | (textureId & ((1u << SORT_TEXTURE_BITS) - 1));
+    key = (key << SORT_MESH_BITS) | (meshId & ((1u << SORT_MESH_BITS) - 1));
+    key = (key << SORT_DEPTH_BITS) | depthBits;
+    return key;
+}
+
+
+// Collects one draw item per drawable scene node that survived culling, at the level of detail its
+// projected size calls for
+void UBuildRenderQueue(RenderQueue& queue, const SceneNodes& nodes, const glm::vec3& cameraPosition, float farPlane, const glm::mat4& projection)
+{
+    queue.items.clear();
+
+    // Pixels one world unit covers at unit distance; only a perspective projection shrinks with distance
+    int width, height;
+    UGetFramebufferSize(width, height);
+    const float pixelsPerUnit = projection[1][1] * height * 0.5f;
+    const bool perspective = projection[2][3] != 0.0f;
+
+    for (size_t i = 0; i < nodes.meshes.size(); ++i)
+    {
+        const GLMesh* mesh = nodes.meshes[i];
+        if (mesh == nullptr || !nodes.visible[i])
+            continue;
+
+        const glm::vec4& origin = nodes.worldMatrices[i][3];
+        float distance = glm::length(glm::vec3(origin.x, origin.y, origin.z) - cameraPosition) / farPlane;
+
+        // Diameter of the world bounding sphere on screen
+        const glm::vec3 center(nodes.centerX[i], nodes.centerY[i], nodes.centerZ[i]);
+        const float radius = glm::length(glm::vec3(nodes.extentX[i], nodes.extentY[i], nodes.extentZ[i]));
+        float pixels = 2.0f * radius * pixelsPerUnit;
+        if (perspective)
+            pixels /= std::max(glm::length(center - cameraPosition), NEAR_PLANE);
+        const GLMesh* level = USelectMeshLod(*mesh, pixels);
+
+        DrawItem item;
+        item.key = UMakeSortKey(nodes.programs[i], gMeshArena.vao, UGetMaterialTexture(gMaterials, nodes.materials[i]), level->id, distance);
+        item.node = (uint32_t)i;
+        item.mesh = level;
+        queue.items.push_back(item);
+    }
+}
+
+
+// LSD radix sort on the 64-bit keys, one byte per pass. Passes where every key
+// shares the same byte (e.g. a single program) are skipped.
+void USortRenderQueue(RenderQueue& queue)
+{
+    std::vector<DrawItem>& items = queue.items;
+    std::vector<DrawItem>& scratch = queue.scratch;
+    const size_t count = items.size();
+    if (count < 2)
+        return;
+
+    scratch.resize(count);
+
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        size_t histogram[256] = {};
+        for (size_t i = 0; i < count; ++i)
+            ++histogram[(items[i].key >> shift) & 0xFF];
+
+        if (histogram[(items[0].key >> shift) & 0xFF] == count)
+            continue;
+
+        // Turn counts into starting offsets
+        size_t offset = 0;
+        for (int b = 0; b < 256; ++b)
+        {
+            size_t bucketCount = histogram[b];
+            histogram[b] = offset;
+            offset += bucketCount;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+            scratch[histogram[(items[i].key >> shift) & 0xFF]++] = items[i];
+
+        items.swap(scratch);
+    }
+}
+
+
+// Creates the dynamic buffer that holds the frame's indirect draw commands
+void UCreateIndirectBuffer()
+{
+    glGenBuffers(1, &gIndirectBuffer);
+}
+
+
+// Creates the persistently mapped object ring with room for capacity objects in each frame region,
+// plus the static ID ramp that turns base instance + instance index into an object index
+void UCreateObjectRing(ObjectRing& ring, GLuint capacity)
+{
+    GLint alignment = 1;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+
+    ring.capacity = capacity;
+    ring.regionSize = (GLsizeiptr)sizeof(ObjectData) * capacity;
+    ring.regionSize = (ring.regionSize + alignment - 1) / alignment * alignment;
+    ring.region = 0;
+
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &ring.buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ring.buffer);
+    glBufferStorage(GL_SHADER_STORAGE_BUFFER, ring.regionSize * FRAMES_IN_FLIGHT, nullptr, flags);
+    ring.mapped = (unsigned char*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, ring.regionSize * FRAMES_IN_FLIGHT, flags);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    std::vector<GLuint> ids(capacity);
+    for (GLuint i = 0; i < capacity; ++i)
+        ids[i] = i;
+
+    glGenBuffers(1, &ring.idBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, ring.idBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint) * ids.size(), ids.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+// Grows the ring when a frame holds more objects than a region can. The old buffer may still be in
+// use by frames in flight, so those are waited on inside UDestroyObjectRing before it is released.
+void UReserveObjectRing(ObjectRing& ring, GLuint count)
+{
+    if (count <= ring.capacity)
+        return;
+
+    GLuint capacity = ring.capacity;
+    while (capacity < count)
+        capacity *= 2;
+
+    UDestroyObjectRing(ring);
+    UCreateObjectRing(ring, capacity);
+    UBindObjectIdAttribute(ring, gMeshArena.vao);
+}
+
+
+// Points a VAO's objectId attribute at the ring's ID ramp, advancing once per instance
+void UBindObjectIdAttribute(const ObjectRing& ring, GLuint vao)
+{
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, ring.idBuffer);
+    glVertexAttribIPointer(OBJECT_ID_LOCATION, 1, GL_UNSIGNED_INT, sizeof(GLuint), (void*)0);
+    glEnableVertexAttribArray(OBJECT_ID_LOCATION);
+    glVertexAttribDivisor(OBJECT_ID_LOCATION, 1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+// Returns the region for this frame once the GPU has finished reading it
+ObjectData* UBeginObjectRingFrame(ObjectRing& ring)
+{
+    GLsync& fence = ring.fences[ring.region];
+    if (fence)
+    {
+        // Usually already signaled: the region was last used FRAMES_IN_FLIGHT frames ago
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+            ;
+        glDeleteSync(fence);
+        fence = 0;
+    }
 
-    // Retrieves and passes transform matrices to the Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
+    return (ObjectData*)(ring.mapped + ring.regionSize * ring.region);
+}
+
+
+// Makes this frame's region visible to the shaders, fences it behind the frame's draws and advances the ring
+void UEndObjectRingFrame(ObjectRing& ring)
+{
+    ring.fences[ring.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ring.region = (ring.region + 1) % FRAMES_IN_FLIGHT;
+}
+
+
+void UDestroyObjectRing(ObjectRing& ring)
+{
+    for (GLsync& fence : ring.fences)
+    {
+        if (fence)
+        {
+            glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(fence);
+            fence = 0;
+        }
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ring.buffer);
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glDeleteBuffers(1, &ring.buffer);
+    glDeleteBuffers(1, &ring.idBuffer);
+    ring.mapped = nullptr;
+}
+
+
+// Writes the per-object data and builds the indirect commands for the sorted queue. Consecutive items
+// sharing program, mesh and texture become one indirect command whose instances cover them; the object
+// ring holds every item's data in queue order so each command just starts at its first item via the
+// base instance. Commands sharing program and texture form one range for glMultiDrawElementsIndirect.
+void UPrepareRenderQueue(RenderQueue& queue, const SceneNodes& nodes)
+{
+    const size_t count = queue.items.size();
+
+    // Write this frame's per-object data straight into the mapped ring, in sorted order
+    UReserveObjectRing(gObjectRing, (GLuint)count);
+    ObjectData* objects = UBeginObjectRingFrame(gObjectRing);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const int node = queue.items[i].node;
+        objects[i].model = nodes.worldMatrices[node];
+        objects[i].normal = nodes.normalMatrices[node];
+
+        const GLuint material = nodes.materials[node];
+        if (material != MATERIAL_NONE)
+        {
+            objects[i].material = glm::uvec4(gMaterials.materials[material].layer, gMaterials.materials[material].wrapMode, material, queue.items[i].mesh->id);
+            gMaterials.arrays[gMaterials.materials[material].array].lastUsed = gTextureManager.frame;
+        }
+        else
+            objects[i].material = glm::uvec4(0u, 0u, 0u, queue.items[i].mesh->id);
+    }
+
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, OBJECT_DATA_BINDING, gObjectRing.buffer,
+        gObjectRing.regionSize * gObjectRing.region, sizeof(ObjectData) * count);
+
+    // Build one indirect command per run of identical mesh/program/texture array; the layer is per object
+    queue.commands.clear();
+    queue.ranges.clear();
+
+    size_t first = 0;
+    while (first < count)
+    {
+        const uint32_t node = queue.items[first].node;
+        const GLMesh* mesh = queue.items[first].mesh;
+        const GLuint programId = nodes.programs[node];
+        const GLuint textureId = UGetMaterialTexture(gMaterials, nodes.materials[node]);
+
+        // Extend the batch over every following item with identical state
+        size_t last = first + 1;
+        while (last < count)
+        {
+            const uint32_t next = queue.items[last].node;
+            if (queue.items[last].mesh != mesh || nodes.programs[next] != programId || UGetMaterialTexture(gMaterials, nodes.materials[next]) != textureId)
+                break;
+            ++last;
+        }
+
+        DrawElementsIndirectCommand command;
+        command.count = mesh->nIndices;
+        command.instanceCount = (GLuint)(last - first);
+        command.firstIndex = mesh->firstIndex;
+        command.baseVertex = (GLint)mesh->baseVertex;
+        command.baseInstance = (GLuint)first;
+
+        // Start a new multi-draw range whenever the program or texture changes
+        if (queue.ranges.empty() || queue.ranges.back().programId != programId || queue.ranges.back().textureId != textureId)
+        {
+            IndirectRange range;
+            range.programId = programId;
+            range.textureId = textureId;
+            range.firstCommand = (GLuint)queue.commands.size();
+            range.commandCount = 0;
+            queue.ranges.push_back(range);
+        }
+
+        queue.commands.push_back(command);
+        ++queue.ranges.back().commandCount;
+
+        first = last;
+    }
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand) * queue.commands.size(), queue.commands.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+
+// Submits the prepared ranges, or only those of one program when programId is not 0, so passes
+// can split the queue without rebuilding it
+void UDrawRenderQueue(const RenderQueue& queue, GLuint programId)
+{
+    if (queue.ranges.empty())
+        return;
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+
+    // Every mesh lives in the arena, so the VAO is bound once for the whole pass
+    glBindVertexArray(gMeshArena.vao);
+    glActiveTexture(GL_TEXTURE0);
+
+    GLuint currentProgram = 0;
+    GLuint currentTexture = 0;
+
+    for (const IndirectRange& range : queue.ranges)
+    {
+        if (programId != 0 && range.programId != programId)
+            continue;
+
+        // Camera matrices come from the shared FrameData buffer, so a program switch is just the bind
+        if (range.programId != currentProgram)
+        {
+            currentProgram = range.programId;
+            glUseProgram(currentProgram);
+        }
+
+        if (range.textureId != 0 && range.textureId != currentTexture)
+        {
+            currentTexture = range.textureId;
+            glBindTexture(GL_TEXTURE_2D_ARRAY, currentTexture);
+        }
+
+        glMultiDrawElementsIndirect(GL_TRIANGLES, gMeshArena.indexType,
+            (void*)(sizeof(DrawElementsIndirectCommand) * range.firstCommand), range.commandCount, 0);
+    }
+
+    // Deactivate the Vertex Array Object
+    glBindVertexArray(0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+
+// Creates the shadow framebuffer, the composite map and the caster buffer. Cache slot maps are
+// allocated on first use.
+bool UCreateShadowMaps(ShadowMaps& shadows)
+{
+    glGenTextures(1, &shadows.composite);
+    glBindTexture(GL_TEXTURE_2D, shadows.composite);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    UTrackTexture(gTextureManager, shadows.composite, UTextureBytes(GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 1, 1));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &shadows.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadows.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadows.composite, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOutputFramebuffer);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << "Shadow framebuffer incomplete: 0x" << std::hex << status << std::dec << endl;
+        return false;
+    }
+
+    glGenBuffers(1, &shadows.objectBuffer);
+    return true;
+}
+
+
+void UDestroyShadowMaps(ShadowMaps& shadows)
+{
+    for (ShadowCacheSlot& slot : shadows.slots)
+        UDestroyTexture(slot.texture);
+    UDestroyTexture(shadows.composite);
+    glDeleteFramebuffers(1, &shadows.fbo);
+    glDeleteBuffers(1, &shadows.objectBuffer);
+    shadows = ShadowMaps();
+}
+
+
+// Draws every caster of one kind into the bound depth target with the shadow program.
+// Casters get their own object buffer so the per-frame ring stays free for the camera pass.
+void UDrawShadowCasters(ShadowMaps& shadows, const SceneNodes& nodes, unsigned char mode)
+{
+    std::vector<ObjectData> objects;
+    std::vector<int> casters;
+    for (size_t i = 0; i < nodes.meshes.size(); ++i)
+    {
+        if (nodes.meshes[i] == nullptr || nodes.shadowCasters[i] != mode)
+            continue;
+
+        ObjectData object;
+        object.model = nodes.worldMatrices[i];
+        object.normal = nodes.normalMatrices[i];
+        object.material = glm::uvec4(0u, 0u, 0u, nodes.meshes[i]->id);
+        objects.push_back(object);
+        casters.push_back((int)i);
+    }
+    if (casters.empty())
+        return;
+
+    // The caster buffer is sized per call, but base instances still go through the ring's ID ramp
+    UReserveObjectRing(gObjectRing, (GLuint)casters.size());
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, shadows.objectBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(ObjectData) * objects.size(), objects.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, OBJECT_DATA_BINDING, shadows.objectBuffer, 0, sizeof(ObjectData) * objects.size());
+
+    glUseProgram(gShadowProgram.id);
+    glUniformMatrix4fv(UGetUniformLocation(gShadowProgram, "uLightViewProjection"), 1, GL_FALSE,
+        glm::value_ptr(shadows.lightViewProjection));
+
+    // The base instance selects the caster's entry through the objectId ramp
+    glBindVertexArray(gMeshArena.vao);
+    for (size_t i = 0; i < casters.size(); ++i)
+    {
+        const GLMesh* mesh = nodes.meshes[casters[i]];
+        glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, mesh->nIndices, gMeshArena.indexType,
+            (void*)((size_t)gMeshArena.indexSize * mesh->firstIndex), 1, (GLint)mesh->baseVertex, (GLuint)i);
+    }
+    glBindVertexArray(0);
+}
+
+
+// Selects or renders the static shadow map for this light position and adds the dynamic casters.
+// Slots are keyed by the light position quantized to a millimetre and recycled least recently used;
+// any change to a static caster invalidates every slot.
+void URenderShadows(ShadowMaps& shadows, SceneNodes& nodes, const glm::vec3& lightPosition)
+{
+    ++shadows.frame;
+
+    if (nodes.staticShadowsChanged)
+    {
+        for (ShadowCacheSlot& slot : shadows.slots)
+            slot.valid = false;
+        nodes.staticShadowsChanged = false;
+    }
+
+    // Perspective frustum from the lamp towards the desk
+    glm::vec3 up = fabsf(glm::normalize(SHADOW_TARGET - lightPosition).y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+    shadows.lightViewProjection = glm::perspective(glm::radians(120.0f), 1.0f, NEAR_PLANE, 20.0f)
+        * glm::lookAt(lightPosition, SHADOW_TARGET, up);
+
+    auto quantize = [](float value) { return (uint64_t)(int64_t)lroundf(value * 1000.0f) & 0x1FFFFF; };
+    const uint64_t key = (quantize(lightPosition.x) << 42) | (quantize(lightPosition.y) << 21) | quantize(lightPosition.z);
+
+    // Find the slot for this position, otherwise the free or least recently used one
+    ShadowCacheSlot* slot = nullptr;
+    ShadowCacheSlot* victim = &shadows.slots[0];
+    for (ShadowCacheSlot& candidate : shadows.slots)
+    {
+        if (candidate.valid && candidate.key == key)
+        {
+            slot = &candidate;
+            break;
+        }
+        if (victim->valid && (!candidate.valid || candidate.lastUsed < victim->lastUsed))
+            victim = &candidate;
+    }
+
+    int width, height;
+    UGetFramebufferSize(width, height);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, shadows.fbo);
+    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    glEnable(GL_DEPTH_TEST);
+
+    if (slot != nullptr)
+    {
+        ++shadows.cacheHits;
+    }
+    else
+    {
+        slot = victim;
+        if (slot->texture == 0)
+        {
+            glGenTextures(1, &slot->texture);
+            glBindTexture(GL_TEXTURE_2D, slot->texture);
+            glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+            UTrackTexture(gTextureManager, slot->texture, UTextureBytes(GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 1, 1));
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, slot->texture, 0);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        UDrawShadowCasters(shadows, nodes, SHADOW_CASTER_STATIC);
+
+        slot->key = key;
+        slot->valid = true;
+        ++shadows.staticRenders;
+    }
+    slot->lastUsed = shadows.frame;
+    shadows.current = slot->texture;
+
+    // Dynamic casters go on top of a copy so the cached map stays clean
+    bool hasDynamic = std::find(nodes.shadowCasters.begin(), nodes.shadowCasters.end(), SHADOW_CASTER_DYNAMIC) != nodes.shadowCasters.end();
+    if (hasDynamic)
+    {
+        glCopyImageSubData(slot->texture, GL_TEXTURE_2D, 0, 0, 0, 0, shadows.composite, GL_TEXTURE_2D, 0, 0, 0, 0,
+            SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 1);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, shadows.composite, 0);
+        UDrawShadowCasters(shadows, nodes, SHADOW_CASTER_DYNAMIC);
+        shadows.current = shadows.composite;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, gOutputFramebuffer);
+    glViewport(0, 0, width, height);
+
+    glActiveTexture(GL_TEXTURE0 + SHADOW_MAP_UNIT);
+    glBindTexture(GL_TEXTURE_2D, shadows.current);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+
+// Microseconds on the clock shared by every trace event
+double UGetTraceMicroseconds()
+{
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+#if ENABLE_PROFILING
+// Returns the calling thread's ring, registering it on first use
+ProfileThreadBuffer* UGetProfileThreadBuffer()
+{
+    thread_local ProfileThreadBuffer* buffer = nullptr;
+    if (buffer == nullptr)
+    {
+        std::lock_guard<std::mutex> lock(gProfileRegistry.mutex);
+        gProfileRegistry.threads.push_back(std::unique_ptr<ProfileThreadBuffer>(new ProfileThreadBuffer()));
+        buffer = gProfileRegistry.threads.back().get();
+        buffer->id = (int)gProfileRegistry.threads.size() - 1;
+    }
+    return buffer;
+}
+
+
+// Labels the calling thread's track in exported traces; the name must be a string literal
+void USetProfileThreadName(const char* name)
+{
+    UGetProfileThreadBuffer()->name = name;
+}
+
+
+void URecordProfileEvent(const char* name, double begin, double end)
+{
+    ProfileThreadBuffer* buffer = UGetProfileThreadBuffer();
+    const uint64_t index = buffer->written.load(std::memory_order_relaxed);
+    ProfileEvent& event = buffer->events[index & (PROFILE_RING_SIZE - 1)];
+    event.name = name;
+    event.begin = begin;
+    event.end = end;
+    buffer->written.store(index + 1, std::memory_order_release);
+}
+
+
+ProfileZone::ProfileZone(const char* zoneName)
+    : name(zoneName), begin(UGetTraceMicroseconds())
+{
+}
+
+
+ProfileZone::~ProfileZone()
+{
+    URecordProfileEvent(name, begin, UGetTraceMicroseconds());
+}
+#endif
+
+
+// Allocates every query up front; pipeline statistics only when the extension is present
+void UCreateGpuProfiler(GpuProfiler& profiler)
+{
+    profiler.statisticsSupported = GLEW_ARB_pipeline_statistics_query != GL_FALSE;
+
+    for (int set = 0; set < GPU_QUERY_FRAMES; ++set)
+    {
+        for (GpuScopeQueries& scope : profiler.scopes[set])
+        {
+            glGenQueries(1, &scope.timer);
+            if (profiler.statisticsSupported)
+                glGenQueries(PIPELINE_STATISTIC_COUNT, scope.statistics);
+        }
+    }
+}
+
+
+void UDestroyGpuProfiler(GpuProfiler& profiler)
+{
+    for (int set = 0; set < GPU_QUERY_FRAMES; ++set)
+    {
+        for (GpuScopeQueries& scope : profiler.scopes[set])
+        {
+            glDeleteQueries(1, &scope.timer);
+            if (profiler.statisticsSupported)
+                glDeleteQueries(PIPELINE_STATISTIC_COUNT, scope.statistics);
+        }
+    }
+}
+
+
+// Switches to the query set issued GPU_QUERY_FRAMES frames ago and harvests its results
+void UBeginGpuFrame(GpuProfiler& profiler)
+{
+    ++profiler.frame;
+    const int set = (int)(profiler.frame % GPU_QUERY_FRAMES);
+
+    profiler.lastFrame.clear();
+    for (int i = 0; i < profiler.scopeCount[set]; ++i)
+    {
+        const GpuScopeQueries& scope = profiler.scopes[set][i];
+
+        // Skip rather than stall when the GPU is further behind than the double buffering covers
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(scope.timer, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+        {
+            ++profiler.dropped;
+            continue;
+        }
+
+        GpuScopeResult result = {};
+        result.name = scope.name;
+        result.frame = scope.frame;
+        result.cpuBegin = scope.cpuBegin;
+        result.cpuMicroseconds = scope.cpuEnd - scope.cpuBegin;
+
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(scope.timer, GL_QUERY_RESULT, &nanoseconds);
+        result.gpuMicroseconds = nanoseconds / 1000.0;
+
+        if (profiler.statisticsSupported)
+        {
+            for (int s = 0; s < PIPELINE_STATISTIC_COUNT; ++s)
+                glGetQueryObjectui64v(scope.statistics[s], GL_QUERY_RESULT, &result.statistics[s]);
+        }
+
+        profiler.lastFrame.push_back(result);
+        profiler.history.push_back(result);
+        if (profiler.history.size() > (size_t)GPU_TRACE_HISTORY)
+            profiler.history.pop_front();
+    }
+    profiler.scopeCount[set] = 0;
+}
+
+
+// Opens a named pass scope; the name must outlive the profiler (string literals)
+void UBeginGpuScope(GpuProfiler& profiler, const char* name)
+{
+    const int set = (int)(profiler.frame % GPU_QUERY_FRAMES);
+    if (profiler.open >= 0 || profiler.scopeCount[set] >= GPU_MAX_SCOPES)
+        return;
+
+    profiler.open = profiler.scopeCount[set]++;
+    GpuScopeQueries& scope = profiler.scopes[set][profiler.open];
+    scope.name = name;
+    scope.frame = profiler.frame;
+    scope.cpuBegin = UGetTraceMicroseconds();
+
+    glBeginQuery(GL_TIME_ELAPSED, scope.timer);
+    if (profiler.statisticsSupported)
+    {
+        for (int s = 0; s < PIPELINE_STATISTIC_COUNT; ++s)
+            glBeginQuery(PIPELINE_STATISTIC_TARGETS[s], scope.statistics[s]);
+    }
+}
+
+
+void UEndGpuScope(GpuProfiler& profiler)
+{
+    if (profiler.open < 0)
+        return;
+
+    GpuScopeQueries& scope = profiler.scopes[profiler.frame % GPU_QUERY_FRAMES][profiler.open];
+    glEndQuery(GL_TIME_ELAPSED);
+    if (profiler.statisticsSupported)
+    {
+        for (int s = 0; s < PIPELINE_STATISTIC_COUNT; ++s)
+            glEndQuery(PIPELINE_STATISTIC_TARGETS[s]);
+    }
+    scope.cpuEnd = UGetTraceMicroseconds();
+    profiler.open = -1;
+}
+
+
+// Writes the recorded CPU zones and retained pass timings in the Chrome trace event format
+// (chrome://tracing, Perfetto). Each profiled thread gets a track; pass CPU submission spans go on
+// one more track and GPU durations on another; elapsed-time queries carry no
+// start time, so each GPU span is placed at its pass's CPU submission time.
+bool UWriteChromeTrace(const std::string& path, const GpuProfiler& profiler)
+{
+    std::ofstream trace(path);
+    if (!trace)
+        return false;
+
+    trace << "{\"traceEvents\":[\n";
+    trace << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU passes\"}},\n";
+    trace << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU passes\"}}";
+
+#if ENABLE_PROFILING
+    // CPU zones, one track per recording thread
+    {
+        std::lock_guard<std::mutex> lock(gProfileRegistry.mutex);
+        for (const std::unique_ptr<ProfileThreadBuffer>& thread : gProfileRegistry.threads)
+        {
+            const uint64_t written = thread->written.load(std::memory_order_acquire);
+            const uint64_t first = written > PROFILE_RING_SIZE ? written - PROFILE_RING_SIZE : 0;
+            std::vector<ProfileEvent> events;
+            for (uint64_t i = first; i < written; ++i)
+                events.push_back(thread->events[i & (PROFILE_RING_SIZE - 1)]);
+
+            // The owner keeps recording; slots it reached during the copy may be torn
+            const uint64_t after = thread->written.load(std::memory_order_acquire);
+            const uint64_t valid = after + 1 > PROFILE_RING_SIZE ? after + 1 - PROFILE_RING_SIZE : 0;
+
+            const int tid = 10 + thread->id;
+            trace << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+                << ",\"args\":{\"name\":\"" << thread->name << " " << thread->id << "\"}}";
+            for (uint64_t i = std::max(first, valid); i < written; ++i)
+            {
+                const ProfileEvent& event = events[i - first];
+                trace << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                    << ",\"ts\":" << event.begin << ",\"dur\":" << event.end - event.begin << "}";
+            }
+        }
+    }
+#endif
+
+    for (const GpuScopeResult& scope : profiler.history)
+    {
+        trace << ",\n{\"name\":\"" << scope.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << scope.cpuBegin
+            << ",\"dur\":" << scope.cpuMicroseconds << ",\"args\":{\"frame\":" << scope.frame << "}}";
+
+        trace << ",\n{\"name\":\"" << scope.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":" << scope.cpuBegin
+            << ",\"dur\":" << scope.gpuMicroseconds << ",\"args\":{\"frame\":" << scope.frame;
+        if (profiler.statisticsSupported)
+        {
+            for (int s = 0; s < PIPELINE_STATISTIC_COUNT; ++s)
+                trace << ",\"" << PIPELINE_STATISTIC_NAMES[s] << "\":" << scope.statistics[s];
+        }
+        trace << "}}";
+    }
+
+    trace << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return (bool)trace;
+}
+
+
+// Allocates the G-buffer attachments at the framebuffer size
+bool UCreateGBuffer(GBuffer& gbuffer, int width, int height)
+{
+    gbuffer.width = width;
+    gbuffer.height = height;
+
+    auto createTarget = [width, height](GLuint& texture, GLenum internalFormat)
+    {
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, width, height);
+        UTrackTexture(gTextureManager, texture, UTextureBytes(internalFormat, width, height, 1, 1));
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    };
+    createTarget(gbuffer.albedo, GL_RGBA8);
+    createTarget(gbuffer.normal, GL_RG16_SNORM);
+    createTarget(gbuffer.depth, GL_DEPTH24_STENCIL8);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &gbuffer.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gbuffer.albedo, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gbuffer.normal, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, gbuffer.depth, 0);
+
+    const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, drawBuffers);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOutputFramebuffer);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << "G-buffer incomplete: 0x" << std::hex << status << std::dec << endl;
+        return false;
+    }
+    return true;
+}
+
+
+void UDestroyGBuffer(GBuffer& gbuffer)
+{
+    glDeleteFramebuffers(1, &gbuffer.fbo);
+    UDestroyTexture(gbuffer.albedo);
+    UDestroyTexture(gbuffer.normal);
+    UDestroyTexture(gbuffer.depth);
+    gbuffer = GBuffer();
+}
+
+
+// Deferred path: the scene program fills the G-buffer, one full-screen pass lights every visible
+// pixel once, then the unlit lamp is drawn forward against the G-buffer's depth
+void URenderDeferred(const glm::mat4& viewProjection)
+{
+    int width, height;
+    UGetFramebufferSize(width, height);
+    if (width == 0 || height == 0)
+        return;     // Minimized
+
+    if (width != gGBuffer.width || height != gGBuffer.height)
+    {
+        UDestroyGBuffer(gGBuffer);
+        if (!UCreateGBuffer(gGBuffer, width, height))
+            return;
+    }
+
+    if (gRenderQueue.items.empty())
+        return;
+    UPrepareRenderQueue(gRenderQueue, gScene);
+    if (gVirtualTexturing)
+        URenderVirtualFeedback(gVirtualTextures, gRenderQueue);
+
+    // Geometry pass
+    UBeginGpuScope(gGpuProfiler, "Geometry pass");
+    glBindFramebuffer(GL_FRAMEBUFFER, gGBuffer.fbo);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    UDrawRenderQueue(gRenderQueue, gProgram.id);
+    UEndGpuScope(gGpuProfiler);
+
+    // Lighting pass
+    UBeginGpuScope(gGpuProfiler, "Lighting pass");
+    glBindFramebuffer(GL_FRAMEBUFFER, gOutputFramebuffer);
+    glDisable(GL_DEPTH_TEST);
+    glUseProgram(gDeferredLightingProgram.id);
+    glUniformMatrix4fv(UGetUniformLocation(gDeferredLightingProgram, "uInverseViewProjection"), 1, GL_FALSE,
+        glm::value_ptr(glm::inverse(viewProjection)));
+
+    const GLuint targets[] = { gGBuffer.albedo, gGBuffer.normal, gGBuffer.depth };
+    for (GLuint unit = 0; unit < 3; ++unit)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, targets[unit]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    glBindVertexArray(gFullscreenVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+    glEnable(GL_DEPTH_TEST);
+    UEndGpuScope(gGpuProfiler);
+
+    // Forward-shaded lamp, depth tested against the scene
+    UBeginGpuScope(gGpuProfiler, "Lamp pass");
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, gGBuffer.fbo);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOutputFramebuffer);
+    UDrawRenderQueue(gRenderQueue, gLampProgram.id);
+    UEndGpuScope(gGpuProfiler);
+
+    UEndObjectRingFrame(gObjectRing);
+}
+
+
+// Prints the average frame time of the active render path every two seconds
+void UReportFrameTime(float deltaTime)
+{
+    static float elapsed = 0.0f;
+    static int frames = 0;
+
+    elapsed += deltaTime;
+    ++frames;
+    if (elapsed < 2.0f)
+        return;
+
+    const float milliseconds = elapsed * 1000.0f / frames;
+    cout << (gDeferredShading ? "Deferred" : "Forward") << " shading: " << milliseconds << " ms/frame ("
+        << frames / elapsed << " fps)" << endl;
+    cout << "Textures: " << gTextureManager.residentBytes / 1048576.0 << " MB resident (peak " << gTextureManager.peakBytes / 1048576.0
+        << " MB, budget " << (gTextureManager.budgetBytes >> 20) << " MB), " << gTextureManager.droppedLevels << " levels dropped, "
+        << gTextureManager.restoredLevels << " restored" << endl;
+    if (gVirtualTexturing)
+        cout << "Virtual textures: " << gVirtualTextures.residentTiles.size() << "/" << gVirtualTextures.pages.size()
+            << " pages resident, " << gVirtualTextures.uploads << " uploads, " << gVirtualTextures.evictions << " evictions" << endl;
+
+    elapsed = 0.0f;
+    frames = 0;
+}
+
+
+// Appends a node to the scene and returns its index. Parents must be added before their children.
+int UAddSceneNode(SceneNodes& nodes, int parent, const GLMesh* mesh, GLuint programId, GLuint material,
+    const glm::vec3& position, float angle, const glm::vec3& axis, const glm::vec3& scale)
+{
+    nodes.positions.push_back(position);
+    nodes.rotations.push_back(glm::vec4(axis, angle));
+    nodes.scales.push_back(scale);
+    nodes.parents.push_back(parent);
+
+    nodes.worldMatrices.push_back(glm::mat4(1.0f));
+    nodes.normalMatrices.push_back(glm::mat4(1.0f));
+    nodes.uniformScale.push_back(1);
+    nodes.dirty.push_back(1);
+    ++nodes.dirtyCount;
+
+    nodes.centerX.push_back(0.0f);
+    nodes.centerY.push_back(0.0f);
+    nodes.centerZ.push_back(0.0f);
+    nodes.extentX.push_back(0.0f);
+    nodes.extentY.push_back(0.0f);
+    nodes.extentZ.push_back(0.0f);
+    nodes.visible.push_back(1);
+    nodes.occluders.push_back(0);
+    nodes.shadowCasters.push_back(SHADOW_CASTER_NONE);
+
+    nodes.meshes.push_back(mesh);
+    nodes.programs.push_back(programId);
+    nodes.materials.push_back(material);
+
+    return (int)nodes.positions.size() - 1;
+}
+
+
+// Moves a node and flags it so its world matrix is rebuilt on the next update
+void USetNodePosition(SceneNodes& nodes, int node, const glm::vec3& position)
+{
+    nodes.positions[node] = position;
+    if (!nodes.dirty[node])
+    {
+        nodes.dirty[node] = 1;
+        ++nodes.dirtyCount;
+    }
+}
+
+
+// Rebuilds the cached world matrix of every dirty node and of every node below a dirty parent
+void UUpdateSceneTransforms(SceneNodes& nodes)
+{
+    // Static scenes pay nothing once the first frame has been built
+    if (nodes.dirtyCount == 0)
+        return;
+
+    const size_t nodeCount = nodes.positions.size();
+    nodes.cofactorScratch.clear();
+
+    // Parents always precede their children, so one forward sweep resolves the whole hierarchy
+    for (size_t i = 0; i < nodeCount; ++i)
+    {
+        const int parent = nodes.parents[i];
+        if (parent >= 0 && nodes.dirty[parent])
+            nodes.dirty[i] = 1;
+
+        if (!nodes.dirty[i])
+            continue;
+
+        const glm::vec4& rotation = nodes.rotations[i];
+        // Model matrix: transformations are applied right-to-left order
+        glm::mat4 local = glm::translate(nodes.positions[i])
+            * glm::rotate(rotation.w, glm::vec3(rotation.x, rotation.y, rotation.z))
+            * glm::scale(nodes.scales[i]);
+
+        const glm::mat4& world = nodes.worldMatrices[i] = parent >= 0 ? nodes.worldMatrices[parent] * local : local;
+
+        // Rotation and uniform scale keep normals perpendicular, so the model matrix itself serves
+        // as the normal matrix (normals are renormalized in the fragment shader). Only non-uniformly
+        // scaled nodes are queued for the batched cofactor pass below.
+        const glm::vec3& scale = nodes.scales[i];
+        const bool uniform = scale.x == scale.y && scale.y == scale.z && (parent < 0 || nodes.uniformScale[parent]);
+        nodes.uniformScale[i] = uniform ? 1 : 0;
+        if (uniform)
+            nodes.normalMatrices[i] = world;
+        else
+            nodes.cofactorScratch.push_back((int)i);
+
+        if (nodes.shadowCasters[i] == SHADOW_CASTER_STATIC)
+            nodes.staticShadowsChanged = true;
+
+        // Refit the world bounding box: transform the local center, and project the local
+        // half-extents onto each world axis through the absolute matrix
+        const GLMesh* mesh = nodes.meshes[i];
+        if (mesh != nullptr)
+        {
+            glm::vec3 localCenter = (mesh->boundsMin + mesh->boundsMax) * 0.5f;
+            glm::vec3 localExtent = (mesh->boundsMax - mesh->boundsMin) * 0.5f;
+            glm::vec4 center = world * glm::vec4(localCenter, 1.0f);
+
+            nodes.centerX[i] = center.x;
+            nodes.centerY[i] = center.y;
+            nodes.centerZ[i] = center.z;
+            nodes.extentX[i] = fabsf(world[0].x) * localExtent.x + fabsf(world[1].x) * localExtent.y + fabsf(world[2].x) * localExtent.z;
+            nodes.extentY[i] = fabsf(world[0].y) * localExtent.x + fabsf(world[1].y) * localExtent.y + fabsf(world[2].y) * localExtent.z;
+            nodes.extentZ[i] = fabsf(world[0].z) * localExtent.x + fabsf(world[1].z) * localExtent.y + fabsf(world[2].z) * localExtent.z;
+        }
+    }
+
+    UComputeNormalMatrices(nodes.worldMatrices.data(), nodes.normalMatrices.data(),
+        nodes.cofactorScratch.data(), nodes.cofactorScratch.size());
+
+    std::fill(nodes.dirty.begin(), nodes.dirty.end(), 0);
+    nodes.dirtyCount = 0;
+}
+
+
+// Writes the normal matrix of each listed node as the cofactor matrix of its upper 3x3:
+// columns c1 x c2, c2 x c0 and c0 x c1. That equals det * inverse-transpose, so no inverse or
+// division is needed; the sign of det is folded in so mirrored transforms keep outward normals.
+void UComputeNormalMatrices(const glm::mat4* worldMatrices, glm::mat4* normalMatrices, const int* nodes, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    // Four matrices per iteration: transpose their columns so each register holds one element of four nodes
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 c[3][3];     // c[column][row], four nodes per lane
+        for (int column = 0; column < 3; ++column)
+        {
+            __m128 m0 = _mm_loadu_ps(&worldMatrices[nodes[i + 0]][column][0]);
+            __m128 m1 = _mm_loadu_ps(&worldMatrices[nodes[i + 1]][column][0]);
+            __m128 m2 = _mm_loadu_ps(&worldMatrices[nodes[i + 2]][column][0]);
+            __m128 m3 = _mm_loadu_ps(&worldMatrices[nodes[i + 3]][column][0]);
+            _MM_TRANSPOSE4_PS(m0, m1, m2, m3);
+            c[column][0] = m0;
+            c[column][1] = m1;
+            c[column][2] = m2;
+        }
+
+        // n[k] = c[k+1] x c[k+2]
+        __m128 n[3][4];
+        for (int k = 0; k < 3; ++k)
+        {
+            const __m128* a = c[(k + 1) % 3];
+            const __m128* b = c[(k + 2) % 3];
+            n[k][0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+            n[k][1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+            n[k][2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+            n[k][3] = _mm_setzero_ps();
+        }
+
+        // det = c0 . (c1 x c2); flip every element of nodes with a negative determinant
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c[0][0], n[0][0]), _mm_mul_ps(c[0][1], n[0][1])),
+            _mm_mul_ps(c[0][2], n[0][2]));
+        __m128 sign = _mm_and_ps(det, _mm_set1_ps(-0.0f));
+
+        for (int k = 0; k < 3; ++k)
+        {
+            __m128 r0 = _mm_xor_ps(n[k][0], sign), r1 = _mm_xor_ps(n[k][1], sign);
+            __m128 r2 = _mm_xor_ps(n[k][2], sign), r3 = n[k][3];
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            _mm_storeu_ps(&normalMatrices[nodes[i + 0]][k][0], r0);
+            _mm_storeu_ps(&normalMatrices[nodes[i + 1]][k][0], r1);
+            _mm_storeu_ps(&normalMatrices[nodes[i + 2]][k][0], r2);
+            _mm_storeu_ps(&normalMatrices[nodes[i + 3]][k][0], r3);
+        }
+        for (int j = 0; j < 4; ++j)
+            normalMatrices[nodes[i + j]][3] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    }
+#endif
+
+    // Remaining nodes
+    for (; i < count; ++i)
+    {
+        const glm::mat4& world = worldMatrices[nodes[i]];
+        const glm::vec3 c0(world[0]), c1(world[1]), c2(world[2]);
+        glm::vec3 n0 = glm::cross(c1, c2);
+        const float sign = glm::dot(c0, n0) < 0.0f ? -1.0f : 1.0f;
+
+        glm::mat4& normal = normalMatrices[nodes[i]];
+        normal[0] = glm::vec4(n0 * sign, 0.0f);
+        normal[1] = glm::vec4(glm::cross(c2, c0) * sign, 0.0f);
+        normal[2] = glm::vec4(glm::cross(c0, c1) * sign, 0.0f);
+        normal[3] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    }
+}
+
+
+// Extracts the left, right, bottom, top, near and far planes (xyz = normal, w = distance) from a
+// view-projection matrix. Normals point into the frustum, so a point is inside when dot(n, p) + w >= 0.
+void UExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4 planes[6])
+{
+    const glm::mat4 m = glm::transpose(viewProjection);    // Rows of the matrix as columns
+
+    planes[0] = m[3] + m[0];
+    planes[1] = m[3] - m[0];
+    planes[2] = m[3] + m[1];
+    planes[3] = m[3] - m[1];
+    planes[4] = m[3] + m[2];
+    planes[5] = m[3] - m[2];
+
+    for (int p = 0; p < 6; ++p)
+        planes[p] = planes[p] / glm::length(glm::vec3(planes[p].x, planes[p].y, planes[p].z));
+}
+
+
+// Tests every node's world bounding box against the frustum and stores the result in nodes.visible.
+// A box is rejected when it lies entirely behind any plane: the plane distance of its center plus
+// its projected radius |n.x|*e.x + |n.y|*e.y + |n.z|*e.z is negative.
+void UCullScene(SceneNodes& nodes, const glm::mat4& viewProjection, CullStats& stats)
+{
+    glm::vec4 planes[6];
+    UExtractFrustumPlanes(viewProjection, planes);
+
+    const size_t nodeCount = nodes.centerX.size();
+    const float* cx = nodes.centerX.data();
+    const float* cy = nodes.centerY.data();
+    const float* cz = nodes.centerZ.data();
+    const float* ex = nodes.extentX.data();
+    const float* ey = nodes.extentY.data();
+    const float* ez = nodes.extentZ.data();
+    unsigned char* visible = nodes.visible.data();
+
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    // Eight nodes per iteration
+    for (; i + 8 <= nodeCount; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(cx + i), y = _mm256_loadu_ps(cy + i), z = _mm256_loadu_ps(cz + i);
+        __m256 hx = _mm256_loadu_ps(ex + i), hy = _mm256_loadu_ps(ey + i), hz = _mm256_loadu_ps(ez + i);
+        __m256 outside = _mm256_setzero_ps();
+
+        for (int p = 0; p < 6; ++p)
+        {
+            __m256 nx = _mm256_set1_ps(planes[p].x), ny = _mm256_set1_ps(planes[p].y), nz = _mm256_set1_ps(planes[p].z);
+            __m256 ax = _mm256_set1_ps(fabsf(planes[p].x)), ay = _mm256_set1_ps(fabsf(planes[p].y)), az = _mm256_set1_ps(fabsf(planes[p].z));
+
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, x), _mm256_mul_ps(ny, y)),
+                _mm256_add_ps(_mm256_mul_ps(nz, z), _mm256_set1_ps(planes[p].w)));
+            __m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, hx), _mm256_mul_ps(ay, hy)), _mm256_mul_ps(az, hz));
+
+            outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), _mm256_setzero_ps(), _CMP_LT_OQ));
+        }
+
+        int mask = _mm256_movemask_ps(outside);
+        for (int lane = 0; lane < 8; ++lane)
+            visible[i + lane] = (mask >> lane) & 1 ? 0 : 1;
+    }
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    // Four nodes per iteration
+    for (; i + 4 <= nodeCount; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(cx + i), y = _mm_loadu_ps(cy + i), z = _mm_loadu_ps(cz + i);
+        __m128 hx = _mm_loadu_ps(ex + i), hy = _mm_loadu_ps(ey + i), hz = _mm_loadu_ps(ez + i);
+        __m128 outside = _mm_setzero_ps();
+
+        for (int p = 0; p < 6; ++p)
+        {
+            __m128 nx = _mm_set1_ps(planes[p].x), ny = _mm_set1_ps(planes[p].y), nz = _mm_set1_ps(planes[p].z);
+            __m128 ax = _mm_set1_ps(fabsf(planes[p].x)), ay = _mm_set1_ps(fabsf(planes[p].y)), az = _mm_set1_ps(fabsf(planes[p].z));
+
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, x), _mm_mul_ps(ny, y)),
+                _mm_add_ps(_mm_mul_ps(nz, z), _mm_set1_ps(planes[p].w)));
+            __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, hx), _mm_mul_ps(ay, hy)), _mm_mul_ps(az, hz));
+
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+        }
+
+        int mask = _mm_movemask_ps(outside);
+        for (int lane = 0; lane < 4; ++lane)
+            visible[i + lane] = (mask >> lane) & 1 ? 0 : 1;
+    }
+#endif
+
+    // Scalar fallback and the nodes left over after the last full SIMD batch
+    for (; i < nodeCount; ++i)
+    {
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; ++p)
+        {
+            float distance = planes[p].x * cx[i] + planes[p].y * cy[i] + planes[p].z * cz[i] + planes[p].w;
+            float radius = fabsf(planes[p].x) * ex[i] + fabsf(planes[p].y) * ey[i] + fabsf(planes[p].z) * ez[i];
+            inside = distance + radius >= 0.0f;
+        }
+        visible[i] = inside ? 1 : 0;
+    }
+
+    // Only drawable nodes count towards the statistics
+    stats.tested = 0;
+    stats.rejected = 0;
+    stats.occluded = 0;
+    for (size_t n = 0; n < nodeCount; ++n)
+    {
+        if (nodes.meshes[n] == nullptr)
+            continue;
+        ++stats.tested;
+        if (!visible[n])
+            ++stats.rejected;
+    }
+}
+
+
+// Marks a node as an occluder: its mesh is rasterized into the CPU depth buffer every frame
+void USetNodeOccluder(SceneNodes& nodes, int node, bool occluder)
+{
+    nodes.occluders[node] = occluder ? 1 : 0;
+}
+
+
+// Sets whether a node casts shadows, and whether it belongs to the cached static map
+void USetNodeShadowCaster(SceneNodes& nodes, int node, unsigned char mode)
+{
+    if (nodes.shadowCasters[node] == SHADOW_CASTER_STATIC || mode == SHADOW_CASTER_STATIC)
+        nodes.staticShadowsChanged = true;
+    nodes.shadowCasters[node] = mode;
+}
+
+
+// Starts the worker threads. Each waits for tasks until the pool is stopped.
+void UStartThreadPool(ThreadPool& pool, unsigned workerCount)
+{
+    pool.stopping = false;
+    for (unsigned i = 0; i < workerCount; ++i)
+    {
+        pool.workers.emplace_back([&pool]()
+        {
+            PROFILE_THREAD_NAME("Worker");
+            for (;;)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(pool.mutex);
+                    pool.wake.wait(lock, [&pool]() { return pool.stopping || !pool.tasks.empty(); });
+                    if (pool.stopping && pool.tasks.empty())
+                        return;
+                    task = std::move(pool.tasks.front());
+                    pool.tasks.pop_front();
+                }
+                PROFILE_ZONE("Task");
+                task();
+            }
+        });
+    }
+}
+
+
+void USubmitTask(ThreadPool& pool, std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.tasks.push_back(std::move(task));
+    }
+    pool.wake.notify_one();
+}
+
+
+// Runs body(0..count-1) across the pool and the calling thread, returning when every index is done.
+// The caller pulls indices too, so it finishes the work itself when all workers are busy elsewhere.
+void UParallelFor(ThreadPool& pool, size_t count, const std::function<void(size_t)>& body)
+{
+    if (count == 0)
+        return;
+
+    struct Job
+    {
+        std::atomic<size_t> next{ 0 };
+        std::atomic<size_t> finished{ 0 };
+        size_t count = 0;
+        std::function<void(size_t)> body;
+    };
+
+    // Shared ownership: helpers that start after the caller has returned must still see valid state
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->count = count;
+    job->body = body;
+
+    auto work = [job]()
+    {
+        size_t index;
+        while ((index = job->next.fetch_add(1)) < job->count)
+        {
+            job->body(index);
+            job->finished.fetch_add(1);
+        }
+    };
+
+    size_t helpers = std::min(pool.workers.size(), count - 1);
+    for (size_t i = 0; i < helpers; ++i)
+        USubmitTask(pool, work);
+
+    work();
+    while (job->finished.load() < count)
+        std::this_thread::yield();
+}
+
+
+void UStopThreadPool(ThreadPool& pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.stopping = true;
+    }
+    pool.wake.notify_all();
+
+    for (std::thread& worker : pool.workers)
+        worker.join();
+    pool.workers.clear();
+}
+
+
+// Renders the occluder meshes into the low-resolution depth buffer and rebuilds the HiZ pyramid.
+// Triangles are transformed and binned on the calling thread; tiles are then rasterized in parallel,
+// each tile owning its pixels so no synchronization is needed.
+void URasterizeOccluders(OcclusionBuffer& buffer, const SceneNodes& nodes, const glm::mat4& viewProjection)
+{
+    const int tilesX = (OCCLUSION_WIDTH + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE;
+    const int tilesY = (OCCLUSION_HEIGHT + OCCLUSION_TILE_SIZE - 1) / OCCLUSION_TILE_SIZE;
+
+    // Allocate the pyramid on first use
+    if (buffer.levels.empty())
+    {
+        int width = OCCLUSION_WIDTH;
+        int height = OCCLUSION_HEIGHT;
+        for (;;)
+        {
+            buffer.levels.push_back(std::vector<float>(width * height));
+            buffer.levelSizes.push_back(glm::ivec2(width, height));
+            if (width == 1 && height == 1)
+                break;
+            width = std::max(1, (width + 1) / 2);
+            height = std::max(1, (height + 1) / 2);
+        }
+        buffer.tileBins.resize(tilesX * tilesY);
+    }
+
+    buffer.triangles.clear();
+    for (std::vector<uint32_t>& bin : buffer.tileBins)
+        bin.clear();
+
+    // Transform every occluder triangle to screen space and bin it by its bounding rectangle
+    for (size_t n = 0; n < nodes.meshes.size(); ++n)
+    {
+        const GLMesh* mesh = nodes.meshes[n];
+        if (mesh == nullptr || !nodes.occluders[n] || !nodes.visible[n])
+            continue;
+
+        const glm::mat4 mvp = viewProjection * nodes.worldMatrices[n];
+        const GLfloat* vertices = gMeshArena.vertices.data() + mesh->baseVertex * FLOATS_PER_ARENA_VERTEX;
+        const GLuint* indices = gMeshArena.indices.data() + mesh->firstIndex;
+
+        for (GLuint t = 0; t + 2 < mesh->nIndices; t += 3)
+        {
+            glm::vec3 screen[3];
+            bool clipped = false;
+            for (int k = 0; k < 3; ++k)
+            {
+                const GLfloat* position = vertices + indices[t + k] * FLOATS_PER_ARENA_VERTEX;
+                glm::vec4 clip = mvp * glm::vec4(position[0], position[1], position[2], 1.0f);
+
+                // Triangles crossing the near plane are skipped: leaving out occluder area is always safe
+                if (clip.w <= 1e-5f || clip.z < -clip.w)
+                {
+                    clipped = true;
+                    break;
+                }
+                screen[k] = glm::vec3((clip.x / clip.w * 0.5f + 0.5f) * OCCLUSION_WIDTH,
+                    (clip.y / clip.w * 0.5f + 0.5f) * OCCLUSION_HEIGHT,
+                    clip.z / clip.w * 0.5f + 0.5f);
+            }
+            if (clipped)
+                continue;
+
+            float minX = std::min(screen[0].x, std::min(screen[1].x, screen[2].x));
+            float maxX = std::max(screen[0].x, std::max(screen[1].x, screen[2].x));
+            float minY = std::min(screen[0].y, std::min(screen[1].y, screen[2].y));
+            float maxY = std::max(screen[0].y, std::max(screen[1].y, screen[2].y));
+            if (maxX < 0.0f || maxY < 0.0f || minX >= OCCLUSION_WIDTH || minY >= OCCLUSION_HEIGHT)
+                continue;
+
+            uint32_t triangle = (uint32_t)(buffer.triangles.size() / 3);
+            buffer.triangles.push_back(screen[0]);
+            buffer.triangles.push_back(screen[1]);
+            buffer.triangles.push_back(screen[2]);
+
+            int tileMinX = std::max(0, (int)minX / OCCLUSION_TILE_SIZE);
+            int tileMaxX = std::min(tilesX - 1, (int)maxX / OCCLUSION_TILE_SIZE);
+            int tileMinY = std::max(0, (int)minY / OCCLUSION_TILE_SIZE);
+            int tileMaxY = std::min(tilesY - 1, (int)maxY / OCCLUSION_TILE_SIZE);
+            for (int ty = tileMinY; ty <= tileMaxY; ++ty)
+                for (int tx = tileMinX; tx <= tileMaxX; ++tx)
+                    buffer.tileBins[ty * tilesX + tx].push_back(triangle);
+        }
+    }
+
+    // Rasterize the tiles in parallel with edge functions, keeping the nearest depth per pixel
+    std::vector<float>& depth = buffer.levels[0];
+    UParallelFor(gThreadPool, buffer.tileBins.size(), [&](size_t tile)
+    {
+        const int x0 = (int)(tile % tilesX) * OCCLUSION_TILE_SIZE;
+        const int y0 = (int)(tile / tilesX) * OCCLUSION_TILE_SIZE;
+        const int x1 = std::min(x0 + OCCLUSION_TILE_SIZE, OCCLUSION_WIDTH);
+        const int y1 = std::min(y0 + OCCLUSION_TILE_SIZE, OCCLUSION_HEIGHT);
+
+        for (int y = y0; y < y1; ++y)
+            std::fill(depth.begin() + y * OCCLUSION_WIDTH + x0, depth.begin() + y * OCCLUSION_WIDTH + x1, 1.0f);
+
+        for (uint32_t triangle : buffer.tileBins[tile])
+        {
+            const glm::vec3& a = buffer.triangles[triangle * 3 + 0];
+            const glm::vec3& b = buffer.triangles[triangle * 3 + 1];
+            const glm::vec3& c = buffer.triangles[triangle * 3 + 2];
+
+            float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+            if (fabsf(area) < 1e-8f)
+                continue;
+            float inverseArea = 1.0f / area;
+
+            int minX = std::max(x0, (int)std::min(a.x, std::min(b.x, c.x)));
+            int maxX = std::min(x1 - 1, (int)std::max(a.x, std::max(b.x, c.x)));
+            int minY = std::max(y0, (int)std::min(a.y, std::min(b.y, c.y)));
+            int maxY = std::min(y1 - 1, (int)std::max(a.y, std::max(b.y, c.y)));
+
+            for (int y = minY; y <= maxY; ++y)
+            {
+                float py = y + 0.5f;
+                for (int x = minX; x <= maxX; ++x)
+                {
+                    float px = x + 0.5f;
+
+                    // Normalized barycentrics are all non-negative inside, whatever the winding
+                    float w0 = ((b.x - px) * (c.y - py) - (b.y - py) * (c.x - px)) * inverseArea;
+                    float w1 = ((c.x - px) * (a.y - py) - (c.y - py) * (a.x - px)) * inverseArea;
+                    float w2 = 1.0f - w0 - w1;
+                    if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+                        continue;
+
+                    float z = w0 * a.z + w1 * b.z + w2 * c.z;
+                    float& stored = depth[y * OCCLUSION_WIDTH + x];
+                    if (z < stored)
+                        stored = z;
+                }
+            }
+        }
+    });
+
+    // Build the HiZ pyramid; odd edges fold their last row/column into the farthest value too
+    for (size_t level = 1; level < buffer.levels.size(); ++level)
+    {
+        const std::vector<float>& source = buffer.levels[level - 1];
+        std::vector<float>& target = buffer.levels[level];
+        const glm::ivec2 sourceSize = buffer.levelSizes[level - 1];
+        const glm::ivec2 targetSize = buffer.levelSizes[level];
+
+        for (int y = 0; y < targetSize.y; ++y)
+        {
+            for (int x = 0; x < targetSize.x; ++x)
+            {
+                float farthest = 0.0f;
+                for (int sy = y * 2; sy < std::min(y * 2 + 2, sourceSize.y); ++sy)
+                    for (int sx = x * 2; sx < std::min(x * 2 + 2, sourceSize.x); ++sx)
+                        farthest = std::max(farthest, source[sy * sourceSize.x + sx]);
+                target[y * targetSize.x + x] = farthest;
+            }
+        }
+    }
+}
+
+
+// Projects a world-space box and compares its nearest depth against the HiZ level where its
+// screen rectangle spans at most a couple of texels
+bool UIsBoxOccluded(const OcclusionBuffer& buffer, const glm::vec3& center, const glm::vec3& extent, const glm::mat4& viewProjection)
+{
+    float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+    float nearestDepth = 1.0f;
+
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        glm::vec3 point(center.x + ((corner & 1) ? extent.x : -extent.x),
+            center.y + ((corner & 2) ? extent.y : -extent.y),
+            center.z + ((corner & 4) ? extent.z : -extent.z));
+        glm::vec4 clip = viewProjection * glm::vec4(point, 1.0f);
+
+        // Boxes reaching the camera plane are never reported occluded
+        if (clip.w <= 1e-5f || clip.z < -clip.w)
+            return false;
+
+        float x = (clip.x / clip.w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        float y = (clip.y / clip.w * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+        nearestDepth = std::min(nearestDepth, clip.z / clip.w * 0.5f + 0.5f);
+    }
+
+    int x0 = std::max(0, (int)minX);
+    int y0 = std::max(0, (int)minY);
+    int x1 = std::min(OCCLUSION_WIDTH - 1, (int)maxX);
+    int y1 = std::min(OCCLUSION_HEIGHT - 1, (int)maxY);
+    if (x0 > x1 || y0 > y1)
+        return false;
+
+    // Pick the level where the rectangle covers at most 2x2 texels
+    size_t level = 0;
+    while (level + 1 < buffer.levels.size() && std::max(x1 - x0, y1 - y0) > 1)
+    {
+        x0 >>= 1;
+        y0 >>= 1;
+        x1 >>= 1;
+        y1 >>= 1;
+        ++level;
+    }
+
+    const std::vector<float>& hiz = buffer.levels[level];
+    const int width = buffer.levelSizes[level].x;
+    for (int y = y0; y <= y1; ++y)
+        for (int x = x0; x <= x1; ++x)
+            if (nearestDepth <= hiz[y * width + x])
+                return false;
+
+    return true;
+}
+
+
+// Rasterizes the occluders, then hides every frustum-visible non-occluder node that lies fully behind them
+void UOcclusionCullScene(SceneNodes& nodes, const glm::mat4& viewProjection, CullStats& stats)
+{
+    PROFILE_ZONE("UOcclusionCullScene");
+    URasterizeOccluders(gOcclusionBuffer, nodes, viewProjection);
+
+    for (size_t i = 0; i < nodes.meshes.size(); ++i)
+    {
+        if (nodes.meshes[i] == nullptr || nodes.occluders[i] || !nodes.visible[i])
+            continue;
+
+        glm::vec3 center(nodes.centerX[i], nodes.centerY[i], nodes.centerZ[i]);
+        glm::vec3 extent(nodes.extentX[i], nodes.extentY[i], nodes.extentZ[i]);
+        if (UIsBoxOccluded(gOcclusionBuffer, center, extent, viewProjection))
+        {
+            nodes.visible[i] = 0;
+            ++stats.occluded;
+        }
+    }
+}
+
+
+// Populates the scene graph with the desk setup and the lamp
+void UCreateScene(SceneNodes& nodes)
+{
+    const glm::vec3 noAxis(1.0f, 1.0f, 1.0f);
+    const glm::vec3 xAxis(1.0f, 0.0f, 0.0f);
+    const glm::vec3 yAxis(0.0f, 1.0f, 0.0f);
+    const glm::vec3 unitScale(1.0f, 1.0f, 1.0f);
+
+    // Root node for the desk and everything on it; more desks are added by adding more roots
+    int desk = UAddSceneNode(nodes, -1, nullptr, 0, MATERIAL_NONE, glm::vec3(0.0f), 0.0f, noAxis, unitScale);
+
+    #pragma region MonitorRendering
+    //Monitor Outer
+    int monitor = UAddSceneNode(nodes, desk, &gBoxMesh, gProgram.id, MATERIAL_MONITOR,
+        glm::vec3(-0.8f, 0.2f, 0.0f), 0.0f, noAxis, glm::vec3(1.0f, 0.8f, 0.1f));
+
+    //Monitor Inner
+    UAddSceneNode(nodes, desk, &gPlaneMesh, gProgram.id, MATERIAL_INNER_MONITOR,
+        glm::vec3(-0.8f, 0.2f, 0.06f), glm::radians(90.0f), xAxis, glm::vec3(0.475f, 0.35f, 0.35f));
+    #pragma endregion
+
+    #pragma region Keyboard
+    //Keyboard base
+    UAddSceneNode(nodes, desk, &gBoxMesh, gProgram.id, MATERIAL_MONITOR,
+        glm::vec3(-1.0f, -0.45f, 0.5f), 0.0f, noAxis, glm::vec3(0.7f, 0.05f, 0.25f));
+
+    //Keycaps
+    UAddSceneNode(nodes, desk, &gPlaneMesh, gProgram.id, MATERIAL_KEYBOARD,
+        glm::vec3(-1.0f, -0.42f, 0.5f), glm::radians(0.0f), xAxis, glm::vec3(0.352f, 0.0f, 0.125f));
+    #pragma endregion
+
+    #pragma region Mousepad
+    UAddSceneNode(nodes, desk, &gPlaneMesh, gProgram.id, MATERIAL_FABRIC,
+        glm::vec3(0.0f, -0.48f, 0.45f), glm::radians(0.0f), xAxis, glm::vec3(1.4f, 0.35f, 0.30f));
+
+    //Mouse
+    UAddSceneNode(nodes, desk, &gSphereMesh, gProgram.id, MATERIAL_WOOD,
+        glm::vec3(0.0f, -0.45f, 0.6f), 0.0f, noAxis, glm::vec3(0.075f, 0.05f, 0.1f));
+    #pragma endregion
+
+    #pragma region Desk Rendering
+    //Desk Surface
+    int deskSurface = UAddSceneNode(nodes, desk, &gBoxMesh, gProgram.id, MATERIAL_WOOD,
+        glm::vec3(0.0f, -0.55f, 0.3f), glm::radians(0.0f), xAxis, glm::vec3(3.0f, 0.1f, 1.0f));
+    #pragma endregion
+
+    #pragma region MonitorStand Rendering
+    int stand = UAddSceneNode(nodes, desk, &gBoxMesh, gProgram.id, MATERIAL_MONITOR,
+        glm::vec3(-0.8f, -0.35f, 0.0f), 0.0f, noAxis, glm::vec3(0.1f, 0.30f, 0.1f));
+    #pragma endregion
+
+    // Large solid pieces hide whatever is behind them from the software occlusion pass
+    USetNodeOccluder(nodes, monitor, true);
+    USetNodeOccluder(nodes, deskSurface, true);
+    USetNodeOccluder(nodes, stand, true);
+
+    // Everything on the desk casts shadows; nothing moves, so all casters are cached
+    for (int node = desk + 1; node < (int)nodes.meshes.size(); ++node)
+        USetNodeShadowCaster(nodes, node, SHADOW_CASTER_STATIC);
+
+    // LAMP: the smaller pyramid used as a visual que for the light source
+    gLampNode = UAddSceneNode(nodes, -1, &gMesh, gLampProgram.id, MATERIAL_NONE,
+        gLightPosition, 180.0f, yAxis, gLightScale);
+    gLampOrbitOrigin = gLightPosition;
+
+    // The lamp's point light; its radius covers the whole desk
+    gLampLight = UAddPointLight(gLightPosition, gLightColor, 1.0f, 20.0f);
+}
+
+// Shape generators. Each one works out its vertex and index counts first, sizes the output buffers once
+// and writes interleaved arena vertices (position, normal, texture coords) and triangle indices in place.
+// Triangles wind counter-clockwise seen from outside.
+
+// Writes one interleaved vertex and returns the position after it
+GLfloat* UWriteVertex(GLfloat* out, const glm::vec3& position, const glm::vec3& normal, float u, float v)
+{
+    out[0] = position.x;
+    out[1] = position.y;
+    out[2] = position.z;
+    out[3] = normal.x;
+    out[4] = normal.y;
+    out[5] = normal.z;
+    out[6] = u;
+    out[7] = v;
+    return out + FLOATS_PER_ARENA_VERTEX;
+}
+
+
+// Writes a flat grid of segments x segments quads spanning origin + u * uAxis + v * vAxis for u, v in
+// [0, 1]. cross(uAxis, vAxis) must point along the normal. Indices start at baseVertex.
+void UWriteGrid(const glm::vec3& origin, const glm::vec3& uAxis, const glm::vec3& vAxis, const glm::vec3& normal, int segments,
+    GLuint baseVertex, GLfloat*& vertex, GLuint*& index)
+{
+    const int side = segments + 1;
+    for (int j = 0; j < side; ++j)
+    {
+        for (int i = 0; i < side; ++i)
+        {
+            const float u = (float)i / segments;
+            const float v = (float)j / segments;
+            vertex = UWriteVertex(vertex, origin + uAxis * u + vAxis * v, normal, u, v);
+        }
+    }
+
+    for (int j = 0; j < segments; ++j)
+    {
+        for (int i = 0; i < segments; ++i)
+        {
+            const GLuint corner = baseVertex + j * side + i;
+            *index++ = corner;
+            *index++ = corner + 1;
+            *index++ = corner + side + 1;
+            *index++ = corner;
+            *index++ = corner + side + 1;
+            *index++ = corner + side;
+        }
+    }
+}
+
+
+// UV sphere of radius 1 with 'slices' segments around Y and 'stacks' from pole to pole. Each ring carries
+// a seam vertex at u = 1 and each pole one vertex per slice, so texture coordinates never wrap.
+void UGenerateUVSphere(int slices, int stacks, std::vector<GLfloat>& verts, std::vector<GLuint>& indices)
+{
+    const int columns = slices + 1;
+    verts.resize((size_t)columns * (stacks + 1) * FLOATS_PER_ARENA_VERTEX);
+    indices.resize((size_t)slices * (stacks - 1) * 6);     // The pole stacks are one triangle per slice
+
+    GLfloat* vertex = verts.data();
+    for (int stack = 0; stack <= stacks; ++stack)
+    {
+        const float phi = (float)M_PI * stack / stacks;    // Angle from the north pole
+        for (int slice = 0; slice <= slices; ++slice)
+        {
+            const float theta = 2.0f * (float)M_PI * slice / slices - (float)M_PI;
+            const glm::vec3 normal(sinf(phi) * sinf(theta), cosf(phi), sinf(phi) * cosf(theta));
+            vertex = UWriteVertex(vertex, normal, normal, (float)slice / slices, 1.0f - (float)stack / stacks);
+        }
+    }
+
+    GLuint* index = indices.data();
+    for (int stack = 0; stack < stacks; ++stack)
+    {
+        for (int slice = 0; slice < slices; ++slice)
+        {
+            const GLuint upper = stack * columns + slice;
+            const GLuint lower = upper + columns;
+            // The first stack's upper row and the last stack's lower row are poles, so each of
+            // those stacks keeps only the triangle with a single pole vertex
+            if (stack != stacks - 1)
+            {
+                *index++ = upper;
+                *index++ = lower;
+                *index++ = lower + 1;
+            }
+            if (stack != 0)
+            {
+                *index++ = upper;
+                *index++ = lower + 1;
+                *index++ = upper + 1;
+            }
+        }
+    }
+}
+
+
+// Icosphere of radius 1: an icosahedron whose triangles are split in four 'subdivisions' times, so all
+// triangles are about the same size. Texture coordinates follow the UV sphere's mapping; corners of
+// triangles that straddle the seam are duplicated at u + 1.
+void UGenerateIcosphere(int subdivisions, std::vector<GLfloat>& verts, std::vector<GLuint>& indices)
+{
+    const size_t faceCount = (size_t)20 << (2 * subdivisions);
+    std::vector<glm::vec3> positions;
+    positions.reserve(faceCount / 2 + 2 + faceCount / 8);     // Closed mesh: V = F / 2 + 2, plus seam copies
+
+    const float t = (1.0f + sqrtf(5.0f)) * 0.5f;
+    const glm::vec3 corners[12] = {
+        glm::vec3(-1.0f, t, 0.0f), glm::vec3(1.0f, t, 0.0f), glm::vec3(-1.0f, -t, 0.0f), glm::vec3(1.0f, -t, 0.0f),
+        glm::vec3(0.0f, -1.0f, t), glm::vec3(0.0f, 1.0f, t), glm::vec3(0.0f, -1.0f, -t), glm::vec3(0.0f, 1.0f, -t),
+        glm::vec3(t, 0.0f, -1.0f), glm::vec3(t, 0.0f, 1.0f), glm::vec3(-t, 0.0f, -1.0f), glm::vec3(-t, 0.0f, 1.0f),
+    };
+    static const GLuint icosahedron[60] = {
+        0, 11, 5,   0, 5, 1,    0, 1, 7,    0, 7, 10,   0, 10, 11,
+        1, 5, 9,    5, 11, 4,   11, 10, 2,  10, 7, 6,   7, 1, 8,
+        3, 9, 4,    3, 4, 2,    3, 2, 6,    3, 6, 8,    3, 8, 9,
+        4, 9, 5,    2, 4, 11,   6, 2, 10,   8, 6, 7,    9, 8, 1,
+    };
+    for (const glm::vec3& corner : corners)
+        positions.push_back(glm::normalize(corner));
+
+    // Each edge is split once; the cache lets both triangles sharing it reuse the midpoint
+    std::unordered_map<uint64_t, GLuint> midpoints;
+    auto midpoint = [&positions, &midpoints](GLuint a, GLuint b)
+    {
+        const uint64_t key = (uint64_t)std::min(a, b) << 32 | std::max(a, b);
+        auto cached = midpoints.find(key);
+        if (cached != midpoints.end())
+            return cached->second;
+        const glm::vec3 position = glm::normalize(positions[a] + positions[b]);
+        positions.push_back(position);
+        midpoints.emplace(key, (GLuint)positions.size() - 1);
+        return (GLuint)positions.size() - 1;
+    };
+
+    std::vector<GLuint> triangles(icosahedron, icosahedron + 60);
+    std::vector<GLuint> split;
+    for (int level = 0; level < subdivisions; ++level)
+    {
+        split.resize(triangles.size() * 4);
+        GLuint* out = split.data();
+        for (size_t i = 0; i < triangles.size(); i += 3)
+        {
+            const GLuint a = triangles[i], b = triangles[i + 1], c = triangles[i + 2];
+            const GLuint ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+            const GLuint children[12] = { a, ab, ca,  b, bc, ab,  c, ca, bc,  ab, bc, ca };
+            memcpy(out, children, sizeof(children));
+            out += 12;
+        }
+        triangles.swap(split);
+        midpoints.clear();
+    }
+
+    std::vector<glm::vec2> uvs(positions.size());
+    for (size_t i = 0; i < positions.size(); ++i)
+    {
+        const glm::vec3& p = positions[i];
+        uvs[i] = glm::vec2(atan2f(p.x, p.z) / (2.0f * (float)M_PI) + 0.5f, 1.0f - acosf(glm::clamp(p.y, -1.0f, 1.0f)) / (float)M_PI);
+    }
+
+    std::unordered_map<GLuint, GLuint> seamCopies;
+    for (size_t i = 0; i < triangles.size(); i += 3)
+    {
+        const float maxU = std::max(uvs[triangles[i]].x, std::max(uvs[triangles[i + 1]].x, uvs[triangles[i + 2]].x));
+        for (size_t k = i; k < i + 3; ++k)
+        {
+            const GLuint corner = triangles[k];
+            if (maxU - uvs[corner].x <= 0.5f)
+                continue;
+            auto copy = seamCopies.find(corner);
+            if (copy == seamCopies.end())
+            {
+                const glm::vec3 position = positions[corner];
+                const glm::vec2 uv(uvs[corner].x + 1.0f, uvs[corner].y);
+                positions.push_back(position);
+                uvs.push_back(uv);
+                copy = seamCopies.emplace(corner, (GLuint)positions.size() - 1).first;
+            }
+            triangles[k] = copy->second;
+        }
+    }
+
+    verts.resize(positions.size() * FLOATS_PER_ARENA_VERTEX);
+    GLfloat* vertex = verts.data();
+    for (size_t i = 0; i < positions.size(); ++i)
+        vertex = UWriteVertex(vertex, positions[i], positions[i], uvs[i].x, uvs[i].y);
+    indices.swap(triangles);
+}
+
+
+// Box from -0.5 to 0.5 with every face split into segments x segments quads. Faces keep their own
+// vertices so normals and texture coordinates stay per face.
+void UGenerateBox(int segments, std::vector<GLfloat>& verts, std::vector<GLuint>& indices)
+{
+    const size_t faceVertices = (size_t)(segments + 1) * (segments + 1);
+    verts.resize(6 * faceVertices * FLOATS_PER_ARENA_VERTEX);
+    indices.resize((size_t)6 * segments * segments * 6);
+
+    // Normal, then the directions u and v run in; cross(u, v) is the normal
+    const glm::vec3 faces[6][3] = {
+        { glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f) },
+        { glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 1.0f, 0.0f) },
+        { glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f) },
+        { glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f) },
+        { glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f) },
+        { glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f) },
+    };
+
+    GLfloat* vertex = verts.data();
+    GLuint* index = indices.data();
+    for (int face = 0; face < 6; ++face)
+    {
+        const glm::vec3& normal = faces[face][0];
+        const glm::vec3& uAxis = faces[face][1];
+        const glm::vec3& vAxis = faces[face][2];
+        UWriteGrid((normal - uAxis - vAxis) * 0.5f, uAxis, vAxis, normal, segments, (GLuint)(face * faceVertices), vertex, index);
+    }
+}
+
+
+// Plane of 2 x 2 units in XZ facing +Y, split into segments x segments quads; u follows +X, v follows -Z
+void UGeneratePlane(int segments, std::vector<GLfloat>& verts, std::vector<GLuint>& indices)
+{
+    verts.resize((size_t)(segments + 1) * (segments + 1) * FLOATS_PER_ARENA_VERTEX);
+    indices.resize((size_t)segments * segments * 6);
+
+    GLfloat* vertex = verts.data();
+    GLuint* index = indices.data();
+    UWriteGrid(glm::vec3(-1.0f, 0.0f, 1.0f), glm::vec3(2.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -2.0f), glm::vec3(0.0f, 1.0f, 0.0f),
+        segments, 0, vertex, index);
+}
+
+
+// Pyramid with its apex at y = 0.5 over a base polygon of 'sides' corners at y = -0.5, stretched to fill
+// the unit square footprint; three sides give the lamp's shape. Faces are flat, with their own vertices.
+void UGeneratePyramid(int sides, std::vector<GLfloat>& verts, std::vector<GLuint>& indices)
+{
+    verts.resize((size_t)sides * 4 * FLOATS_PER_ARENA_VERTEX);   // Three per side, plus the base corners
+    indices.resize((size_t)(sides + sides - 2) * 3);
+
+    // Corners around Y, the first at the back (-Z); even counts are turned half a step to sit square
+    std::vector<glm::vec3> base(sides);
+    glm::vec3 low(1.0f), high(-1.0f);
+    for (int k = 0; k < sides; ++k)
+    {
+        const float angle = 2.0f * (float)M_PI * (k + (sides % 2 == 0 ? 0.5f : 0.0f)) / sides;
+        base[k] = glm::vec3(sinf(angle), -0.5f, -cosf(angle));
+        low = glm::min(low, base[k]);
+        high = glm::max(high, base[k]);
+    }
+    for (glm::vec3& corner : base)
+    {
+        corner.x = (corner.x - low.x) / (high.x - low.x) - 0.5f;
+        corner.z = (corner.z - low.z) / (high.z - low.z) - 0.5f;
+    }
+
+    const glm::vec3 apex(0.0f, 0.5f, 0.0f);
+    GLfloat* vertex = verts.data();
+    GLuint* index = indices.data();
+    GLuint next = 0;
+    for (int k = 0; k < sides; ++k)
+    {
+        const glm::vec3& right = base[k];
+        const glm::vec3& left = base[(k + 1) % sides];
+        const glm::vec3 normal = glm::normalize(glm::cross(left - apex, right - apex));
+        vertex = UWriteVertex(vertex, apex, normal, 0.5f, 1.0f);
+        vertex = UWriteVertex(vertex, left, normal, 0.0f, 0.0f);
+        vertex = UWriteVertex(vertex, right, normal, 1.0f, 0.0f);
+        *index++ = next;
+        *index++ = next + 1;
+        *index++ = next + 2;
+        next += 3;
+    }
+
+    // The base is a fan from the first corner, mapped straight down onto the texture
+    const GLuint baseStart = next;
+    for (const glm::vec3& corner : base)
+        vertex = UWriteVertex(vertex, corner, glm::vec3(0.0f, -1.0f, 0.0f), corner.x + 0.5f, corner.z + 0.5f);
+    for (int k = 1; k + 1 < sides; ++k)
+    {
+        *index++ = baseStart;
+        *index++ = baseStart + k;
+        *index++ = baseStart + k + 1;
+    }
+}
+
+
+// Picks the coarsest level of detail whose threshold the projected size still reaches
+const GLMesh* USelectMeshLod(const GLMesh& mesh, float pixels)
+{
+    const GLMesh* level = &mesh;
+    for (const GLMesh& coarser : mesh.lods)
+    {
+        if (pixels >= level->lodMinPixels)
+            break;
+        level = &coarser;
+    }
+    return level;
+}
+
+
+// Counts triangles whose corners are collinear; a generator that emits any leaves a hole in its surface
+size_t UCountDegenerateTriangles(const std::vector<GLfloat>& verts, const std::vector<GLuint>& indices)
+{
+    auto position = [&verts](GLuint index)
+    {
+        const GLfloat* vertex = &verts[(size_t)index * FLOATS_PER_ARENA_VERTEX];
+        return glm::vec3(vertex[0], vertex[1], vertex[2]);
+    };
+
+    size_t degenerate = 0;
+    for (size_t i = 0; i + 2 < indices.size(); i += 3)
+    {
+        const glm::vec3 a = position(indices[i]);
+        const glm::vec3 edgeCross = glm::cross(position(indices[i + 1]) - a, position(indices[i + 2]) - a);
+        if (glm::dot(edgeCross, edgeCross) <= 1e-12f)
+            ++degenerate;
+    }
+    return degenerate;
+}
+
+
+// Suballocates generated geometry out of the shared arena
+void UAddGeneratedMesh(const std::vector<GLfloat>& verts, const std::vector<GLuint>& indices, GLMesh& mesh)
+{
+    const size_t degenerate = UCountDegenerateTriangles(verts, indices);
+    if (degenerate > 0)
+        cout << "Generated mesh has " << degenerate << " zero-area triangles out of " << indices.size() / 3 << endl;
+
+    mesh.nVertices = (GLuint)(verts.size() / FLOATS_PER_ARENA_VERTEX);
+    mesh.nIndices = (GLuint)indices.size();
+    UAddMeshToArena(gMeshArena, verts.data(), mesh.nVertices, indices.data(), mesh.nIndices, mesh);
+}
+
+
+// The sphere's levels of detail: UV spheres up close, icospheres once it is small on screen
+void UCreateSphereMesh(GLMesh& mesh)
+{
+    PROFILE_ZONE("UCreateSphereMesh");
+    const int levelCount = sizeof(SPHERE_LODS) / sizeof(SPHERE_LODS[0]);
+    mesh.lods.resize(levelCount - 1);
+
+    std::vector<GLfloat> verts;
+    std::vector<GLuint> indices;
+    for (int level = 0; level < levelCount; ++level)
+    {
+        const MeshLodSpec& spec = SPHERE_LODS[level];
+        if (level < SPHERE_UV_LEVELS)
+            UGenerateUVSphere(spec.detail, spec.detail / 2, verts, indices);
+        else
+            UGenerateIcosphere(spec.detail, verts, indices);
+
+        GLMesh& target = level == 0 ? mesh : mesh.lods[level - 1];
+        target.lodMinPixels = spec.minPixels;
+        UAddGeneratedMesh(verts, indices, target);
+    }
+}
+
+// Implements the UCreatePyramidMesh function
+void UCreatePyramidMesh(GLMesh& mesh)
+{
+    PROFILE_ZONE("UCreatePyramidMesh");
+    std::vector<GLfloat> verts;
+    std::vector<GLuint> indices;
+    UGeneratePyramid(3, verts, indices);
+    UAddGeneratedMesh(verts, indices, mesh);
+}
+
+void UCreatePlaneMesh(GLMesh& mesh)
+{
+    PROFILE_ZONE("UCreatePlaneMesh");
+    std::vector<GLfloat> verts;
+    std::vector<GLuint> indices;
+    UGeneratePlane(1, verts, indices);
+    UAddGeneratedMesh(verts, indices, mesh);
+}
+
+void UCreateBoxMesh(GLMesh& mesh)
+{
+    PROFILE_ZONE("UCreateBoxMesh");
+    std::vector<GLfloat> verts;
+    std::vector<GLuint> indices;
+    UGenerateBox(1, verts, indices);
+    UAddGeneratedMesh(verts, indices, mesh);
+}
+
+// Converts to an IEEE half float, rounding to nearest. Out-of-range values clamp to the largest
+// finite half and values below the smallest normal flush to zero, which is plenty for texture coords.
+uint16_t UFloatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    const int32_t exponent = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (exponent <= 0)
+        return sign;
+    if (exponent >= 31)
+        return sign | 0x7bff;
+
+    // Round the 23-bit mantissa to 10 bits; a carry out bumps the exponent, which the add handles
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    if (mantissa & 0x1000)
+        ++half;
+    return sign | (uint16_t)std::min<uint32_t>(half, 0x7bff);
+}
+
+
+// Same folding as the shaders' octEncode: the unit sphere onto an octahedron, unfolded into [-1, 1]^2
+glm::vec2 UOctahedralEncode(const glm::vec3& normal)
+{
+    const glm::vec3 n = normal / (fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z));
+    if (n.z >= 0.0f)
+        return glm::vec2(n.x, n.y);
+    return glm::vec2((1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f), (1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+}
+
+
+// Packs interleaved float vertices into the compact layout, positions relative to the mesh bounds
+void UQuantizeVertices(const GLfloat* verts, GLuint vertexCount, const glm::vec3& boundsMin, const glm::vec3& boundsMax, CompactVertex* out)
+{
+    const glm::vec3 extent = boundsMax - boundsMin;
+    for (GLuint v = 0; v < vertexCount; ++v)
+    {
+        const GLfloat* vertex = verts + v * FLOATS_PER_ARENA_VERTEX;
+        CompactVertex& compact = out[v];
+
+        // Flat meshes have no extent along one axis; everything sits at the minimum there
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            const float t = extent[axis] > 0.0f ? (vertex[axis] - boundsMin[axis]) / extent[axis] : 0.0f;
+            compact.position[axis] = (uint16_t)lroundf(glm::clamp(t, 0.0f, 1.0f) * 65535.0f);
+        }
+        compact.position[3] = 0;
+
+        const glm::vec2 normal = UOctahedralEncode(glm::normalize(glm::vec3(vertex[3], vertex[4], vertex[5])));
+        compact.normal[0] = (int16_t)lroundf(glm::clamp(normal.x, -1.0f, 1.0f) * 32767.0f);
+        compact.normal[1] = (int16_t)lroundf(glm::clamp(normal.y, -1.0f, 1.0f) * 32767.0f);
+
+        compact.uv[0] = UFloatToHalf(vertex[6]);
+        compact.uv[1] = UFloatToHalf(vertex[7]);
+    }
+}
+
+
+// Cache misses of drawing the indices through a FIFO post-transform cache of VERTEX_CACHE_SIZE entries
+size_t USimulateVertexCache(const GLuint* indices, size_t indexCount, GLuint vertexCount)
+{
+    // A vertex is resident while fewer than VERTEX_CACHE_SIZE misses happened since it was loaded
+    std::vector<size_t> loadedAt(vertexCount, 0);
+    size_t misses = 0;
+    for (size_t i = 0; i < indexCount; ++i)
+    {
+        size_t& loaded = loadedAt[indices[i]];
+        if (loaded == 0 || misses - loaded >= (size_t)VERTEX_CACHE_SIZE)
+            loaded = ++misses;
+    }
+    return misses;
+}
+
+
+// Tipsify (Sander, Nehab and Barczak 2007): emits the fan around one vertex at a time and moves on to a
+// neighbour that is still cached, or else through a dead-end stack of recent vertices. Triangle positions
+// where it had to fall back to the dead-end stack or the input order go to hardBoundaries.
+void UTipsifyIndices(const GLuint* indices, size_t indexCount, GLuint vertexCount, std::vector<GLuint>& out, std::vector<size_t>& hardBoundaries)
+{
+    const size_t triangleCount = indexCount / 3;
+
+    // Triangles around each vertex, as ranges of one flat list
+    std::vector<GLuint> liveTriangles(vertexCount, 0);
+    for (size_t i = 0; i < indexCount; ++i)
+        ++liveTriangles[indices[i]];
+    std::vector<GLuint> adjacencyStart(vertexCount + 1, 0);
+    for (GLuint v = 0; v < vertexCount; ++v)
+        adjacencyStart[v + 1] = adjacencyStart[v] + liveTriangles[v];
+    std::vector<GLuint> adjacency(indexCount);
+    std::vector<GLuint> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+    for (size_t i = 0; i < indexCount; ++i)
+        adjacency[fill[indices[i]]++] = (GLuint)(i / 3);
+
+    std::vector<int> cachedAt(vertexCount, 0);
+    std::vector<char> emitted(triangleCount, 0);
+    std::vector<GLuint> deadEnds;
+    std::vector<GLuint> candidates;
+    out.resize(indexCount);
+    hardBoundaries.clear();
+
+    size_t written = 0;
+    int time = VERTEX_CACHE_SIZE + 1;
+    GLuint cursor = 0;
+    int fan = indexCount > 0 ? (int)indices[0] : -1;
+    while (fan >= 0)
+    {
+        candidates.clear();
+        for (GLuint a = adjacencyStart[fan]; a < adjacencyStart[fan + 1]; ++a)
+        {
+            const GLuint triangle = adjacency[a];
+            if (emitted[triangle])
+                continue;
+            emitted[triangle] = 1;
+
+            for (int k = 0; k < 3; ++k)
+            {
+                const GLuint v = indices[triangle * 3 + k];
+                out[written++] = v;
+                deadEnds.push_back(v);
+                candidates.push_back(v);
+                --liveTriangles[v];
+                if (time - cachedAt[v] > VERTEX_CACHE_SIZE)
+                    cachedAt[v] = time++;
+            }
+        }
+
+        // Next fan: the oldest candidate that stays cached while its remaining triangles are emitted
+        int next = -1;
+        int best = -1;
+        for (GLuint v : candidates)
+        {
+            if (liveTriangles[v] == 0)
+                continue;
+            const int priority = time - cachedAt[v] + 2 * (int)liveTriangles[v] <= VERTEX_CACHE_SIZE ? time - cachedAt[v] : 0;
+            if (priority > best)
+            {
+                best = priority;
+                next = (int)v;
+            }
+        }
+
+        if (next < 0)
+        {
+            while (!deadEnds.empty() && next < 0)
+            {
+                const GLuint v = deadEnds.back();
+                deadEnds.pop_back();
+                if (liveTriangles[v] > 0)
+                    next = (int)v;
+            }
+            for (; next < 0 && cursor < vertexCount; ++cursor)
+            {
+                if (liveTriangles[cursor] > 0)
+                    next = (int)cursor;
+            }
+            if (next >= 0 && written > 0)
+                hardBoundaries.push_back(written / 3);
+        }
+        fan = next;
+    }
+}
+
+
+// Linear-speed overdraw ordering: splits the cache-ordered triangles into clusters, at the hard boundaries
+// and wherever a cluster's own ACMR has come down to OVERDRAW_CLUSTER_LAMBDA times the mesh's, then draws
+// the clusters facing out from the mesh center first since they tend to hide the rest
+void UOrderClustersForOverdraw(const GLfloat* verts, GLuint vertexCount, std::vector<GLuint>& indices, const std::vector<size_t>& hardBoundaries)
+{
+    const size_t triangleCount = indices.size() / 3;
+    if (triangleCount < 2)
+        return;
+
+    const float threshold = OVERDRAW_CLUSTER_LAMBDA * USimulateVertexCache(indices.data(), indices.size(), vertexCount) / triangleCount;
+
+    // Each cluster is simulated from a cold cache since any other cluster may end up before it
+    std::vector<size_t> starts(1, 0);
+    std::vector<size_t> loadedAt(vertexCount, 0);
+    size_t misses = 0;
+    size_t clusterBase = 0;     // Misses before the current cluster; older loads count as evicted
+    size_t nextHard = 0;
+    for (size_t t = 0; t < triangleCount; ++t)
+    {
+        bool split = false;
+        if (nextHard < hardBoundaries.size() && hardBoundaries[nextHard] == t)
+        {
+            split = true;
+            ++nextHard;
+        }
+        else if (t > starts.back())
+            split = (float)(misses - clusterBase) / (t - starts.back()) <= threshold;
+
+        if (split && t > starts.back())
+        {
+            starts.push_back(t);
+            clusterBase = misses;
+        }
+
+        for (int k = 0; k < 3; ++k)
+        {
+            size_t& loaded = loadedAt[indices[t * 3 + k]];
+            if (loaded <= clusterBase || misses - loaded >= (size_t)VERTEX_CACHE_SIZE)
+                loaded = ++misses;
+        }
+    }
+    if (starts.size() < 2)
+        return;
+    starts.push_back(triangleCount);
+
+    // Area-weighted centroid and normal of every cluster and of the whole mesh
+    auto position = [verts](GLuint v) { return glm::vec3(verts[v * FLOATS_PER_ARENA_VERTEX], verts[v * FLOATS_PER_ARENA_VERTEX + 1], verts[v * FLOATS_PER_ARENA_VERTEX + 2]); };
+    const size_t clusterCount = starts.size() - 1;
+    std::vector<glm::vec3> centroids(clusterCount, glm::vec3(0.0f));
+    std::vector<glm::vec3> normals(clusterCount, glm::vec3(0.0f));
+    std::vector<float> areas(clusterCount, 0.0f);
+    glm::vec3 meshCentroid(0.0f);
+    float meshArea = 0.0f;
+    for (size_t c = 0; c < clusterCount; ++c)
+    {
+        for (size_t t = starts[c]; t < starts[c + 1]; ++t)
+        {
+            const glm::vec3 a = position(indices[t * 3]), b = position(indices[t * 3 + 1]), d = position(indices[t * 3 + 2]);
+            const glm::vec3 normal = glm::cross(b - a, d - a);
+            const float area = glm::length(normal);
+            centroids[c] = centroids[c] + (a + b + d) * (area / 3.0f);
+            normals[c] = normals[c] + normal;
+            areas[c] += area;
+        }
+        meshCentroid = meshCentroid + centroids[c];
+        meshArea += areas[c];
+        if (areas[c] > 0.0f)
+            centroids[c] = centroids[c] / areas[c];
+    }
+    if (meshArea > 0.0f)
+        meshCentroid = meshCentroid / meshArea;
+
+    std::vector<std::pair<float, size_t>> order(clusterCount);
+    for (size_t c = 0; c < clusterCount; ++c)
+    {
+        const float length = glm::length(normals[c]);
+        order[c] = std::make_pair(length > 0.0f ? glm::dot(centroids[c] - meshCentroid, normals[c]) / length : 0.0f, c);
+    }
+    std::stable_sort(order.begin(), order.end(), [](const std::pair<float, size_t>& a, const std::pair<float, size_t>& b) { return a.first > b.first; });
+
+    std::vector<GLuint> sorted;
+    sorted.reserve(indices.size());
+    for (const auto& cluster : order)
+        sorted.insert(sorted.end(), indices.begin() + starts[cluster.second] * 3, indices.begin() + starts[cluster.second + 1] * 3);
+    indices.swap(sorted);
+}
+
+
+// Renumbers vertices in the order the indices first reach them so fetches walk the vertex buffer
+// forward. Vertices no triangle uses keep their data at the end.
+void UReorderVertexFetch(std::vector<GLfloat>& verts, std::vector<GLuint>& indices)
+{
+    const GLuint vertexCount = (GLuint)(verts.size() / FLOATS_PER_ARENA_VERTEX);
+    const GLuint unassigned = ~0u;
+    std::vector<GLuint> remap(vertexCount, unassigned);
+    GLuint next = 0;
+    for (GLuint& index : indices)
+    {
+        if (remap[index] == unassigned)
+            remap[index] = next++;
+        index = remap[index];
+    }
+
+    std::vector<GLfloat> reordered(verts.size());
+    for (GLuint v = 0; v < vertexCount; ++v)
+    {
+        if (remap[v] == unassigned)
+            remap[v] = next++;
+        memcpy(&reordered[remap[v] * FLOATS_PER_ARENA_VERTEX], &verts[v * FLOATS_PER_ARENA_VERTEX], sizeof(GLfloat) * FLOATS_PER_ARENA_VERTEX);
+    }
+    verts.swap(reordered);
+}
+
+
+// Vertex cache order, then overdraw order between clusters, then fetch order
+void UOptimizeMesh(std::vector<GLfloat>& verts, std::vector<GLuint>& indices)
+{
+    PROFILE_ZONE("UOptimizeMesh");
+    const GLuint vertexCount = (GLuint)(verts.size() / FLOATS_PER_ARENA_VERTEX);
+    std::vector<GLuint> ordered;
+    std::vector<size_t> hardBoundaries;
+    UTipsifyIndices(indices.data(), indices.size(), vertexCount, ordered, hardBoundaries);
+    UOrderClustersForOverdraw(verts.data(), vertexCount, ordered, hardBoundaries);
+    indices.swap(ordered);
+    UReorderVertexFetch(verts, indices);
+}
+
+
+// Appends a mesh's interleaved vertices (position, normal, texture coords) and indices to the arena,
+// reordered by UOptimizeMesh. Indices stay local to the mesh; the draw adds baseVertex when fetching.
+void UAddMeshToArena(MeshArena& arena, const GLfloat* verts, GLuint vertexCount, const GLuint* indices, GLuint indexCount, GLMesh& mesh)
+{
+    std::vector<GLfloat> optimizedVerts(verts, verts + vertexCount * FLOATS_PER_ARENA_VERTEX);
+    std::vector<GLuint> optimizedIndices(indices, indices + indexCount);
+    const size_t missesBefore = USimulateVertexCache(indices, indexCount, vertexCount);
+    UOptimizeMesh(optimizedVerts, optimizedIndices);
+    const size_t missesAfter = USimulateVertexCache(optimizedIndices.data(), indexCount, vertexCount);
+    verts = optimizedVerts.data();
+    indices = optimizedIndices.data();
+
+    // Object-space bounds for culling
+    mesh.boundsMin = glm::vec3(verts[0], verts[1], verts[2]);
+    mesh.boundsMax = mesh.boundsMin;
+    for (GLuint v = 1; v < vertexCount; ++v)
+    {
+        const GLfloat* position = verts + v * FLOATS_PER_ARENA_VERTEX;
+        mesh.boundsMin = glm::min(mesh.boundsMin, glm::vec3(position[0], position[1], position[2]));
+        mesh.boundsMax = glm::max(mesh.boundsMax, glm::vec3(position[0], position[1], position[2]));
+    }
+
+    // Quantize outside the lock; positions use the bounds just computed
+    MeshDequantization dequantization = { glm::vec4(0.0f), glm::vec4(1.0f) };
+    std::vector<CompactVertex> compact;
+    if (gCompactVertices)
+    {
+        compact.resize(vertexCount);
+        UQuantizeVertices(verts, vertexCount, mesh.boundsMin, mesh.boundsMax, compact.data());
+        dequantization.offset = glm::vec4(mesh.boundsMin, 0.0f);
+        dequantization.scale = glm::vec4(mesh.boundsMax - mesh.boundsMin, 0.0f);
+    }
+
+    std::lock_guard<std::mutex> lock(arena.mutex);
+    mesh.id = arena.meshCount++;
+    mesh.baseVertex = (GLuint)(arena.vertices.size() / FLOATS_PER_ARENA_VERTEX);
+    mesh.firstIndex = (GLuint)arena.indices.size();
+    arena.vertices.insert(arena.vertices.end(), verts, verts + vertexCount * FLOATS_PER_ARENA_VERTEX);
+    arena.compactVertices.insert(arena.compactVertices.end(), compact.begin(), compact.end());
+    arena.indices.insert(arena.indices.end(), indices, indices + indexCount);
+    arena.dequantization.push_back(dequantization);
+    arena.maxMeshVertices = std::max(arena.maxMeshVertices, vertexCount);
+    arena.triangleCount += indexCount / 3;
+    arena.cacheMissesBefore += missesBefore;
+    arena.cacheMissesAfter += missesAfter;
+}
+
+
+// Creates the arena VAO and sends all accumulated geometry to the GPU
+void UUploadMeshArena(MeshArena& arena)
+{
+    glGenVertexArrays(1, &arena.vao);
+    glBindVertexArray(arena.vao);
+
+    // Create 2 buffers: first one for the vertex data; second one for the indices
+    glGenBuffers(2, arena.vbos);
+    glBindBuffer(GL_ARRAY_BUFFER, arena.vbos[0]); // Activates the buffer
+    const size_t vertexBytes = gCompactVertices ? sizeof(CompactVertex) * arena.compactVertices.size() : sizeof(GLfloat) * arena.vertices.size();
+    glBufferData(GL_ARRAY_BUFFER, vertexBytes, gCompactVertices ? (const void*)arena.compactVertices.data() : (const void*)arena.vertices.data(), GL_STATIC_DRAW);
+
+    // Indices are local to each mesh, so 16 bits do whenever no single mesh has more vertices than that
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.vbos[1]); // Activates the buffer
+    if (arena.maxMeshVertices <= 0xffff)
+    {
+        const std::vector<GLushort> shortIndices(arena.indices.begin(), arena.indices.end());
+        arena.indexType = GL_UNSIGNED_SHORT;
+        arena.indexSize = sizeof(GLushort);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * shortIndices.size(), shortIndices.data(), GL_STATIC_DRAW);
+    }
+    else
+    {
+        arena.indexType = GL_UNSIGNED_INT;
+        arena.indexSize = sizeof(GLuint);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * arena.indices.size(), arena.indices.data(), GL_STATIC_DRAW);
+    }
+
+    if (gCompactVertices)
+    {
+        // Normalized attributes arrive in the shader as [0, 1] positions and [-1, 1] octahedral normals
+        const GLint stride = sizeof(CompactVertex);
+        glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offsetof(CompactVertex, position));
+        glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, stride, (void*)offsetof(CompactVertex, normal));
+        glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)offsetof(CompactVertex, uv));
+    }
+    else
+    {
+        const GLuint floatsPerVertex = 3;
+        const GLuint floatsPerNormal = 3;
+        const GLuint floatsPerUV = 2;
+
+        // Strides between vertex coordinates
+        GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);
+
+        // Create Vertex Attribute Pointers
+        glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
+        glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
+        glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
+    }
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Per-instance object index into the object ring
+    UBindObjectIdAttribute(gObjectRing, arena.vao);
+
+    // Every vertex shader rebuilds positions through the mesh table, identity or not
+    glGenBuffers(1, &arena.meshBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, arena.meshBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(MeshDequantization) * arena.dequantization.size(), arena.dequantization.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MESH_DATA_BINDING, arena.meshBuffer);
+
+    cout << "Mesh arena: " << arena.vertices.size() / FLOATS_PER_ARENA_VERTEX << " vertices, " << vertexBytes / 1024
+        << " KB of " << (gCompactVertices ? "compact" : "float") << " vertex data, " << arena.indexSize * 8 << "-bit indices" << endl;
+    if (arena.triangleCount > 0)
+    {
+        cout << "Vertex cache ACMR (" << VERTEX_CACHE_SIZE << "-entry FIFO, " << arena.triangleCount << " triangles): "
+            << (float)arena.cacheMissesBefore / arena.triangleCount << " as generated, "
+            << (float)arena.cacheMissesAfter / arena.triangleCount << " optimized" << endl;
+    }
+}
+
+
+void UDestroyMeshArena(MeshArena& arena)
+{
+    glDeleteVertexArrays(1, &arena.vao);
+    glDeleteBuffers(2, arena.vbos);
+    glDeleteBuffers(1, &arena.meshBuffer);
+}
+
+/*Generate and load the texture*/
+bool UCreateTexture(const char* filename, GLuint& textureId)
+{
+    PROFILE_ZONE("UCreateTexture");
+    CookedTexture texture;
+    if (!ULoadTextureData(filename, texture))
+        return false; // Error loading the image
+
+    glGenTextures(1, &textureId);
+    UUploadCookedTexture(textureId, texture);
+    return true;
+}
+
+
+// Produces an image's full mip chain ready for upload: the cached BC1/BC3 cook when the driver can
+// sample it, otherwise RGBA8 levels built by UBuildMipChain. Safe on any thread.
+bool ULoadTextureData(const std::string& filename, CookedTexture& texture)
+{
+    if (GLEW_EXT_texture_compression_s3tc)
+        return UCookTextureFile(filename, texture);
+
+    int width, height, channels;
+    unsigned char* image = stbi_load(filename.c_str(), &width, &height, &channels, 0);
+    if (!image)
+        return false;
+
+    if (channels != 3 && channels != 4)
+    {
+        cout << "Not implemented to handle image with " << channels << " channels" << endl;
+        stbi_image_free(image);
+        return false;
+    }
+
+    flipImageVertically(image, width, height, channels);
+    std::vector<ImageLevel> levels;
+    UBuildMipChain(image, width, height, channels, TEXTURE_MIP_FILTER, levels);
+    stbi_image_free(image);
+
+    texture.format = GL_RGBA8;
+    texture.levels.clear();
+    texture.data.clear();
+    for (const ImageLevel& level : levels)
+    {
+        TextureLevel info;
+        info.width = level.width;
+        info.height = level.height;
+        info.offset = texture.data.size();
+        info.size = level.pixels.size();
+        texture.levels.push_back(info);
+        texture.data.insert(texture.data.end(), level.pixels.begin(), level.pixels.end());
+    }
+    return true;
+}
+
+
+// Creates the material table with every material pointing at a one-layer grey placeholder array
+void UCreateMaterialLibrary(MaterialLibrary& library, GLuint materialCount)
+{
+    static const unsigned char placeholder[2 * 2 * 4] = {
+        128, 128, 128, 255,  128, 128, 128, 255,
+        128, 128, 128, 255,  128, 128, 128, 255,
+    };
+
+    MaterialArray array;
+    array.format = GL_RGBA8;
+    array.width = 2;
+    array.height = 2;
+    array.levels = 1;
+    UResizeMaterialArray(array, 1, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, 2, 2, 1, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    array.layerCount = 1;
+
+    library.arrays.assign(1, array);
+    library.materials.assign(materialCount, Material());
+}
+
+
+// Reallocates an array's storage with room for 'capacity' layers and without its top 'droppedLevels'
+// mips, copying every level the old and the new storage have in common
+void UResizeMaterialArray(MaterialArray& array, GLsizei capacity, GLsizei droppedLevels)
+{
+    const GLsizei width = std::max(1, array.width >> droppedLevels);
+    const GLsizei height = std::max(1, array.height >> droppedLevels);
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, array.levels - droppedLevels, array.format, width, height, capacity);
+    UTrackTexture(gTextureManager, texture, UTextureBytes(array.format, width, height, capacity, array.levels - droppedLevels));
+
+    // set the texture wrapping parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    // set texture filtering parameters
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    if (array.texture != 0)
+    {
+        for (GLsizei level = std::max(droppedLevels, array.droppedLevels); level < array.levels; ++level)
+        {
+            glCopyImageSubData(array.texture, GL_TEXTURE_2D_ARRAY, level - array.droppedLevels, 0, 0, 0,
+                texture, GL_TEXTURE_2D_ARRAY, level - droppedLevels, 0, 0, 0,
+                std::max(1, array.width >> level), std::max(1, array.height >> level), array.layerCount);
+        }
+        UDestroyTexture(array.texture);
+    }
+
+    array.texture = texture;
+    array.capacity = capacity;
+    array.droppedLevels = droppedLevels;
+}
+
+
+// Uploads levels [firstLevel, endLevel) of a cooked texture into one layer of the bound array, each at
+// its place in the array's possibly reduced storage
+void UUploadMaterialLevels(const MaterialArray& array, GLint layer, const CookedTexture& texture, GLsizei firstLevel, GLsizei endLevel)
+{
+    for (GLsizei i = firstLevel; i < endLevel; ++i)
+    {
+        const TextureLevel& level = texture.levels[i];
+        const GLint storageLevel = i - array.droppedLevels;
+        if (texture.format == GL_RGBA8)
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, storageLevel, 0, 0, layer, level.width, level.height, 1,
+                GL_RGBA, GL_UNSIGNED_BYTE, texture.data.data() + level.offset);
+        else
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, storageLevel, 0, 0, layer, level.width, level.height, 1,
+                texture.format, (GLsizei)level.size, texture.data.data() + level.offset);
+    }
+}
+
+
+// Uploads a material's texture as a new layer of the array matching its size, format and mip count,
+// creating or growing that array as needed, and points the material at the layer
+void UAddMaterialLayer(MaterialLibrary& library, GLuint material, const CookedTexture& texture)
+{
+    const TextureLevel& base = texture.levels[0];
+
+    // Array 0 is the placeholder and never takes material layers
+    size_t index = 1;
+    while (index < library.arrays.size())
+    {
+        const MaterialArray& candidate = library.arrays[index];
+        if (candidate.format == texture.format && candidate.width == base.width && candidate.height == base.height &&
+            candidate.levels == (GLsizei)texture.levels.size())
+            break;
+        ++index;
+    }
+    if (index == library.arrays.size())
+    {
+        MaterialArray array;
+        array.format = texture.format;
+        array.width = base.width;
+        array.height = base.height;
+        array.levels = (GLsizei)texture.levels.size();
+        library.arrays.push_back(array);
+    }
+
+    MaterialArray& array = library.arrays[index];
+    if (array.layerCount == array.capacity)
+        UResizeMaterialArray(array, std::max(MATERIAL_ARRAY_INITIAL_LAYERS, array.capacity * 2), array.droppedLevels);
+
+    // Levels the budget has dropped from the array are skipped; they return with the other layers'
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+    UUploadMaterialLevels(array, array.layerCount, texture, array.droppedLevels, (GLsizei)texture.levels.size());
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    library.materials[material].array = (GLuint)index;
+    library.materials[material].layer = (GLuint)array.layerCount++;
+}
+
+
+// Texture array a material samples from, or 0 for MATERIAL_NONE
+GLuint UGetMaterialTexture(const MaterialLibrary& library, GLuint material)
+{
+    if (material == MATERIAL_NONE)
+        return 0;
+    return library.arrays[library.materials[material].array].texture;
+}
+
+
+// Decodes a material's image on the thread pool; the render loop then uploads it as an array layer.
+// Until then the material shows the placeholder, and a file that fails to load keeps it.
+void UCreateMaterialAsync(AssetLoader& loader, MaterialLibrary& library, GLuint material, const char* filename)
+{
+    loader.pending.fetch_add(1);
+    const std::string path = filename;
+    library.materials[material].file = path;
+    USubmitTask(gThreadPool, [&loader, &library, material, path]()
+    {
+        PROFILE_ZONE("UDecodeTexture");
+        std::function<void()> upload;
+
+        // The mip chain is built or read from the cache here, so the GL thread only copies it
+        std::shared_ptr<CookedTexture> texture = std::make_shared<CookedTexture>();
+        if (ULoadTextureData(path, *texture))
+            upload = [&library, material, texture]() { UAddMaterialLayer(library, material, *texture); };
+        else
+            upload = [path]() { cout << "Failed to load texture " << path << endl; };
+
+        std::lock_guard<std::mutex> lock(loader.mutex);
+        loader.uploads.push_back(std::move(upload));
+    });
+}
+
+
+void UDestroyMaterialLibrary(MaterialLibrary& library)
+{
+    for (MaterialArray& array : library.arrays)
+        UDestroyTexture(array.texture);
+    library.arrays.clear();
+    library.materials.clear();
+}
+
+// Runs decoded uploads on the GL thread until none are waiting or the time budget is spent
+void UPumpAssetUploads(AssetLoader& loader, double budgetSeconds)
+{
+    if (loader.pending.load() == 0)
+        return;
+
+    const double start = UGetTime();
+    do
+    {
+        std::function<void()> upload;
+        {
+            std::lock_guard<std::mutex> lock(loader.mutex);
+            if (loader.uploads.empty())
+                return;
+            upload = std::move(loader.uploads.front());
+            loader.uploads.pop_front();
+        }
+        upload();
+
+        if (loader.pending.fetch_sub(1) == 1)
+            cout << "Assets ready in " << (UGetTime() - loader.startTime) * 1000.0 << " ms" << endl;
+    } while (UGetTime() - start < budgetSeconds);
+}
+
+
+// Blocks until every submitted load has been uploaded
+void UFinishAssetLoads(AssetLoader& loader)
+{
+    while (loader.pending.load() > 0)
+    {
+        UPumpAssetUploads(loader, 1.0e9);
+        std::this_thread::yield();
+    }
+}
+
+
+// 64-bit FNV-1a hash of a byte range, continuing from the given hash
+uint64_t UHashBytes(const unsigned char* bytes, size_t size, uint64_t hash)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+
+bool UReadFile(const std::string& path, std::vector<unsigned char>& bytes)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+        return false;
+
+    std::streamsize size = file.tellg();
+    file.seekg(0);
+    bytes.resize((size_t)size);
+    return (bool)file.read((char*)bytes.data(), size);
+}
+
+
+// Encodes 16 RGBA pixels (row-major 4x4) as one 8-byte BC1 block. The endpoints are opposite corners of
+// the colour bounding box, inset by 1/16 of its extent, on the diagonal that follows the sign of each
+// channel's covariance with the widest channel; each pixel takes the palette entry nearest to its
+// projection onto that diagonal.
+void UEncodeBC1Block(const unsigned char* block, unsigned char* out)
+{
+    unsigned char minColor[4], maxColor[4];
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    // Four pixels per register; per-byte min/max, then fold the four lanes onto the first
+    __m128i p0 = _mm_loadu_si128((const __m128i*)block + 0);
+    __m128i p1 = _mm_loadu_si128((const __m128i*)block + 1);
+    __m128i p2 = _mm_loadu_si128((const __m128i*)block + 2);
+    __m128i p3 = _mm_loadu_si128((const __m128i*)block + 3);
+    __m128i low = _mm_min_epu8(_mm_min_epu8(p0, p1), _mm_min_epu8(p2, p3));
+    __m128i high = _mm_max_epu8(_mm_max_epu8(p0, p1), _mm_max_epu8(p2, p3));
+    low = _mm_min_epu8(low, _mm_shuffle_epi32(low, _MM_SHUFFLE(1, 0, 3, 2)));
+    low = _mm_min_epu8(low, _mm_shuffle_epi32(low, _MM_SHUFFLE(2, 3, 0, 1)));
+    high = _mm_max_epu8(high, _mm_shuffle_epi32(high, _MM_SHUFFLE(1, 0, 3, 2)));
+    high = _mm_max_epu8(high, _mm_shuffle_epi32(high, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t packedMin = (uint32_t)_mm_cvtsi128_si32(low);
+    uint32_t packedMax = (uint32_t)_mm_cvtsi128_si32(high);
+    memcpy(minColor, &packedMin, 4);
+    memcpy(maxColor, &packedMax, 4);
+#else
+    for (int c = 0; c < 4; ++c)
+    {
+        minColor[c] = 255;
+        maxColor[c] = 0;
+    }
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            minColor[c] = std::min(minColor[c], block[i * 4 + c]);
+            maxColor[c] = std::max(maxColor[c], block[i * 4 + c]);
+        }
+    }
+#endif
+
+    // Pull the endpoints off outliers
+    for (int c = 0; c < 3; ++c)
+    {
+        int inset = (maxColor[c] - minColor[c]) >> 4;
+        minColor[c] = (unsigned char)(minColor[c] + inset);
+        maxColor[c] = (unsigned char)(maxColor[c] - inset);
+    }
+
+    // The colours run along the main diagonal only when the channels rise together; a channel that falls
+    // as the widest one rises trades its endpoints so the line runs along the matching diagonal instead
+    int widest = 0;
+    for (int c = 1; c < 3; ++c)
+    {
+        if (maxColor[c] - minColor[c] > maxColor[widest] - minColor[widest])
+            widest = c;
+    }
+    for (int c = 0; c < 3; ++c)
+    {
+        int covariance = 0;
+        for (int i = 0; i < 16; ++i)
+        {
+            const unsigned char* pixel = block + i * 4;
+            covariance += (2 * pixel[widest] - minColor[widest] - maxColor[widest]) * (2 * pixel[c] - minColor[c] - maxColor[c]);
+        }
+        if (covariance < 0)
+            std::swap(minColor[c], maxColor[c]);
+    }
+
+    uint16_t color0 = (uint16_t)(((maxColor[0] >> 3) << 11) | ((maxColor[1] >> 2) << 5) | (maxColor[2] >> 3));
+    uint16_t color1 = (uint16_t)(((minColor[0] >> 3) << 11) | ((minColor[1] >> 2) << 5) | (minColor[2] >> 3));
+
+    uint32_t indices = 0;
+    if (color0 != color1)
+    {
+        int axis[3] = { maxColor[0] - minColor[0], maxColor[1] - minColor[1], maxColor[2] - minColor[2] };
+        int lengthSquared = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+        // Position along the axis in thirds -> palette index (0 = color0, 1 = color1, 2 and 3 between)
+        static const uint32_t paletteIndex[4] = { 1, 3, 2, 0 };
+        for (int i = 0; i < 16; ++i)
+        {
+            const unsigned char* pixel = block + i * 4;
+            int projection = (pixel[0] - minColor[0]) * axis[0] + (pixel[1] - minColor[1]) * axis[1] + (pixel[2] - minColor[2]) * axis[2];
+            int step = lengthSquared > 0 ? (projection * 3 + lengthSquared / 2) / lengthSquared : 0;
+            step = std::max(0, std::min(3, step));
+            indices |= paletteIndex[step] << (2 * i);
+        }
+    }
+
+    // color0 > color1 selects the four-colour palette; swapping the endpoints swaps 0 with 1 and 2 with 3
+    if (color0 < color1)
+    {
+        std::swap(color0, color1);
+        indices ^= 0x55555555u;
+    }
+
+    out[0] = (unsigned char)(color0 & 0xFF);
+    out[1] = (unsigned char)(color0 >> 8);
+    out[2] = (unsigned char)(color1 & 0xFF);
+    out[3] = (unsigned char)(color1 >> 8);
+    for (int b = 0; b < 4; ++b)
+        out[4 + b] = (unsigned char)(indices >> (8 * b));
+}
+
+
+// Encodes 16 RGBA pixels as one 16-byte BC3 block: an eight-value alpha ramp followed by a BC1 colour block
+void UEncodeBC3Block(const unsigned char* block, unsigned char* out)
+{
+    int alphaMin = 255, alphaMax = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        alphaMin = std::min(alphaMin, (int)block[i * 4 + 3]);
+        alphaMax = std::max(alphaMax, (int)block[i * 4 + 3]);
+    }
+
+    uint64_t indices = 0;
+    if (alphaMax > alphaMin)
+    {
+        // alpha0 > alpha1: code 0 is alpha0, 1 is alpha1 and 2..7 step from alpha0 towards alpha1
+        int range = alphaMax - alphaMin;
+        for (int i = 0; i < 16; ++i)
+        {
+            int step = ((block[i * 4 + 3] - alphaMin) * 7 + range / 2) / range;
+            uint64_t code = step == 7 ? 0 : step == 0 ? 1 : (uint64_t)(8 - step);
+            indices |= code << (3 * i);
+        }
+    }
+
+    out[0] = (unsigned char)alphaMax;
+    out[1] = (unsigned char)alphaMin;
+    for (int b = 0; b < 6; ++b)
+        out[2 + b] = (unsigned char)(indices >> (8 * b));
+
+    UEncodeBC1Block(block, out + 8);
+}
+
+
+// Encodes every level of the image's mip chain: BC1 for opaque images, BC3 when the source has alpha
+void UCookTexture(const unsigned char* pixels, int width, int height, int channels, CookedTexture& cooked)
+{
+    PROFILE_ZONE("UCookTexture");
+    std::vector<ImageLevel> mips;
+    UBuildMipChain(pixels, width, height, channels, TEXTURE_MIP_FILTER, mips);
+
+    const bool hasAlpha = channels == 4;
+    const size_t blockBytes = hasAlpha ? 16 : 8;
+    cooked.format = hasAlpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    cooked.levels.clear();
+    cooked.data.clear();
+
+    for (const ImageLevel& mip : mips)
+    {
+        const int blocksX = (mip.width + 3) / 4;
+        const int blocksY = (mip.height + 3) / 4;
+
+        TextureLevel info;
+        info.width = mip.width;
+        info.height = mip.height;
+        info.offset = cooked.data.size();
+        info.size = (size_t)blocksX * blocksY * blockBytes;
+        cooked.data.resize(info.offset + info.size);
+        cooked.levels.push_back(info);
+
+        unsigned char* out = cooked.data.data() + info.offset;
+        unsigned char block[16 * 4];
+        for (int by = 0; by < blocksY; ++by)
+        {
+            for (int bx = 0; bx < blocksX; ++bx)
+            {
+                // Blocks past the right or top edge repeat the last column or row
+                for (int y = 0; y < 4; ++y)
+                {
+                    int sy = std::min(by * 4 + y, mip.height - 1);
+                    for (int x = 0; x < 4; ++x)
+                    {
+                        int sx = std::min(bx * 4 + x, mip.width - 1);
+                        memcpy(block + (y * 4 + x) * 4, &mip.pixels[((size_t)sy * mip.width + sx) * 4], 4);
+                    }
+                }
+
+                if (hasAlpha)
+                    UEncodeBC3Block(block, out);
+                else
+                    UEncodeBC1Block(block, out);
+                out += blockBytes;
+            }
+        }
+    }
+}
+
+// Writes a cooked texture in KTX2's header and level-index layout. The data format descriptor and
+// key/value sections are left empty, so these files are meant for ULoadTextureCache only.
+bool USaveTextureCache(const std::string& path, const CookedTexture& cooked)
+{
+    KtxHeader header = {};
+    memcpy(header.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER));
+    header.vkFormat = cooked.format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? KTX_FORMAT_BC3_RGBA : KTX_FORMAT_BC1_RGB;
+    header.typeSize = 1;
+    header.pixelWidth = (uint32_t)cooked.levels[0].width;
+    header.pixelHeight = (uint32_t)cooked.levels[0].height;
+    header.faceCount = 1;
+    header.levelCount = (uint32_t)cooked.levels.size();
+
+    const size_t dataStart = sizeof(KtxHeader) + sizeof(KtxLevelIndex) * cooked.levels.size();
+    std::vector<KtxLevelIndex> index(cooked.levels.size());
+    for (size_t i = 0; i < cooked.levels.size(); ++i)
+    {
+        index[i].byteOffset = dataStart + cooked.levels[i].offset;
+        index[i].byteLength = cooked.levels[i].size;
+        index[i].uncompressedByteLength = cooked.levels[i].size;
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)index.data(), sizeof(KtxLevelIndex) * index.size());
+    file.write((const char*)cooked.data.data(), cooked.data.size());
+    return (bool)file;
+}
+
+
+// Reads a file written by USaveTextureCache. Anything truncated or unexpected is rejected so the caller re-cooks.
+bool ULoadTextureCache(const std::string& path, CookedTexture& cooked)
+{
+    std::vector<unsigned char> bytes;
+    if (!UReadFile(path, bytes) || bytes.size() < sizeof(KtxHeader))
+        return false;
+
+    KtxHeader header;
+    memcpy(&header, bytes.data(), sizeof(header));
+    if (memcmp(header.identifier, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0 ||
+        header.levelCount == 0 || header.levelCount > 32 || header.pixelWidth == 0 || header.pixelHeight == 0)
+        return false;
+
+    size_t blockBytes;
+    if (header.vkFormat == KTX_FORMAT_BC1_RGB)
+    {
+        cooked.format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        blockBytes = 8;
+    }
+    else if (header.vkFormat == KTX_FORMAT_BC3_RGBA)
+    {
+        cooked.format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        blockBytes = 16;
+    }
+    else
+        return false;
+
+    if (bytes.size() < sizeof(KtxHeader) + sizeof(KtxLevelIndex) * header.levelCount)
+        return false;
+
+    cooked.levels.resize(header.levelCount);
+    for (uint32_t i = 0; i < header.levelCount; ++i)
+    {
+        KtxLevelIndex index;
+        memcpy(&index, bytes.data() + sizeof(KtxHeader) + sizeof(KtxLevelIndex) * i, sizeof(index));
+
+        TextureLevel& level = cooked.levels[i];
+        level.width = std::max(1, (int)(header.pixelWidth >> i));
+        level.height = std::max(1, (int)(header.pixelHeight >> i));
+        level.offset = (size_t)index.byteOffset;
+        level.size = (size_t)index.byteLength;
+
+        const size_t expected = (size_t)((level.width + 3) / 4) * ((level.height + 3) / 4) * blockBytes;
+        if (level.size != expected || index.byteOffset + index.byteLength > bytes.size())
+            return false;
+    }
+
+    // Level offsets are file offsets, so the file itself is the data block
+    cooked.data.swap(bytes);
+    return true;
+}
+
+
+// Cache files are named after a hash of the source bytes and the cook version, so an edited image or a
+// format change misses the cache instead of loading stale data
+std::string UTextureCachePath(const std::vector<unsigned char>& source, const char* extension)
+{
+    const uint64_t key = UHashBytes(source.data(), source.size(), FNV_OFFSET_BASIS ^ TEXTURE_COOK_VERSION);
+    static const char hexDigits[] = "0123456789abcdef";
+    std::string cachePath = TEXTURE_CACHE_DIRECTORY;
+    for (int shift = 60; shift >= 0; shift -= 4)
+        cachePath += hexDigits[(key >> shift) & 0xF];
+    return cachePath + extension;
+}
+
+
+// Produces the block-compressed mip chain of a source image: from the cache when a file for the source's
+// content hash exists, otherwise by decoding and cooking it and writing the cache. Safe on any thread.
+bool UCookTextureFile(const std::string& filename, CookedTexture& cooked)
+{
+    PROFILE_ZONE("UCookTextureFile");
+    std::vector<unsigned char> source;
+    if (!UReadFile(filename, source))
+        return false;
+
+    const std::string cachePath = UTextureCachePath(source, ".ktx2");
+    if (ULoadTextureCache(cachePath, cooked))
+        return true;
+
+    int width, height, channels;
+    unsigned char* image = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 0);
+    if (!image)
+        return false;
+
+    if (channels != 3 && channels != 4)
+    {
+        cout << "Not implemented to handle image with " << channels << " channels" << endl;
+        stbi_image_free(image);
+        return false;
+    }
+
+    flipImageVertically(image, width, height, channels);
+    UCookTexture(image, width, height, channels, cooked);
+    stbi_image_free(image);
+
+    // An unwritable cache only costs the next launch another cook
+    if (!USaveTextureCache(cachePath, cooked))
+        cout << "Could not write texture cache " << cachePath << endl;
+    return true;
+}
+
+
+// Uploads every precomputed level of a texture into an existing texture name
+void UUploadCookedTexture(GLuint textureId, const CookedTexture& cooked)
+{
+    UTrackTexture(gTextureManager, textureId, cooked.data.size());
+    glBindTexture(GL_TEXTURE_2D, textureId);
+
+    // set the texture wrapping parameters
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    // set texture filtering parameters
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)cooked.levels.size() - 1);
+
+    for (size_t i = 0; i < cooked.levels.size(); ++i)
+    {
+        const TextureLevel& level = cooked.levels[i];
+        if (cooked.format == GL_RGBA8)
+            glTexImage2D(GL_TEXTURE_2D, (GLint)i, GL_RGBA8, level.width, level.height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                cooked.data.data() + level.offset);
+        else
+            glCompressedTexImage2D(GL_TEXTURE_2D, (GLint)i, cooked.format, level.width, level.height, 0,
+                (GLsizei)level.size, cooked.data.data() + level.offset);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+}
+
+
+// The original per-byte row swap, kept as the baseline for UBenchmarkImageKernels
+void UFlipImageBytewise(unsigned char* image, int width, int height, int channels)
+{
+    for (int j = 0; j < height / 2; ++j)
+    {
+        int index1 = j * width * channels;
+        int index2 = (height - 1 - j) * width * channels;
+
+        for (int i = width * channels; i > 0; --i)
+        {
+            unsigned char tmp = image[index1];
+            image[index1] = image[index2];
+            image[index2] = tmp;
+            ++index1;
+            ++index2;
+        }
+    }
+}
+
+
+// Widens packed RGB to RGBA with opaque alpha
+void UExpandRGBToRGBA(const unsigned char* rgb, unsigned char* rgba, size_t pixelCount)
+{
+    size_t i = 0;
+
+#if defined(IMAGE_SIMD_SSE2) && (defined(__AVX2__) || defined(__SSSE3__))
+    // 16 pixels per iteration, four at a time: pshufb spreads 12 source bytes over 16.
+    // Each load reads 16 bytes for 12, so stop while a whole extra pixel lies beyond the last load.
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+    for (; i + 18 <= pixelCount; i += 16)
+    {
+        for (size_t k = 0; k < 16; k += 4)
+        {
+            __m128i source = _mm_loadu_si128((const __m128i*)(rgb + (i + k) * 3));
+            _mm_storeu_si128((__m128i*)(rgba + (i + k) * 4), _mm_or_si128(_mm_shuffle_epi8(source, spread), opaque));
+        }
+    }
+#elif defined(IMAGE_SIMD_NEON)
+    // 16 pixels per iteration through the de-interleaving loads and interleaving stores
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        uint8x16x3_t source = vld3q_u8(rgb + i * 3);
+        uint8x16x4_t expanded;
+        expanded.val[0] = source.val[0];
+        expanded.val[1] = source.val[1];
+        expanded.val[2] = source.val[2];
+        expanded.val[3] = vdupq_n_u8(255);
+        vst4q_u8(rgba + i * 4, expanded);
+    }
+#endif
+
+    for (; i < pixelCount; ++i)
+    {
+        rgba[i * 4 + 0] = rgb[i * 3 + 0];
+        rgba[i * 4 + 1] = rgb[i * 3 + 1];
+        rgba[i * 4 + 2] = rgb[i * 3 + 2];
+        rgba[i * 4 + 3] = 255;
+    }
+}
+
+
+// Multiplies colour by alpha in place, rounding exactly: c * a / 255 == (t + (t >> 8)) >> 8 with t = c * a + 128
+void UPremultiplyAlpha(unsigned char* rgba, size_t pixelCount)
+{
+    size_t i = 0;
+
+#if defined(IMAGE_SIMD_SSE2) && defined(__AVX2__)
+    // Eight pixels per iteration in 16-bit lanes. Alpha multiplies itself by 255 so it comes out unchanged.
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i colorMask = _mm256_set1_epi64x(0x0000FFFFFFFFFFFFll);
+    const __m256i alphaOne = _mm256_set1_epi64x(0x00FF000000000000ll);
+    const __m256i half = _mm256_set1_epi16(128);
+    for (; i + 8 <= pixelCount; i += 8)
+    {
+        __m256i pixels = _mm256_loadu_si256((const __m256i*)(rgba + i * 4));
+        __m256i halves[2] = { _mm256_unpacklo_epi8(pixels, zero), _mm256_unpackhi_epi8(pixels, zero) };
+        for (__m256i& value : halves)
+        {
+            __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(value, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            alpha = _mm256_or_si256(_mm256_and_si256(alpha, colorMask), alphaOne);
+            __m256i product = _mm256_add_epi16(_mm256_mullo_epi16(value, alpha), half);
+            value = _mm256_srli_epi16(_mm256_add_epi16(product, _mm256_srli_epi16(product, 8)), 8);
+        }
+        _mm256_storeu_si256((__m256i*)(rgba + i * 4), _mm256_packus_epi16(halves[0], halves[1]));
+    }
+#elif defined(IMAGE_SIMD_SSE2)
+    // Four pixels per iteration in 16-bit lanes. Alpha multiplies itself by 255 so it comes out unchanged.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i colorMask = _mm_set_epi32(0x0000FFFF, (int)0xFFFFFFFF, 0x0000FFFF, (int)0xFFFFFFFF);
+    const __m128i alphaOne = _mm_set_epi32(0x00FF0000, 0, 0x00FF0000, 0);
+    const __m128i half = _mm_set1_epi16(128);
+    for (; i + 4 <= pixelCount; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(rgba + i * 4));
+        __m128i halves[2] = { _mm_unpacklo_epi8(pixels, zero), _mm_unpackhi_epi8(pixels, zero) };
+        for (__m128i& value : halves)
+        {
+            __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(value, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            alpha = _mm_or_si128(_mm_and_si128(alpha, colorMask), alphaOne);
+            __m128i product = _mm_add_epi16(_mm_mullo_epi16(value, alpha), half);
+            value = _mm_srli_epi16(_mm_add_epi16(product, _mm_srli_epi16(product, 8)), 8);
+        }
+        _mm_storeu_si128((__m128i*)(rgba + i * 4), _mm_packus_epi16(halves[0], halves[1]));
+    }
+#elif defined(IMAGE_SIMD_NEON)
+    // Eight pixels per iteration; vraddhn computes (t + ((t + 128) >> 8) + 128) >> 8 in one step
+    for (; i + 8 <= pixelCount; i += 8)
+    {
+        uint8x8x4_t pixels = vld4_u8(rgba + i * 4);
+        for (int c = 0; c < 3; ++c)
+        {
+            uint16x8_t product = vmull_u8(pixels.val[c], pixels.val[3]);
+            pixels.val[c] = vraddhn_u16(product, vrshrq_n_u16(product, 8));
+        }
+        vst4_u8(rgba + i * 4, pixels);
+    }
+#endif
+
+    for (; i < pixelCount; ++i)
+    {
+        unsigned char* pixel = rgba + i * 4;
+        for (int c = 0; c < 3; ++c)
+        {
+            unsigned product = pixel[c] * pixel[3] + 128u;
+            pixel[c] = (unsigned char)((product + (product >> 8)) >> 8);
+        }
+    }
+}
+
+
+// Built on first use; static initialization is thread-safe, so loader workers may race to it
+const SrgbTables& UGetSrgbTables()
+{
+    static const SrgbTables tables = []()
+    {
+        SrgbTables built;
+        for (int i = 0; i < 256; ++i)
+        {
+            float encoded = i / 255.0f;
+            built.toLinear[i] = encoded <= 0.04045f ? encoded / 12.92f : powf((encoded + 0.055f) / 1.055f, 2.4f);
+        }
+        for (int i = 0; i < SRGB_ENCODE_STEPS; ++i)
+        {
+            float linear = i / (float)(SRGB_ENCODE_STEPS - 1);
+            float encoded = linear <= 0.0031308f ? linear * 12.92f : 1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+            built.toSrgb[i] = (unsigned char)(encoded * 255.0f + 0.5f);
+        }
+        return built;
+    }();
+    return tables;
+}
+
+
+// Decodes sRGB colour to linear floats; alpha is already linear and is only rescaled
+void UImageToLinear(const unsigned char* rgba, size_t pixelCount, float* linear)
+{
+    const SrgbTables& tables = UGetSrgbTables();
+    for (size_t i = 0; i < pixelCount * 4; i += 4)
+    {
+        linear[i + 0] = tables.toLinear[rgba[i + 0]];
+        linear[i + 1] = tables.toLinear[rgba[i + 1]];
+        linear[i + 2] = tables.toLinear[rgba[i + 2]];
+        linear[i + 3] = rgba[i + 3] / 255.0f;
+    }
+}
+
+
+// Clamps linear floats (filter lobes can overshoot) and encodes them back to sRGB bytes
+void ULinearToImage(const float* linear, size_t pixelCount, unsigned char* rgba)
+{
+    const SrgbTables& tables = UGetSrgbTables();
+    const float maxStep = (float)(SRGB_ENCODE_STEPS - 1);
+
+#if defined(IMAGE_SIMD_SSE2)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_setr_ps(maxStep, maxStep, maxStep, 255.0f);
+#elif defined(IMAGE_SIMD_NEON)
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float scaleValues[4] = { maxStep, maxStep, maxStep, 255.0f };
+    const float32x4_t scale = vld1q_f32(scaleValues);
+#endif
+
+    for (size_t i = 0; i < pixelCount * 4; i += 4)
+    {
+        // Colour becomes a table step, alpha its final byte value
+        int32_t steps[4];
+#if defined(IMAGE_SIMD_SSE2)
+        __m128 value = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(linear + i), zero), one);
+        _mm_storeu_si128((__m128i*)steps, _mm_cvtps_epi32(_mm_mul_ps(value, scale)));
+#elif defined(IMAGE_SIMD_NEON)
+        float32x4_t value = vminq_f32(vmaxq_f32(vld1q_f32(linear + i), zero), one);
+        vst1q_s32(steps, vcvtnq_s32_f32(vmulq_f32(value, scale)));
+#else
+        for (int c = 0; c < 4; ++c)
+        {
+            float value = std::max(0.0f, std::min(1.0f, linear[i + c]));
+            steps[c] = (int32_t)(value * (c == 3 ? 255.0f : maxStep) + 0.5f);
+        }
+#endif
+        rgba[i + 0] = tables.toSrgb[steps[0]];
+        rgba[i + 1] = tables.toSrgb[steps[1]];
+        rgba[i + 2] = tables.toSrgb[steps[2]];
+        rgba[i + 3] = (unsigned char)steps[3];
+    }
+}
+
+
+// Halves a linear RGBA float image along both axes (an axis already at 1 texel stays 1).
+// The filter is separable: one pass across rows, then one down columns, four channels per SIMD op.
+void UDownsampleLinear(const std::vector<float>& source, int width, int height, int filter, std::vector<float>& destination)
+{
+    // Taps relative to source texel 2i of destination texel i. The Kaiser kernel spans two destination
+    // texels either side (alpha 4); its weights are fixed for a 2:1 reduction, so compute them once.
+    static const float boxWeights[2] = { 0.5f, 0.5f };
+    static const struct KaiserKernel
+    {
+        float weights[8];
+        KaiserKernel()
+        {
+            const float alpha = 4.0f;
+            auto besselI0 = [](float x)
+            {
+                float sum = 1.0f, term = 1.0f;
+                for (int k = 1; k < 16; ++k)
+                {
+                    term *= (x * 0.5f / k) * (x * 0.5f / k);
+                    sum += term;
+                }
+                return sum;
+            };
+
+            float total = 0.0f;
+            for (int t = 0; t < 8; ++t)
+            {
+                // Distance from the destination texel centre in destination texels: -1.75 .. 1.75
+                float x = (t - 3.5f) * 0.5f;
+                float sinc = sinf(3.14159265f * x) / (3.14159265f * x);
+                float window = besselI0(alpha * sqrtf(1.0f - (x * 0.5f) * (x * 0.5f))) / besselI0(alpha);
+                weights[t] = sinc * window;
+                total += weights[t];
+            }
+            for (float& weight : weights)
+                weight /= total;
+        }
+    } kaiser;
+
+    const float* weights = filter == MIP_FILTER_KAISER ? kaiser.weights : boxWeights;
+    const int tapCount = filter == MIP_FILTER_KAISER ? 8 : 2;
+    const int firstTap = filter == MIP_FILTER_KAISER ? -3 : 0;
+
+    // One axis at a time; texels along the axis are 'step' floats apart, lines are 'pitch' floats apart
+    auto reduce = [&](const float* input, int length, int lines, int step, int pitch, float* output, int outStep, int outPitch)
+    {
+        const int outLength = std::max(1, length / 2);
+        for (int line = 0; line < lines; ++line)
+        {
+            const float* in = input + (size_t)line * pitch;
+            float* out = output + (size_t)line * outPitch;
+            for (int i = 0; i < outLength; ++i)
+            {
+                float* texel = out + (size_t)i * outStep;
+                if (length == 1)
+                {
+                    memcpy(texel, in, sizeof(float) * 4);
+                    continue;
+                }
+
+#if defined(IMAGE_SIMD_SSE2)
+                __m128 sum = _mm_setzero_ps();
+                for (int t = 0; t < tapCount; ++t)
+                {
+                    int s = std::max(0, std::min(length - 1, 2 * i + firstTap + t));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[t]), _mm_loadu_ps(in + (size_t)s * step)));
+                }
+                _mm_storeu_ps(texel, sum);
+#elif defined(IMAGE_SIMD_NEON)
+                float32x4_t sum = vdupq_n_f32(0.0f);
+                for (int t = 0; t < tapCount; ++t)
+                {
+                    int s = std::max(0, std::min(length - 1, 2 * i + firstTap + t));
+                    sum = vmlaq_n_f32(sum, vld1q_f32(in + (size_t)s * step), weights[t]);
+                }
+                vst1q_f32(texel, sum);
+#else
+                float sum[4] = {};
+                for (int t = 0; t < tapCount; ++t)
+                {
+                    int s = std::max(0, std::min(length - 1, 2 * i + firstTap + t));
+                    for (int c = 0; c < 4; ++c)
+                        sum[c] += weights[t] * in[(size_t)s * step + c];
+                }
+                memcpy(texel, sum, sizeof(sum));
+#endif
+            }
+        }
+    };
+
+    const int nextWidth = std::max(1, width / 2);
+    const int nextHeight = std::max(1, height / 2);
+
+    std::vector<float> rows((size_t)nextWidth * height * 4);
+    reduce(source.data(), width, height, 4, width * 4, rows.data(), 4, nextWidth * 4);
+
+    destination.resize((size_t)nextWidth * nextHeight * 4);
+    reduce(rows.data(), height, nextWidth, nextWidth * 4, 4, destination.data(), nextWidth * 4, 4);
+}
+
+
+// Builds the complete RGBA8 mip chain of an RGB or RGBA image. RGBA images are premultiplied first
+// so transparent texels do not bleed their colour into neighbours; reduction runs in linear light.
+void UBuildMipChain(const unsigned char* pixels, int width, int height, int channels, int filter, std::vector<ImageLevel>& levels)
+{
+    PROFILE_ZONE("UBuildMipChain");
+    const size_t pixelCount = (size_t)width * height;
+
+    levels.clear();
+    levels.emplace_back();
+    ImageLevel& base = levels.back();
+    base.width = width;
+    base.height = height;
+    base.pixels.resize(pixelCount * 4);
+    if (channels == 3)
+        UExpandRGBToRGBA(pixels, base.pixels.data(), pixelCount);
+    else
+    {
+        memcpy(base.pixels.data(), pixels, pixelCount * 4);
+        UPremultiplyAlpha(base.pixels.data(), pixelCount);
+    }
+
+    std::vector<float> linear(pixelCount * 4);
+    UImageToLinear(levels[0].pixels.data(), pixelCount, linear.data());
+
+    std::vector<float> next;
+    while (width > 1 || height > 1)
+    {
+        UDownsampleLinear(linear, width, height, filter, next);
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+        linear.swap(next);
+
+        levels.emplace_back();
+        ImageLevel& level = levels.back();
+        level.width = width;
+        level.height = height;
+        level.pixels.resize((size_t)width * height * 4);
+        ULinearToImage(linear.data(), (size_t)width * height, level.pixels.data());
+    }
+}
+
+
+// Times the image kernels on a synthetic 2048x2048 photo-sized image and prints the averages,
+// with the original per-byte row flip as the baseline
+void UBenchmarkImageKernels()
+{
+    const int width = 2048, height = 2048, runs = 10;
+    const size_t pixelCount = (size_t)width * height;
+
+    std::vector<unsigned char> rgb(pixelCount * 3);
+    uint32_t seed = 12345u;
+    for (unsigned char& value : rgb)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        value = (unsigned char)(seed >> 24);
+    }
+    std::vector<unsigned char> rgba(pixelCount * 4);
+    std::vector<ImageLevel> levels;
+
+    auto time = [runs](const char* name, const std::function<void()>& kernel)
+    {
+        kernel(); // Warm caches and the sRGB tables
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < runs; ++i)
+            kernel();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+        cout << "  " << name << ": " << ms << " ms" << endl;
+        return ms;
+    };
+
+    cout << "Image kernels, " << width << "x" << height << ", mean of " << runs << " runs" << endl;
+    double bytewise = time("flip (per-byte loop)", [&]() { UFlipImageBytewise(rgb.data(), width, height, 3); });
+    double chunked = time("flip (memcpy rows)", [&]() { flipImageVertically(rgb.data(), width, height, 3); });
+    cout << "  flip speedup: " << bytewise / chunked << "x" << endl;
+    time("RGB -> RGBA", [&]() { UExpandRGBToRGBA(rgb.data(), rgba.data(), pixelCount); });
+    time("premultiply alpha", [&]() { UPremultiplyAlpha(rgba.data(), pixelCount); });
+    time("mip chain (box)", [&]() { UBuildMipChain(rgb.data(), width, height, 3, MIP_FILTER_BOX, levels); });
+    time("mip chain (Kaiser)", [&]() { UBuildMipChain(rgb.data(), width, height, 3, MIP_FILTER_KAISER, levels); });
+}
+
+// Packs a tile's address the way the feedback shader writes it
+uint32_t UMakeVirtualTileKey(GLuint material, GLuint level, GLuint tileX, GLuint tileY)
+{
+    return material << 24 | level << 20 | tileY << 10 | tileX;
+}
+
+
+// Cuts every level into tiles, finest first, down to the first level that fits in a single tile
+void UComputeVirtualLayout(VirtualMaterial& material, GLuint width, GLuint height)
+{
+    material.width = width;
+    material.height = height;
+    material.levelTiles.clear();
+    material.levelFirstTile.clear();
+    material.tileCount = 0;
+
+    for (GLuint level = 0; level < VT_MAX_LEVELS; ++level)
+    {
+        const GLuint levelWidth = std::max(1u, width >> level);
+        const GLuint levelHeight = std::max(1u, height >> level);
+        const glm::uvec2 tiles((levelWidth + VT_TILE_SIZE - 1) / VT_TILE_SIZE, (levelHeight + VT_TILE_SIZE - 1) / VT_TILE_SIZE);
+        material.levelTiles.push_back(tiles);
+        material.levelFirstTile.push_back(material.tileCount);
+        material.tileCount += tiles.x * tiles.y;
+        if (tiles.x == 1 && tiles.y == 1)
+            break;
+    }
+}
+
+
+// Writes a material's tile file next to the texture cache, or reuses one whose header and size match.
+// Runs on the thread pool.
+bool UCookVirtualTexture(const std::string& filename, VirtualMaterial& material)
+{
+    PROFILE_ZONE("UCookVirtualTexture");
+    std::vector<unsigned char> source;
+    if (!UReadFile(filename, source))
+        return false;
+    material.tileFile = UTextureCachePath(source, ".vtex");
+
+    std::ifstream cached(material.tileFile, std::ios::binary | std::ios::ate);
+    if (cached)
+    {
+        const std::streamoff fileSize = cached.tellg();
+        VirtualTileHeader header;
+        cached.seekg(0);
+        if (cached.read((char*)&header, sizeof(header)) && memcmp(header.magic, VT_TILE_FILE_MAGIC, sizeof(header.magic)) == 0)
+        {
+            UComputeVirtualLayout(material, header.width, header.height);
+            if (header.levelCount == material.levelTiles.size() &&
+                fileSize == (std::streamoff)(sizeof(header) + VT_TILE_BYTES * material.tileCount))
+                return true;
+        }
+    }
+    cached.close();
+
+    int width, height, channels;
+    unsigned char* image = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, 0);
+    if (!image)
+        return false;
+
+    if (channels != 3 && channels != 4)
+    {
+        cout << "Not implemented to handle image with " << channels << " channels" << endl;
+        stbi_image_free(image);
+        return false;
+    }
+
+    flipImageVertically(image, width, height, channels);
+    std::vector<ImageLevel> levels;
+    UBuildMipChain(image, width, height, channels, TEXTURE_MIP_FILTER, levels);
+    stbi_image_free(image);
+    UComputeVirtualLayout(material, (GLuint)width, (GLuint)height);
+
+    std::ofstream file(material.tileFile, std::ios::binary);
+    VirtualTileHeader header;
+    memcpy(header.magic, VT_TILE_FILE_MAGIC, sizeof(header.magic));
+    header.width = (uint32_t)width;
+    header.height = (uint32_t)height;
+    header.levelCount = (uint32_t)material.levelTiles.size();
+    file.write((const char*)&header, sizeof(header));
+
+    // Borders and the padding past a level's last texel wrap around, matching the repeat addressing
+    auto wrap = [](int coordinate, int size) { coordinate %= size; return coordinate < 0 ? coordinate + size : coordinate; };
+    std::vector<unsigned char> tile(VT_TILE_BYTES);
+    for (size_t level = 0; level < material.levelTiles.size(); ++level)
+    {
+        const ImageLevel& levelImage = levels[level];
+        for (GLuint tileY = 0; tileY < material.levelTiles[level].y; ++tileY)
+            for (GLuint tileX = 0; tileX < material.levelTiles[level].x; ++tileX)
+            {
+                for (GLuint y = 0; y < VT_SLOT_SIZE; ++y)
+                {
+                    const int sourceY = wrap((int)(tileY * VT_TILE_SIZE + y) - (int)VT_TILE_BORDER, levelImage.height);
+                    for (GLuint x = 0; x < VT_SLOT_SIZE; ++x)
+                    {
+                        const int sourceX = wrap((int)(tileX * VT_TILE_SIZE + x) - (int)VT_TILE_BORDER, levelImage.width);
+                        memcpy(&tile[((size_t)y * VT_SLOT_SIZE + x) * 4], &levelImage.pixels[((size_t)sourceY * levelImage.width + sourceX) * 4], 4);
+                    }
+                }
+                file.write((const char*)tile.data(), tile.size());
+            }
+    }
+
+    if (!file)
+    {
+        cout << "Could not write tile file " << material.tileFile << endl;
+        return false;
+    }
+    return true;
+}
+
+
+// Reads one tile record; the stream stays open across the tiles of a request batch
+bool UReadVirtualTile(std::ifstream& file, GLuint tileIndex, std::vector<unsigned char>& pixels)
+{
+    pixels.resize(VT_TILE_BYTES);
+    file.seekg((std::streamoff)(sizeof(VirtualTileHeader) + VT_TILE_BYTES * tileIndex));
+    return (bool)file.read((char*)pixels.data(), pixels.size());
+}
 
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
 
-    #pragma region MonitorRendering
-    //Monitor Outer
-    glBindVertexArray(gBoxMesh.vao);
-
-    // 1. Scales the object by 2
-    scale = glm::scale(glm::vec3(1.0f, 0.8f, 0.1f));
-    // 2. Rotates shape by 15 degrees in the x axis
-    rotation = glm::rotate(0.0f, glm::vec3(1.0, 1.0f, 1.0f));
-    // 3. Place object at the origin
-    translation = glm::translate(glm::vec3(-0.8f, 0.2f, 0.0f));
-    // Model matrix: transformations are applied right-to-left order
-    model = translation * rotation * scale;
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-   
+// Creates the physical atlas and the page table and material buffers. The feedback target is sized
+// on first use.
+void UCreateVirtualTexturing(VirtualTexturing& vt, GLuint materialCount)
+{
+    const GLsizei atlasSize = VT_ATLAS_SLOTS * VT_SLOT_SIZE;
+    glGenTextures(1, &vt.atlas);
+    glBindTexture(GL_TEXTURE_2D, vt.atlas);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, atlasSize, atlasSize);
+    UTrackTexture(gTextureManager, vt.atlas, UTextureBytes(GL_RGBA8, atlasSize, atlasSize, 1, 1));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Nothing else uses the atlas unit, so the atlas stays bound there for the whole run
+    glActiveTexture(GL_TEXTURE0 + VT_ATLAS_UNIT);
+    glBindTexture(GL_TEXTURE_2D, vt.atlas);
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId2);
-    glDrawElements(GL_TRIANGLES, gBoxMesh.nIndices, GL_UNSIGNED_INT, (void*)0);
-    // bind textures on corresponding texture units
-    // Deactivate the Vertex Array Object
-    glBindVertexArray(0);
 
-    //Monitor Inner
-    glBindVertexArray(gPlaneMesh.vao);
-
-    // 1. Scales the object by 2
-    scale = glm::scale(glm::vec3(0.475f, 0.35f, 0.35f));
-    // 2. Rotates shape by 15 degrees in the x axis
-    rotation = glm::rotate(glm::radians(90.0f), glm::vec3(1.0, 0.0f, 0.0f));
-    // 3. Place object at the origin
-    translation = glm::translate(glm::vec3(-0.8f, 0.2f, 0.06f));
-    // Model matrix: transformations are applied right-to-left order
-    model = translation * rotation * scale;
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    vt.materials.assign(materialCount, VirtualMaterial());
+    VirtualMaterialData unregistered;
+    unregistered.size = glm::uvec4(0u);
+    for (glm::uvec4& level : unregistered.levels)
+        level = glm::uvec4(0u);
+    vt.materialData.assign(materialCount, unregistered);
+    vt.dirtyMaterials.assign(materialCount, false);
+    vt.pages.assign(VT_ATLAS_SLOTS * VT_ATLAS_SLOTS, VirtualPage());
+
+    glGenBuffers(1, &vt.materialBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, vt.materialBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(VirtualMaterialData) * materialCount, vt.materialData.data(), GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VIRTUAL_MATERIAL_BINDING, vt.materialBuffer);
+
+    // Grows as materials register; never zero bytes so the binding stays valid
+    glGenBuffers(1, &vt.pageTableBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, vt.pageTableBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 16, nullptr, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PAGE_TABLE_BINDING, vt.pageTableBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    glGenBuffers(FRAMES_IN_FLIGHT, vt.readbackBuffers);
+}
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId);
-    glDrawElements(GL_TRIANGLES, gPlaneMesh.nIndices, GL_UNSIGNED_INT, (void*)0);
-    glBindVertexArray(0);
 
-#pragma endregion
+// (Re)creates the feedback target for a window size, plus readback buffers to match. Readbacks still
+// in flight are dropped since they hold the old size.
+bool UCreateVirtualFeedback(VirtualTexturing& vt, int width, int height)
+{
+    glDeleteFramebuffers(1, &vt.feedbackFbo);
+    UDestroyTexture(vt.feedbackColor);
+    UDestroyTexture(vt.feedbackDepth);
+    vt.feedbackWidth = std::max(1, width / VT_FEEDBACK_DIVISOR);
+    vt.feedbackHeight = std::max(1, height / VT_FEEDBACK_DIVISOR);
+
+    glGenTextures(1, &vt.feedbackColor);
+    glBindTexture(GL_TEXTURE_2D, vt.feedbackColor);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32UI, vt.feedbackWidth, vt.feedbackHeight);
+    UTrackTexture(gTextureManager, vt.feedbackColor, UTextureBytes(GL_R32UI, vt.feedbackWidth, vt.feedbackHeight, 1, 1));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glGenTextures(1, &vt.feedbackDepth);
+    glBindTexture(GL_TEXTURE_2D, vt.feedbackDepth);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT24, vt.feedbackWidth, vt.feedbackHeight);
+    UTrackTexture(gTextureManager, vt.feedbackDepth, UTextureBytes(GL_DEPTH_COMPONENT24, vt.feedbackWidth, vt.feedbackHeight, 1, 1));
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &vt.feedbackFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, vt.feedbackFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, vt.feedbackColor, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, vt.feedbackDepth, 0);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOutputFramebuffer);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << "Feedback framebuffer incomplete: 0x" << std::hex << status << std::dec << endl;
+        return false;
+    }
 
-    glBindVertexArray(gBoxMesh.vao);
-    // 1. Scales the object by 2
-    scale = glm::scale(glm::vec3(0.7f, 0.05f, 0.25f));
-    // 2. Rotates shape by 15 degrees in the x axis
-    rotation = glm::rotate(0.0f, glm::vec3(1.0, 1.0f, 1.0f));
-    // 3. Place object at the origin
-    translation = glm::translate(glm::vec3(-1.0f, -0.45f, 0.5f));
-    // Model matrix: transformations are applied right-to-left order
-    model = translation * rotation * scale;
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    for (int slot = 0; slot < FRAMES_IN_FLIGHT; ++slot)
+    {
+        if (vt.readbackFences[slot])
+        {
+            glDeleteSync(vt.readbackFences[slot]);
+            vt.readbackFences[slot] = 0;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, vt.readbackBuffers[slot]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(GLuint) * vt.feedbackWidth * vt.feedbackHeight, nullptr, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return true;
+}
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId2);
-    glDrawElements(GL_TRIANGLES, gBoxMesh.nIndices, GL_UNSIGNED_INT, (void*)0);
 
-    glBindVertexArray(gPlaneMesh.vao);
+// Cooks a material's tile file on the thread pool and reads its coarsest tile; the render loop then
+// registers the material with that tile pinned, and feedback streams in the rest as the view needs it.
+// Until then the material samples flat grey.
+void UCreateVirtualMaterialAsync(AssetLoader& loader, VirtualTexturing& vt, GLuint material, const char* filename)
+{
+    loader.pending.fetch_add(1);
+    const std::string path = filename;
+    USubmitTask(gThreadPool, [&loader, &vt, material, path]()
+    {
+        PROFILE_ZONE("ULoadVirtualMaterial");
+        std::function<void()> upload;
 
-    // 1. Scales the object by 2
-    scale = glm::scale(glm::vec3(0.352f, 0.0f, 0.125f));
-    // 2. Rotates shape by 15 degrees in the x axis
-    rotation = glm::rotate(glm::radians(0.0f), glm::vec3(1.0, 0.0f, 0.0f));
-    // 3. Place object at the origin
-    translation = glm::translate(glm::vec3(-1.0f, -0.42f, 0.5f));
-    // Model matrix: transformations are applied right-to-left order
-    model = translation * rotation * scale;
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+        std::shared_ptr<VirtualMaterial> layout = std::make_shared<VirtualMaterial>();
+        std::shared_ptr<std::vector<unsigned char>> rootTile = std::make_shared<std::vector<unsigned char>>();
+        bool loaded = UCookVirtualTexture(path, *layout);
+        if (loaded)
+        {
+            std::ifstream file(layout->tileFile, std::ios::binary);
+            loaded = UReadVirtualTile(file, layout->tileCount - 1, *rootTile);
+        }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId5);
-    glDrawElements(GL_TRIANGLES, gPlaneMesh.nIndices, GL_UNSIGNED_INT, (void*)0);
-    glBindVertexArray(0);
+        if (loaded)
+            upload = [&vt, material, layout, rootTile]() { URegisterVirtualMaterial(vt, material, *layout, rootTile->data()); };
+        else
+            upload = [path]() { cout << "Failed to load texture " << path << endl; };
 
-    #pragma region Mousepad
+        std::lock_guard<std::mutex> lock(loader.mutex);
+        loader.uploads.push_back(std::move(upload));
+    });
+}
 
-    glBindVertexArray(gPlaneMesh.vao);
-    // 1. Scales the object by 2
-    scale = glm::scale(glm::vec3(1.4f, 0.35f, 0.30f));
-    // 2. Rotates shape by 15 degrees in the x axis
-    rotation = glm::rotate(glm::radians(0.0f), glm::vec3(1.0, 0.0f, 0.0f));
-    // 3. Place object at the origin
-    translation = glm::translate(glm::vec3(0.0f, -0.48f, 0.45f));
-    // Model matrix: transformations are applied right-to-left order
-    model = translation * rotation * scale;
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId4);
-    glDrawElements(GL_TRIANGLES, gPlaneMesh.nIndices, GL_UNSIGNED_INT, (void*)0);
-    glBindVertexArray(0);
+// Gives a cooked material its page table entries and pins its coarsest tile, so every pixel of it has
+// something resident to sample from then on
+void URegisterVirtualMaterial(VirtualTexturing& vt, GLuint material, const VirtualMaterial& layout, const unsigned char* rootTile)
+{
+    const int slot = UAllocateVirtualPage(vt);
+    if (slot < 0)
+    {
+        cout << "Virtual texture atlas has no room for " << layout.tileFile << endl;
+        return;
+    }
 
-    #pragma endregion
+    VirtualMaterial& entry = vt.materials[material];
+    entry = layout;
+    entry.firstEntry = (GLuint)vt.pageTable.size();
+    entry.registered = true;
+    const GLuint levelCount = (GLuint)entry.levelTiles.size();
+
+    // The table only grows, so reallocate it with every registered material's entries
+    vt.pageTable.resize(entry.firstEntry + entry.tileCount, 0);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, vt.pageTableBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * vt.pageTable.size(), vt.pageTable.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    UPlaceVirtualTile(vt, UMakeVirtualTileKey(material, levelCount - 1, 0, 0), slot, rootTile, true);
+    URefreshPageTable(vt, material);
+
+    VirtualMaterialData& data = vt.materialData[material];
+    data.size = glm::uvec4(entry.width, entry.height, levelCount, 0u);
+    for (GLuint level = 0; level < levelCount; ++level)
+        data.levels[level] = glm::uvec4(entry.firstEntry + entry.levelFirstTile[level], entry.levelTiles[level].x, entry.levelTiles[level].y, 0u);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, vt.materialBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(VirtualMaterialData) * material, sizeof(VirtualMaterialData), &data);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
 
-	// Activate the VBOs contained within the mesh's VAO
-	glBindVertexArray(gSphereMesh.vao);
 
-	// 1. Scales the object
-	scale = glm::scale(glm::vec3(0.075f, 0.05f, 0.1f));
-	// 2. Rotate the object
-	rotation = glm::rotate(0.0f, glm::vec3(1.0, 1.0f, 1.0f));
-	// 3. Position the object
-	translation = glm::translate(glm::vec3(0.0f, -0.45f, 0.6f));
-	// Model matrix: transformations are applied right-to-left order
-	model = translation * rotation * scale;
+// Returns a free atlas slot, else evicts the least recently used page the latest feedback did not ask
+// for. Returns -1 when every page is pinned or in view.
+int UAllocateVirtualPage(VirtualTexturing& vt)
+{
+    int victim = -1;
+    for (size_t slot = 0; slot < vt.pages.size(); ++slot)
+    {
+        const VirtualPage& page = vt.pages[slot];
+        if (page.tile == VT_NO_FEEDBACK)
+            return (int)slot;
+        if (page.pinned || page.lastUsed >= vt.generation)
+            continue;
+        if (victim < 0 || page.lastUsed < vt.pages[victim].lastUsed)
+            victim = (int)slot;
+    }
 
-	glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    if (victim >= 0)
+    {
+        const uint32_t tile = vt.pages[victim].tile;
+        vt.residentTiles.erase(tile);
+        vt.dirtyMaterials[tile >> 24] = true;
+        vt.pages[victim] = VirtualPage();
+        ++vt.evictions;
+    }
+    return victim;
+}
 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, gTextureId3);
-	// Draws the triangles
-	glDrawElements(GL_TRIANGLES, gSphereMesh.nIndices, GL_UNSIGNED_INT, (void*)0);
 
-	// Deactivate the Vertex Array Object
-	glBindVertexArray(0);
+// Copies a tile into its atlas slot and records it as resident
+void UPlaceVirtualTile(VirtualTexturing& vt, uint32_t tile, int slot, const unsigned char* pixels, bool pinned)
+{
+    glBindTexture(GL_TEXTURE_2D, vt.atlas);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % VT_ATLAS_SLOTS) * VT_SLOT_SIZE, (slot / VT_ATLAS_SLOTS) * VT_SLOT_SIZE,
+        VT_SLOT_SIZE, VT_SLOT_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    VirtualPage& page = vt.pages[slot];
+    page.tile = tile;
+    page.lastUsed = vt.generation;
+    page.pinned = pinned;
+    vt.residentTiles[tile] = (GLuint)slot;
+    vt.dirtyMaterials[tile >> 24] = true;
+    ++vt.uploads;
+}
 
-    #pragma region Desk Rendering
 
+// Rebuilds a material's page table entries from coarse to fine: a resident tile points at its own
+// slot and any other tile copies its parent's entry, so it shows the best coarser data until it streams in
+void URefreshPageTable(VirtualTexturing& vt, GLuint material)
+{
+    const VirtualMaterial& entry = vt.materials[material];
+    GLuint* table = vt.pageTable.data() + entry.firstEntry;
+    for (GLuint level = (GLuint)entry.levelTiles.size(); level-- > 0;)
+    {
+        const glm::uvec2 tiles = entry.levelTiles[level];
+        for (GLuint tileY = 0; tileY < tiles.y; ++tileY)
+            for (GLuint tileX = 0; tileX < tiles.x; ++tileX)
+            {
+                GLuint& pageEntry = table[entry.levelFirstTile[level] + tileY * tiles.x + tileX];
+                auto resident = vt.residentTiles.find(UMakeVirtualTileKey(material, level, tileX, tileY));
+                if (resident != vt.residentTiles.end())
+                    pageEntry = (resident->second % VT_ATLAS_SLOTS) | (resident->second / VT_ATLAS_SLOTS) << 8 | level << 16;
+                else if (level + 1 < entry.levelTiles.size())
+                {
+                    // Odd level sizes can leave a last tile whose parent index is one past the coarser grid
+                    const glm::uvec2 parentTiles = entry.levelTiles[level + 1];
+                    pageEntry = table[entry.levelFirstTile[level + 1] + std::min(tileY >> 1, parentTiles.y - 1) * parentTiles.x + std::min(tileX >> 1, parentTiles.x - 1)];
+                }
+            }
+    }
 
-    //Desk Surface
-    glBindVertexArray(gBoxMesh.vao);
-
-    // 1. Scales the object by 2
-    scale = glm::scale(glm::vec3(3.0f, 0.1f, 1.0f));
-    // 2. Rotates shape by 15 degrees in the x axis
-    rotation = glm::rotate(glm::radians(0.0f), glm::vec3(1.0, 0.0f, 0.0f));
-    // 3. Place object at the origin
-    translation = glm::translate(glm::vec3(0.0f, -0.55f, 0.3f));
-    // Model matrix: transformations are applied right-to-left order
-    model = translation * rotation * scale;
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, vt.pageTableBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * entry.firstEntry, sizeof(GLuint) * entry.tileCount, table);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    vt.dirtyMaterials[material] = false;
+}
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId3);
-    glDrawElements(GL_TRIANGLES, gBoxMesh.nIndices, GL_UNSIGNED_INT, (void*)0);
-    glBindVertexArray(0);
 
-#pragma endregion
+// Draws the scene program's ranges of the prepared queue into the small feedback target, each pixel
+// recording the tile it samples, and starts an asynchronous readback picked up frames later
+void URenderVirtualFeedback(VirtualTexturing& vt, const RenderQueue& queue)
+{
+    int width, height;
+    UGetFramebufferSize(width, height);
+    if (width == 0 || height == 0)
+        return;     // Minimized
 
-    #pragma region MonitorStand Rendering
-    glBindVertexArray(gBoxMesh.vao);
-
-    // 1. Scales the object by 2
-    scale = glm::scale(glm::vec3(0.1f, 0.30f, 0.1f));
-    // 2. Rotates shape by 15 degrees in the x axis
-    rotation = glm::rotate(0.0f, glm::vec3(1.0, 1.0f, 1.0f));
-    // 3. Place object at the origin
-    translation = glm::translate(glm::vec3(-0.8f, -0.35f, 0.0f));
-    // Model matrix: transformations are applied right-to-left order
-    model = translation * rotation * scale;
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    if (vt.feedbackWidth != std::max(1, width / VT_FEEDBACK_DIVISOR) || vt.feedbackHeight != std::max(1, height / VT_FEEDBACK_DIVISOR))
+    {
+        if (!UCreateVirtualFeedback(vt, width, height))
+            return;
+    }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId2);
-    glDrawElements(GL_TRIANGLES, gBoxMesh.nIndices, GL_UNSIGNED_INT, (void*)0);
-    // bind textures on corresponding texture units
-    // Deactivate the Vertex Array Object
+    // Every readback buffer still in flight: skip this frame's feedback rather than wait
+    const int slot = vt.readbackSlot;
+    if (vt.readbackFences[slot])
+        return;
+
+    UBeginGpuScope(gGpuProfiler, "Feedback pass");
+    glBindFramebuffer(GL_FRAMEBUFFER, vt.feedbackFbo);
+    glViewport(0, 0, vt.feedbackWidth, vt.feedbackHeight);
+    const GLuint clearValue[4] = { VT_NO_FEEDBACK, 0, 0, 0 };
+    glClearBufferuiv(GL_COLOR, 0, clearValue);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    glUseProgram(gFeedbackProgram.id);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+    glBindVertexArray(gMeshArena.vao);
+    for (const IndirectRange& range : queue.ranges)
+    {
+        if (range.programId == gProgram.id)
+            glMultiDrawElementsIndirect(GL_TRIANGLES, gMeshArena.indexType,
+                (void*)(sizeof(DrawElementsIndirectCommand) * range.firstCommand), range.commandCount, 0);
+    }
     glBindVertexArray(0);
-    #pragma endregion
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
 
-    // Reference matrix uniforms from the Cube Shader program for the cube color, light color, light position, and camera position
-     objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    GLint viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
+    // The copy lands in the pixel buffer without stalling; the fence tells when it is safe to map
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, vt.readbackBuffers[slot]);
+    glReadPixels(0, 0, vt.feedbackWidth, vt.feedbackHeight, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    vt.readbackFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    vt.readbackSlot = (slot + 1) % FRAMES_IN_FLIGHT;
 
-    // Pass color, light, and camera data to the Cube Shader program's corresponding uniforms.
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOutputFramebuffer);
+    glViewport(0, 0, width, height);
+    UEndGpuScope(gGpuProfiler);
+}
 
 
+// Turns one feedback buffer into page usage: visible resident tiles and all their ancestors are marked
+// used, and the missing ones go to the thread pool, coarsest first, to be read from their tile files
+void UProcessVirtualFeedback(VirtualTexturing& vt, const GLuint* feedback, size_t count)
+{
+    PROFILE_ZONE("UProcessVirtualFeedback");
+    ++vt.generation;
 
-    // LAMP: draw lamp
-    //----------------
-    glUseProgram(gLampProgramId);
-    glBindVertexArray(gMesh.vao);
+    std::vector<uint32_t> tiles(feedback, feedback + count);
+    std::sort(tiles.begin(), tiles.end());
+    tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
 
-    //Transform the smaller cube used as a visual que for the light source
-	rotation = glm::rotate(180.0f, glm::vec3(0.0, 1.0f, 0.0f));
-    model = glm::translate(gLightPosition) * rotation * glm::scale(gLightScale);
-	
+    std::vector<VirtualTileRequest> requests;
+    for (uint32_t tile : tiles)
+    {
+        const GLuint material = tile >> 24;
+        GLuint level = (tile >> 20) & 0xF;
+        GLuint tileX = tile & 0x3FF;
+        GLuint tileY = (tile >> 10) & 0x3FF;
+        if (tile == VT_NO_FEEDBACK || material >= vt.materials.size() || !vt.materials[material].registered)
+            continue;
+        const VirtualMaterial& entry = vt.materials[material];
+        if (level >= entry.levelTiles.size() || tileX >= entry.levelTiles[level].x || tileY >= entry.levelTiles[level].y)
+            continue;
+
+        for (; level < entry.levelTiles.size(); ++level)
+        {
+            tileX = std::min(tileX, entry.levelTiles[level].x - 1);
+            tileY = std::min(tileY, entry.levelTiles[level].y - 1);
+            const uint32_t key = UMakeVirtualTileKey(material, level, tileX, tileY);
+            auto resident = vt.residentTiles.find(key);
+            if (resident != vt.residentTiles.end())
+                vt.pages[resident->second].lastUsed = vt.generation;
+            else if (vt.requestedTiles.insert(key).second)
+                requests.push_back({ key, entry.tileFile, entry.levelFirstTile[level] + tileY * entry.levelTiles[level].x + tileX });
+            tileX >>= 1;
+            tileY >>= 1;
+        }
+    }
 
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
+    if (requests.empty())
+        return;
 
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    // A coarse tile fills in for many fine ones, so it streams first
+    std::stable_sort(requests.begin(), requests.end(), [](const VirtualTileRequest& a, const VirtualTileRequest& b)
+    {
+        return ((a.tile >> 20) & 0xF) > ((b.tile >> 20) & 0xF);
+    });
 
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices);
+    USubmitTask(gThreadPool, [&vt, requests]()
+    {
+        PROFILE_ZONE("UStreamVirtualTiles");
+        std::ifstream file;
+        std::string openFile;
+        for (const VirtualTileRequest& request : requests)
+        {
+            if (request.file != openFile)
+            {
+                file.close();
+                file.clear();
+                file.open(request.file, std::ios::binary);
+                openFile = request.file;
+            }
+
+            LoadedTile loaded;
+            loaded.tile = request.tile;
+            if (!UReadVirtualTile(file, request.index, loaded.pixels))
+            {
+                loaded.pixels.clear();
+                file.clear();
+            }
+
+            std::lock_guard<std::mutex> lock(vt.mutex);
+            vt.loadedTiles.push_back(std::move(loaded));
+        }
+    });
+}
 
-    // Deactivate the Vertex Array Object
-    glBindVertexArray(0);
 
-    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
-}
-
-///////////////////////////////////////////////////
-//	UCreateSphereMesh(GLMesh&)
-//
-//	mesh: reference to mesh structure for storing data
-//
-//	Create a sphere mesh and store it in a VAO/VBO
-//
-//  Correct triangle drawing command:
-//
-//	glDrawElements(GL_TRIANGLES, meshes.gSphereMesh.nIndices, GL_UNSIGNED_INT, (void*)0);
-///////////////////////////////////////////////////
-void UCreateSphereMesh(GLMesh& mesh)
+// Frame start: consumes every feedback readback that has landed, then uploads a bounded number of
+// the tiles the workers have streamed and refreshes the page tables they change
+void UUpdateVirtualTexturing(VirtualTexturing& vt)
 {
-	GLfloat verts[] = {
-		// vertex data					// index
-		// top center point
-		0.0f, 1.0f, 0.0f,				//0
-		// ring 1
-		0.0f, 0.9808f, 0.1951f,			//1
-		0.0747f, 0.9808f, 0.1802f,		//2
-		0.1379f, 0.9808f, 0.1379f,		//3
-		0.1802f, 0.9808f, 0.0747f,		//4
-		0.1951f, 0.9808, 0.0f,			//5
-		0.1802f, 0.9808f, -0.0747f,		//6
-		0.1379f, 0.9808f, -0.1379f,		//7
-		0.0747f, 0.9808f, -0.1802f,		//8
-		0.0f, 0.9808f, -0.1951f,		//9
-		-0.0747f, 0.9808f, -0.1802f,	//10
-		-0.1379f, 0.9808f, -0.1379f,	//11
-		-0.1802f, 0.9808f, -0.0747f,	//12
-		-0.1951f, 0.9808, 0.0f,			//13
-		-0.1802f, 0.9808f, 0.0747f,		//14
-		-0.1379f, 0.9808f, 0.1379f,		//15
-		-0.0747f, 0.9808f, 0.1802f,		//16
-		// ring 2
-		0.0f, 0.9239f, 0.3827f,			//17
-		0.1464f, 0.9239f, 0.3536f,		//18
-		0.2706f, 0.9239f, 0.2706f,		//19
-		0.3536f, 0.9239f, 0.1464f,		//20
-		0.3827f, 0.9239f, 0.0f,			//21
-		0.3536f, 0.9239f, -0.1464f,		//22
-		0.2706f, 0.9239f, -0.2706f,		//23
-		0.1464f, 0.9239f, -0.3536f,		//24
-		0.0f, 0.9239f, -0.3827f,		//25
-		-0.1464f, 0.9239f, -0.3536f,	//26
-		-0.2706f, 0.9239f, -0.2706f,	//27
-		-0.3536f, 0.9239f, -0.1464f,	//28
-		-0.3827f, 0.9239f, 0.0f,		//29
-		-0.3536f, 0.9239f, 0.1464f,		//30
-		-0.2706f, 0.9239f, 0.2706f,		//31
-		-0.1464f, 0.9239f, 0.3536f,		//32
-		// ring 3
-		0.0f, 0.8315f, 0.5556f,			//33
-		0.2126f, 0.8315f, 0.5133f,		//34
-		0.3928f, 0.8315f, 0.3928f,		//35
-		0.5133f, 0.8315f, 0.2126f,		//36
-		0.5556f, 0.8315f, 0.0f,			//37
-		0.5133f, 0.8315f, -0.2126f,		//38
-		0.3928f, 0.8315f, -0.3928f,		//39
-		0.2126f, 0.8315f, -0.5133f,		//40
-		0.0f, 0.8315f, -0.5556f,		//41
-		-0.2126f, 0.8315f, -0.5133f,	//42
-		-0.3928f, 0.8315f, -0.3928f,	//43
-		-0.5133f, 0.8315f, -0.2126f,	//44
-		-0.5556f, 0.8315f, 0.0f,		//45
-		-0.5133f, 0.8315f, 0.2126f,		//46
-		-0.3928f, 0.8315f, 0.3928f,		//47
-		-0.2126f, 0.8315f, 0.5133f,		//48
-		// ring 4
-		0.0f, 0.7071f, 0.7071f,			//49
-		0.2706f, 0.7071f, 0.6533f,		//50
-		0.5f, 0.7071f, 0.5f,			//51
-		0.6533f, 0.7071f, 0.2706f,		//52
-		0.7071f, 0.7071f, 0.0f,			//53
-		0.6533f, 0.7071f, -0.2706f,		//54
-		0.5f, 0.7071f, -0.5f,			//55
-		0.2706f, 0.7071f, -0.6533f,		//56
-		0.0f, 0.7071f, -0.7071f,		//57
-		-0.2706f, 0.7071f, -0.6533f,	//58
-		-0.5f, 0.7071f, -0.5f,			//59
-		-0.6533f, 0.7071f, -0.2706f,	//60
-		-0.7071f, 0.7071f, 0.0f,		//61
-		-0.6533f, 0.7071f, 0.2706f,		//62
-		-0.5f, 0.7071f, 0.5f,			//63
-		-0.2706f, 0.7071f, 0.6533f,		//64
-		// ring 5
-		0.0f, 0.5556f, 0.8315f,			//65
-		0.3182f, 0.5556f, 0.7682f,		//66
-		0.5879f, 0.5556f, 0.5879f,		//67
-		0.7682f, 0.5556f, 0.3182f,		//68
-		0.8315f, 0.5556f, 0.0f,			//69
-		0.7682f, 0.5556f, -0.3182f,		//70
-		0.5879f, 0.5556f, -0.5879f,		//71
-		0.3182f, 0.5556f, -0.7682f,		//72
-		0.0f, 0.5556f, -0.8315f,		//73
-		-0.3182f, 0.5556f, -0.7682f,	//74
-		-0.5879f, 0.5556f, -0.5879f,	//75
-		-0.7682f, 0.5556f, -0.3182f,	//76
-		-0.8315f, 0.5556f, 0.0f,		//77
-		-0.7682f, 0.5556f, 0.3182f,		//78
-		-0.5879f, 0.5556f, 0.5879f,		//79
-		-0.3182f, 0.5556f, 0.7682f,		//80
-		//ring 6
-		0.0f, 0.3827f, 0.9239f,			//81
-		0.3536f, 0.3827f, 0.8536f,		//82
-		0.6533f, 0.3827f, 0.6533f,		//83
-		0.8536f, 0.3827f, 0.3536f,		//84
-		0.9239f, 0.3827f, 0.0f,			//85
-		0.8536f, 0.3827f, -0.3536f,		//86
-		0.6533f, 0.3827f, -0.6533f,		//87
-		0.3536f, 0.3827f, -0.8536f,		//88
-		0.0f, 0.3827f, -0.9239f,		//89
-		-0.3536f, 0.3827f, -0.8536f,	//90
-		-0.6533f, 0.3827f, -0.6533f,	//91
-		-0.8536f, 0.3827f, -0.3536f,	//92
-		-0.9239f, 0.3827f, 0.0f,		//93
-		-0.8536f, 0.3827f, 0.3536f,		//94
-		-0.6533f, 0.3827f, 0.6533f,		//95
-		-0.3536f, 0.3827f, 0.8536f,		//96
-		// ring 7
-		0.0f, 0.1951f, 0.9808f,			//97
-		0.3753f, 0.1915f, 0.9061f,		//98
-		0.6935f, 0.1915f, 0.6935f,		//99
-		0.9061f, 0.1915f, 0.3753f,		//100
-		0.9808f, 0.1915f, 0.0f,			//101
-		0.9061f, 0.1915f, -0.3753f,		//102
-		0.6935f, 0.1915f, -0.6935f,		//103
-		0.3753f, 0.1915f, -0.9061f,		//104
-		0.0f, 0.1915f, -0.9808f,		//105
-		-0.3753f, 0.1915f, -0.9061f,	//106
-		-0.6935f, 0.1915f, -0.6935f,	//107
-		-0.9061f, 0.1915f, -0.3753f,	//108
-		-0.9808f, 0.1915f, 0.0f,		//109
-		-0.9061f, 0.1915f, 0.3753f,		//110
-		-0.6935f, 0.1915f, 0.6935f,		//111
-		-0.3753f, 0.1915f, 0.9061f,		//112
-		// ring 8
-		0.0f, 0.0f, 1.0f,				//113
-		0.3827f, 0.0f, 0.9239f,			//114
-		0.7071f, 0.0f, 0.7071f,			//115
-		0.9239f, 0.0f, 0.3827f,			//116
-		1.0f, 0.0f, 0.0f,				//117
-		0.9239f, 0.0f, -0.3827f,		//118
-		0.7071f, 0.0f, -0.7071f,		//119
-		0.3827f, 0.0f, -0.9239f,		//120
-		0.0f, 0.0f, -1.0f,				//121
-		-0.3827f, 0.0f, -0.9239f,		//122
-		-0.7071f, 0.0f, -0.7071f,		//123
-		-0.9239f, 0.0f, -0.3827f,		//124
-		-1.0f, 0.0f, 0.0f,				//125
-		-0.9239f, 0.0f, 0.3827f,		//126
-		-0.7071, 0.0, 0.7071f,			//127
-		-0.3827f, 0.0f, 0.9239f,		//128
-		// ring 9
-		0.0f, -0.1915f, 0.9808f,		//129
-		0.3753f, -0.1915f, 0.9061f,		//130
-		0.6935f, -0.1915f, 0.6935f,		//131
-		0.9061f, -0.1915f, 0.3753f,		//132
-		0.9808f, -0.1915f, 0.0f,		//133
-		0.9061f, -0.1915f, -0.3753f,	//134
-		0.6935f, -0.1915f, -0.6935f,	//135
-		0.3753f, -0.1915f, -0.9061f,	//136
-		0.0f, -0.1915f, -0.9808f,		//137
-		-0.3753f, -0.1915f, -0.9061f,	//138
-		-0.6935f, -0.1915f, -0.6935f,	//139
-		-0.9061f, -0.1915f, -0.3753f,	//140
-		-0.9808f, -0.1915f, 0.0f,		//141
-		-0.9061f, -0.1915f, 0.3753f,	//142
-		-0.6935f, -0.1915f, 0.6935f,	//143
-		-0.3753f, -0.1915f, 0.9061f,	//144
-		// ring 10
-		0.0f, -0.3827f, 0.9239f,		//145
-		0.3536f, -0.3827f, 0.8536f,		//146
-		0.6533f, -0.3827f, 0.6533f,		//147
-		0.8536f, -0.3827f, 0.3536f,		//148
-		0.9239f, -0.3827f, 0.0f,		//149
-		0.8536f, -0.3827f, -0.3536f,	//150
-		0.6533f, -0.3827f, -0.6533f,	//151
-		0.3536f, -0.3827f, -0.8536f,	//152
-		0.0f, -0.3827f, -0.9239f,		//153
-		-0.3536f, -0.3827f, -0.8536f,	//154
-		-0.6533f, -0.3827f, -0.6533f,	//155
-		-0.8536f, -0.3827f, -0.3536f,	//156
-		-0.9239f, -0.3827f, 0.0f,		//157
-		-0.8536f, -0.3827f, 0.3536f,	//158
-		-0.6533f, -0.3827f, 0.6533f,	//159
-		-0.3536f, -0.3827f, 0.8536f,	//160
-		// ring 11
-		0.0f, -0.5556f, 0.8315f,		//161
-		0.3182f, -0.5556f, 0.7682f,		//162
-		0.5879f, -0.5556f, 0.5879f,		//163
-		0.7682f, -0.5556f, 0.3182f,		//164
-		0.8315f, -0.5556f, 0.0f,		//165
-		0.7682f, -0.5556f, -0.3182f,	//166
-		0.5879f, -0.5556f, -0.5879f,	//167
-		0.3182f, -0.5556f, -0.7682f,	//168
-		0.0f, -0.5556f, -0.8315f,		//169
-		-0.3182f, -0.5556f, -0.7682f,	//170
-		-0.5879f, 0.5556f, -0.5879f,	//171
-		-0.7682f, -0.5556f, -0.3182f,	//172
-		-0.8315f, -0.5556f, 0.0f,		//173
-		-0.7682f, -0.5556f, 0.3182f,	//174
-		-0.5879f, -0.5556f, 0.5879f,	//175
-		-0.3182f, -0.5556f, 0.7682f,	//176
-		// ring 12
-		0.0f, -0.7071f, 0.7071f,		//177
-		0.2706f, -0.7071f, 0.6533f,		//178
-		0.5f, -0.7071f, 0.5f,			//179
-		0.6533f, -0.7071f, 0.2706f,		//180
-		0.7071f, -0.7071f, 0.0f,		//181
-		0.6533f, -0.7071f, -0.2706f,	//182
-		0.5f, -0.7071f, -0.5f,			//183
-		0.2706f, -0.7071f, -0.6533f,	//184
-		0.0f, -0.7071f, -0.7071f,		//185
-		-0.2706f, -0.7071f, -0.6533f,	//186
-		-0.5f, -0.7071f, -0.5f,			//187
-		-0.6533f, -0.7071f, -0.2706f,	//188
-		-0.7071f, -0.7071f, 0.0f,		//189
-		-0.6533f, -0.7071f, 0.2706f,	//190
-		-0.5f, -0.7071f, 0.5f,			//191
-		-0.2706f, -0.7071f, 0.6533f,	//192
-		// ring 13
-		0.0f, -0.8315f, 0.5556f,		//193
-		0.2126f, -0.8315f, 0.5133f,		//194
-		0.3928f, -0.8315f, 0.3928f,		//195
-		0.5133f, -0.8315f, 0.2126f,		//196
-		0.5556f, -0.8315f, 0.0f,		//197
-		0.5133f, -0.8315f, -0.2126f,	//198
-		0.3928f, -0.8315f, -0.3928f,	//199
-		0.2126f, -0.8315f, -0.5133f,	//200
-		0.0f, -0.8315f, -0.5556f,		//201
-		-0.2126f, -0.8315f, -0.5133f,	//202
-		-0.3928f, -0.8315f, -0.3928f,	//203
-		-0.5133f, -0.8315f, -0.2126f,	//204
-		-0.5556f, -0.8315f, 0.0f,		//205
-		-0.5133f, -0.8315f, 0.2126f,	//206
-		-0.3928f, -0.8315f, 0.3928f,	//207
-		-0.2126f, -0.8315f, 0.5133f,	//208
-		// ring 14
-		0.0f, -0.9239f, 0.3827f,		//209
-		0.1464f, -0.9239f, 0.3536f,		//210
-		0.2706f, -0.9239f, 0.2706f,		//211
-		0.3536f, -0.9239f, 0.1464f,		//212
-		0.3827f, -0.9239f, 0.0f,		//213
-		0.3536f, -0.9239f, -0.1464f,	//214
-		0.2706f, -0.9239f, -0.2706f,	//215
-		0.1464f, -0.9239f, -0.3536f,	//216
-		0.0f, -0.9239f, -0.3827f,		//217
-		-0.1464f, -0.9239f, -0.3536f,	//218
-		-0.2706f, -0.9239f, -0.2706f,	//219
-		-0.3536f, -0.9239f, -0.1464f,	//220
-		-0.3827f, -0.9239f, 0.0f,		//221
-		-0.3536f, -0.9239f, 0.1464f,	//222
-		-0.2706f, -0.9239f, 0.2706f,	//223
-		-0.1464f, -0.9239f, 0.3536f,	//224
-		// ring 15
-		0.0f, -0.9808f, 0.1951f,		//225
-		0.0747f, -0.9808f, 0.1802f,		//226
-		0.1379f, -0.9808f, 0.1379f,		//227
-		0.1802f, -0.9808f, 0.0747f,		//228
-		0.1951f, -0.9808, 0.0f,			//229
-		0.1802f, -0.9808f, -0.0747f,	//230
-		0.1379f, -0.9808f, -0.1379f,	//231
-		0.0747f, -0.9808f, -0.1802f,	//232
-		0.0f, -0.9808f, -0.1951f,		//233
-		-0.0747f, -0.9808f, -0.1802f,	//234
-		-0.1379f, -0.9808f, -0.1379f,	//235
-		-0.1802f, -0.9808f, -0.0747f,	//236
-		-0.1951f, -0.9808, 0.0f,		//237
-		-0.1802f, -0.9808f, 0.0747f,	//238
-		-0.1379f, -0.9808f, 0.1379f,	//239
-		-0.0747f, -0.9808f, 0.1802f,	//240
-		// bottom center point
-		0.0f, -1.0f, 0.0f,				//241
-	};
-
-	// index data
-	GLuint indices[] = {
-		//ring 1 - top
-		0,1,2,
-		0,2,3,
-		0,3,4,
-		0,4,5,
-		0,5,6,
-		0,6,7,
-		0,7,8,
-		0,8,9,
-		0,9,10,
-		0,10,11,
-		0,11,12,
-		0,12,13,
-		0,13,14,
-		0,14,15,
-		0,15,16,
-		0,16,1,
-
-		// ring 1 to ring 2
-		1,17,18,
-		1,2,18,
-		2,18,19,
-		2,3,19,
-		3,19,20,
-		3,4,20,
-		4,20,21,
-		4,5,21,
-		5,21,22,
-		5,6,22,
-		6,22,23,
-		6,7,23,
-		7,23,24,
-		7,8,24,
-		8,24,25,
-		8,9,25,
-		9,25,26,
-		9,10,26,
-		10,26,27,
-		10,11,27,
-		11,27,28,
-		11,12,28,
-		12,28,29,
-		12,13,29,
-		13,29,30,
-		13,14,30,
-		14,30,31,
-		14,15,31,
-		15,31,32,
-		15,16,32,
-		16,32,17,
-		16,1,17,
-
-		// ring 2 to ring 3
-		17,33,34,
-		17,18,34,
-		18,34,35,
-		18,19,35,
-		19,35,36,
-		19,20,36,
-		20,36,37,
-		20,21,37,
-		21,37,38,
-		21,22,38,
-		22,38,39,
-		22,23,39,
-		23,39,40,
-		23,24,40,
-		24,40,41,
-		24,25,41,
-		25,41,42,
-		25,26,42,
-		26,42,43,
-		26,27,43,
-		27,43,44,
-		27,28,44,
-		28,44,45,
-		28,29,45,
-		29,45,46,
-		29,30,46,
-		30,46,47,
-		30,31,47,
-		31,47,48,
-		31,32,48,
-		32,48,33,
-		32,17,33,
-
-		// ring 3 to ring 4
-		33,49,50,
-		33,34,50,
-		34,50,51,
-		34,35,51,
-		35,51,52,
-		35,36,52,
-		36,52,53,
-		36,37,53,
-		37,53,54,
-		37,38,54,
-		38,54,55,
-		38,39,55,
-		39,55,56,
-		39,40,56,
-		40,56,57,
-		40,41,57,
-		41,57,58,
-		41,42,58,
-		42,58,59,
-		42,43,59,
-		43,59,60,
-		43,44,60,
-		44,60,61,
-		44,45,61,
-		45,61,62,
-		45,46,62,
-		46,62,63,
-		46,47,63,
-		47,63,64,
-		47,48,64,
-		48,64,49,
-		48,33,49,
-
-		// ring 4 to ring 5
-		49,65,66,
-		49,50,66,
-		50,66,67,
-		50,51,67,
-		51,67,68,
-		51,52,68,
-		52,68,69,
-		52,53,69,
-		53,69,70,
-		53,54,70,
-		54,70,71,
-		54,55,71,
-		55,71,72,
-		55,56,72,
-		56,72,73,
-		56,57,73,
-		57,73,74,
-		57,58,74,
-		58,74,75,
-		58,59,75,
-		59,75,76,
-		59,60,76,
-		60,76,77,
-		60,61,77,
-		61,77,78,
-		61,62,78,
-		62,78,79,
-		62,63,79,
-		63,79,80,
-		63,64,80,
-		64,80,65,
-		64,49,65,
-
-		// ring 5 to ring 6
-		65,81,82,
-		65,66,82,
-		66,82,83,
-		66,67,83,
-		67,83,84,
-		67,68,84,
-		68,84,85,
-		68,69,85,
-		69,85,86,
-		69,70,86,
-		70,86,87,
-		70,71,87,
-		71,87,88,
-		71,72,88,
-		72,88,89,
-		72,73,89,
-		73,89,90,
-		73,74,90,
-		74,90,91,
-		74,75,91,
-		75,91,92,
-		75,76,92,
-		76,92,93,
-		76,77,93,
-		77,93,94,
-		77,78,94,
-		78,94,95,
-		78,79,95,
-		79,95,96,
-		79,80,96,
-		80,96,81,
-		80,65,81,
-
-		// ring 6 to ring 7
-		81,97,98,
-		81,82,98,
-		82,98,99,
-		82,83,99,
-		83,99,100,
-		83,84,100,
-		84,100,101,
-		84,85,101,
-		85,101,102,
-		85,86,102,
-		86,102,103,
-		86,87,103,
-		87,103,104,
-		87,88,104,
-		88,104,105,
-		88,89,105,
-		89,105,106,
-		89,90,106,
-		90,106,107,
-		90,91,107,
-		91,107,108,
-		91,92,108,
-		92,108,109,
-		92,93,109,
-		93,109,110,
-		93,94,110,
-		94,110,111,
-		94,95,111,
-		95,111,112,
-		95,96,112,
-		96,112,97,
-		96,81,97,
-
-		// ring 7 to ring 8
-		97,113,114,
-		97,98,114,
-		98,114,115,
-		98,99,115,
-		99,115,116,
-		99,100,116,
-		100,116,117,
-		100,101,117,
-		101,117,118,
-		101,102,118,
-		102,118,119,
-		102,103,119,
-		103,119,120,
-		103,104,120,
-		104,120,121,
-		104,105,121,
-		105,121,122,
-		105,106,122,
-		106,122,123,
-		106,107,123,
-		107,123,124,
-		107,108,124,
-		108,124,125,
-		108,109,125,
-		109,125,126,
-		109,110,126,
-		110,126,127,
-		110,111,127,
-		111,127,128,
-		111,112,128,
-		112,128,113,
-		112,97,113,
-
-		// ring 8 to ring 9
-		113,129,130,
-		113,114,130,
-		114,130,131,
-		114,115,131,
-		115,131,132,
-		115,116,132,
-		116,132,133,
-		116,117,133,
-		117,133,134,
-		117,118,134,
-		118,134,135,
-		118,119,135,
-		119,135,136,
-		119,120,136,
-		120,136,137,
-		120,121,137,
-		121,137,138,
-		121,122,138,
-		122,138,139,
-		122,123,139,
-		123,139,140,
-		123,124,140,
-		124,140,141,
-		124,125,141,
-		125,141,142,
-		125,126,142,
-		126,142,143,
-		126,127,143,
-		127,143,144,
-		127,128,144,
-		128,144,129,
-		128,113,129,
-
-		// ring 9 to ring 10
-		129,145,146,
-		129,130,146,
-		130,146,147,
-		130,131,147,
-		131,147,148,
-		131,132,148,
-		132,148,149,
-		132,133,149,
-		133,149,150,
-		133,134,150,
-		134,150,151,
-		134,135,151,
-		135,151,152,
-		135,136,152,
-		136,152,153,
-		136,137,153,
-		137,153,154,
-		137,138,154,
-		138,154,155,
-		138,139,155,
-		139,155,156,
-		139,140,156,
-		140,156,157,
-		140,141,157,
-		141,157,158,
-		141,142,158,
-		142,158,159,
-		142,143,159,
-		143,159,160,
-		143,144,160,
-		144,160,145,
-		144,129,145,
-
-		// ring 10 to ring 11
-		145,161,162,
-		145,146,162,
-		146,162,163,
-		146,147,163,
-		147,163,164,
-		147,148,164,
-		148,164,165,
-		148,149,165,
-		149,165,166,
-		149,150,166,
-		150,166,167,
-		150,151,167,
-		151,167,168,
-		151,152,168,
-		152,168,169,
-		152,153,169,
-		153,169,170,
-		153,154,170,
-		154,170,171,
-		154,155,171,
-		155,171,172,
-		155,156,172,
-		156,172,173,
-		156,157,173,
-		157,173,174,
-		157,158,174,
-		158,174,175,
-		158,159,175,
-		159,175,176,
-		159,160,176,
-		160,176,161,
-		160,145,161,
-
-		// ring 11 to ring 12
-		161,177,178,
-		161,162,178,
-		162,178,179,
-		162,163,179,
-		163,179,180,
-		163,164,180,
-		164,180,181,
-		164,165,181,
-		165,181,182,
-		165,166,182,
-		166,182,183,
-		166,167,183,
-		167,183,184,
-		167,168,184,
-		168,184,185,
-		168,169,185,
-		169,185,186,
-		169,170,186,
-		170,186,187,
-		170,171,187,
-		171,187,188,
-		171,172,188,
-		172,188,189,
-		172,173,189,
-		173,189,190,
-		173,174,190,
-		174,190,191,
-		174,175,191,
-		175,191,192,
-		175,176,192,
-		176,192,177,
-		176, 161,177,
-
-		// ring 12 to ring 13
-		177,193,194,
-		177,178,194,
-		178,194,195,
-		178,179,195,
-		179,195,196,
-		179,180,196,
-		180,196,197,
-		180,181,197,
-		181,197,198,
-		181,182,198,
-		182,198,199,
-		182,183,199,
-		183,199,200,
-		183,184,200,
-		184,200,201,
-		184,185,201,
-		185,201,202,
-		185,186,202,
-		186,202,203,
-		186,187,203,
-		187,203,204,
-		187,188,204,
-		188,204,205,
-		188,189,205,
-		189,205,206,
-		189,190,206,
-		190,206,207,
-		190,191,207,
-		191,207,208,
-		191,192,208,
-		192,208,193,
-		192,177,193,
-
-		// ring 13 to ring 14
-		193,209,210,
-		193,194,210,
-		194,210,211,
-		194,195,211,
-		195,211,212,
-		195,196,212,
-		196,212,213,
-		196,197,213,
-		197,213,214,
-		197,198,214,
-		198,214,215,
-		198,199,215,
-		199,215,216,
-		199,200,216,
-		200,216,217,
-		200,201,217,
-		201,217,218,
-		201,202,218,
-		202,218,219,
-		202,203,219,
-		203,219,220,
-		203,204,220,
-		204,220,221,
-		204,205,221,
-		205,221,222,
-		205,206,222,
-		206,222,223,
-		206,207,223,
-		207,223,224,
-		207,208,224,
-		208,224,209,
-		208,193,209,
-
-		// ring 14 to ring 15
-		209,225,226,
-		209,210,226,
-		210,226,227,
-		210,211,227,
-		211,227,228,
-		211,212,228,
-		212,228,229,
-		212,213,229,
-		213,229,230,
-		213,214,230,
-		214,230,231,
-		214,215,231,
-		215,231,232,
-		215,216,232,
-		216,232,233,
-		216,217,233,
-		217,233,234,
-		217,218,234,
-		218,234,235,
-		218,219,235,
-		219,235,236,
-		219,220,236,
-		220,236,237,
-		220,221,237,
-		221,237,238,
-		221,222,238,
-		222,238,239,
-		222,223,239,
-		223,239,240,
-		223,224,240,
-		224,240,225,
-		224,209,225,
-
-		// ring 15 - bottom
-		225,226,241,
-		226,227,241,
-		227,228,241,
-		228,229,241,
-		229,239,241,
-		230,231,241,
-		231,232,241,
-		232,233,241,
-		233,234,241,
-		234,235,241,
-		235,236,241,
-		236,237,241,
-		237,238,241,
-		238,239,241,
-		239,240,241,
-		240,225,241
-	};
-
-	// total float values per each type
-	const GLuint floatsPerVertex = 3;
-	const GLuint floatsPerNormal = 3;
-	const GLuint floatsPerUV = 2;
-
-	// store vertex and index count
-	mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex));
-	mesh.nIndices = sizeof(indices) / (sizeof(indices[0]));
-
-	glm::vec3 normal;
-	glm::vec3 vert;
-	glm::vec3 center(0.0f, 0.0f, 0.0f);
-	float u, v;
-	std::vector<GLfloat> combined_values;
-
-	// combine interleaved vertices, normals, and texture coords
-	for (int i = 0; i < sizeof(verts) / (sizeof(verts[0])); i += 3)
-	{
-		vert = glm::vec3(verts[i], verts[i + 1], verts[i + 2]);
-		normal = normalize(vert - center);
-		u = atan2(normal.x, normal.z) / (2 * M_PI) + 0.5;
-		v = normal.y * 0.5 + 0.5;
-		combined_values.push_back(vert.x);
-		combined_values.push_back(vert.y);
-		combined_values.push_back(vert.z);
-		combined_values.push_back(normal.x);
-		combined_values.push_back(normal.y);
-		combined_values.push_back(normal.z);
-		combined_values.push_back(u);
-		combined_values.push_back(v);
-	}
+    PROFILE_ZONE("UUpdateVirtualTexturing");
 
-	// Create VAO
-	glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-	glBindVertexArray(mesh.vao);
-
-	// Create VBOs
-	glGenBuffers(2, mesh.vbos);
-	glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the vertex buffer
-	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * combined_values.size(), combined_values.data(), GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    // Oldest first: readbackSlot is the next one to be written, so it is also the oldest pending
+    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i)
+    {
+        const int slot = (vt.readbackSlot + i) % FRAMES_IN_FLIGHT;
+        GLsync& fence = vt.readbackFences[slot];
+        if (!fence)
+            continue;
+        const GLenum state = glClientWaitSync(fence, 0, 0);
+        if (state != GL_ALREADY_SIGNALED && state != GL_CONDITION_SATISFIED)
+            break;
+        glDeleteSync(fence);
+        fence = 0;
+
+        const size_t pixelCount = (size_t)vt.feedbackWidth * vt.feedbackHeight;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, vt.readbackBuffers[slot]);
+        const GLuint* feedback = (const GLuint*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(GLuint) * pixelCount, GL_MAP_READ_BIT);
+        if (feedback)
+        {
+            UProcessVirtualFeedback(vt, feedback, pixelCount);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]); // Activates the index buffer
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+    std::vector<LoadedTile> loaded;
+    {
+        std::lock_guard<std::mutex> lock(vt.mutex);
+        const size_t count = std::min(vt.loadedTiles.size(), VT_MAX_UPLOADS_PER_FRAME);
+        loaded.assign(std::make_move_iterator(vt.loadedTiles.begin()), std::make_move_iterator(vt.loadedTiles.begin() + count));
+        vt.loadedTiles.erase(vt.loadedTiles.begin(), vt.loadedTiles.begin() + count);
+    }
 
-	// Strides between vertex coordinates
-	GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);
+    for (const LoadedTile& tile : loaded)
+    {
+        // A failed read or a full atlas drops the tile; the next feedback that still wants it asks again
+        vt.requestedTiles.erase(tile.tile);
+        if (tile.pixels.empty())
+            continue;
+        const int slot = UAllocateVirtualPage(vt);
+        if (slot >= 0)
+            UPlaceVirtualTile(vt, tile.tile, slot, tile.pixels.data(), false);
+    }
 
-	// Create Vertex Attribute Pointers
-	glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-	glEnableVertexAttribArray(0);
+    for (GLuint material = 0; material < vt.materials.size(); ++material)
+    {
+        if (vt.dirtyMaterials[material] && vt.materials[material].registered)
+            URefreshPageTable(vt, material);
+    }
+}
 
-	glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-	glEnableVertexAttribArray(1);
 
-	glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-	glEnableVertexAttribArray(2);
+void UDestroyVirtualTexturing(VirtualTexturing& vt)
+{
+    for (GLsync& fence : vt.readbackFences)
+    {
+        if (fence)
+        {
+            glDeleteSync(fence);
+            fence = 0;
+        }
+    }
+    glDeleteBuffers(FRAMES_IN_FLIGHT, vt.readbackBuffers);
+    glDeleteFramebuffers(1, &vt.feedbackFbo);
+    UDestroyTexture(vt.feedbackColor);
+    UDestroyTexture(vt.feedbackDepth);
+    UDestroyTexture(vt.atlas);
+    glDeleteBuffers(1, &vt.pageTableBuffer);
+    glDeleteBuffers(1, &vt.materialBuffer);
+    vt.materials.clear();
+    vt.pages.clear();
+    vt.residentTiles.clear();
+    vt.loadedTiles.clear();
 }
 
-// Implements the UCreatePyramidMesh function
-void UCreatePyramidMesh(GLMesh& mesh)
+// Bytes of a texture's storage over all its layers and allocated levels
+size_t UTextureBytes(GLenum format, GLsizei width, GLsizei height, GLsizei layers, GLsizei levels)
 {
-    // Vertex data
-    GLfloat verts[] = {
-        // Vertex Positions		// Normals			// Texture coords
-        //left side
-        0.0f, 0.5f, 0.0f,		-0.894427180f, 0.0f, -0.447213590f,	0.5f, 1.0f,		//top point	
-        0.0f, -0.5f, -0.5f,		-0.894427180f, 0.0f, -0.447213590f,	0.0f, 0.0f,		//back center
-        -0.5f, -0.5f, 0.5f,		-0.894427180f, 0.0f, -0.447213590f,	1.0f, 0.0f,     //front bottom left
-        0.0f, 0.5f, 0.0f,		-0.894427180f, 0.0f, -0.447213590f,	0.5f, 1.0f,		//top point	
-        //right side
-        0.0f, 0.5f, 0.0f,		0.894427180f, 0.0f, -0.447213590f,	0.5f, 1.0f,		//top point	
-        0.5f, -0.5f, 0.5f,		0.894427180f, 0.0f, -0.447213590f,	0.0f, 0.0f,     //front bottom right
-        0.0f, -0.5f, -0.5f,		0.894427180f, 0.0f, -0.447213590f,	1.0f, 0.0f,		//back center	
-        0.0f, 0.5f, 0.0f,		0.894427180f, 0.0f, -0.447213590f,	0.5f, 1.0f,		//top point	
-        //front side
-        0.0f, 0.5f, 0.0f,		0.0f, 0.0f, 1.0f,	0.5f, 1.0f,		//top point			
-        -0.5f, -0.5f, 0.5f,		0.0f, 0.0f, 1.0f,	0.0f, 0.0f,     //front bottom left	
-        0.5f, -0.5f, 0.5f,		0.0f, 0.0f, 1.0f,	1.0f, 0.0f,     //front bottom right
-        0.0f, 0.5f, 0.0f,		0.0f, 0.0f, 1.0f,	0.5f, 1.0f,		//top point	
-        //bottom side
-        -0.5f, -0.5f, 0.5f,		0.0f, -1.0f, 0.0f,	0.0f, 1.0f,     //front bottom left
-        0.5f, -0.5f, 0.5f,		0.0f, -1.0f, 0.0f,	1.0f, 1.0f,     //front bottom right
-        0.0f, -0.5f, -0.5f,		0.0f, -1.0f, 0.0f,	0.5f, 0.0f,		//back center	
-        -0.5f, -0.5f, 0.5f,		0.0f, -1.0f, 0.0f,	0.0f, 1.0f,     //front bottom left
-    };
-
-    const GLuint floatsPerVertex = 3;	// Number of coordinates per vertex
-    const GLuint floatsPerColor = 3;	// Number of values per vertex color
-    const GLuint floatsPerUV = 2;		// Number of texture coordinate values
-
-    // Calculate total defined vertices
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerColor + floatsPerUV));
-
-    glGenVertexArrays(1, &mesh.vao);			// Creates 1 VAO
-    glGenBuffers(1, mesh.vbos);					// Creates 1 VBO
-    glBindVertexArray(mesh.vao);				// Activates the VAO
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]);	// Activates the VBO
-    // Sends vertex or coordinate data to the GPU
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
-
-    // Strides between sets of attribute data
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerColor + floatsPerUV);
-
-    // Creates the Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, (void*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, floatsPerColor, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerColor)));
-    glEnableVertexAttribArray(2);
+    size_t bytes = 0;
+    for (GLsizei level = 0; level < levels; ++level)
+    {
+        const size_t levelWidth = std::max(1, width >> level);
+        const size_t levelHeight = std::max(1, height >> level);
+        const size_t blocks = ((levelWidth + 3) / 4) * ((levelHeight + 3) / 4);
+        if (format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT)
+            bytes += blocks * 8;
+        else if (format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+            bytes += blocks * 16;
+        else
+            bytes += levelWidth * levelHeight * 4;  // Every uncompressed format the renderer allocates is 32-bit
+    }
+    return bytes * layers;
 }
 
-void UCreatePlaneMesh(GLMesh& mesh)
-{
-    // Vertex data
-    GLfloat verts[] = {
-        // Vertex Positions		// Normals			// Texture coords	// Index
-        -1.0f, 0.0f, 1.0f,		0.0f, 1.0f, 0.0f,	0.0f, 0.0f,			//0
-        1.0f, 0.0f, 1.0f,		0.0f, 1.0f, 0.0f,	1.0f, 0.0f,			//1
-        1.0f,  0.0f, -1.0f,		0.0f, 1.0f, 0.0f,	1.0f, 1.0f,			//2
-        -1.0f, 0.0f, -1.0f,		0.0f, 1.0f, 0.0f,	0.0f, 1.0f,			//3
-    };
 
-    // Index data
-    GLuint indices[] = {
-        0,1,2,
-        0,3,2
-    };
+// Records or updates a texture's size and the resident and peak totals
+void UTrackTexture(TextureManager& manager, GLuint texture, size_t bytes)
+{
+    size_t& tracked = manager.textures[texture];
+    manager.residentBytes = manager.residentBytes - tracked + bytes;
+    tracked = bytes;
+    manager.peakBytes = std::max(manager.peakBytes, manager.residentBytes);
+}
 
-    // total float values per each type
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
 
-    // store vertex and index count
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
+void UUntrackTexture(TextureManager& manager, GLuint texture)
+{
+    auto tracked = manager.textures.find(texture);
+    if (tracked == manager.textures.end())
+        return;
+    manager.residentBytes -= tracked->second;
+    manager.textures.erase(tracked);
+}
 
-    // Generate the VAO for the mesh
-    glGenVertexArrays(1, &mesh.vao);
-    glBindVertexArray(mesh.vao);	// activate the VAO
 
-    // Create VBOs for the mesh
-    glGenBuffers(2, mesh.vbos);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends data to the GPU
+// Drops one top level at a time from the least recently used idle array until the resident bytes fit
+// the target. Returns false when no idle array has a level left to give.
+bool UShedTextureLevels(TextureManager& manager, MaterialLibrary& library, size_t targetBytes)
+{
+    while (manager.residentBytes > targetBytes)
+    {
+        MaterialArray* victim = nullptr;
+        for (size_t index = 1; index < library.arrays.size(); ++index)
+        {
+            MaterialArray& array = library.arrays[index];
+            const bool idle = array.lastUsed + TEXTURE_IDLE_FRAMES < manager.frame;
+            const bool canDrop = array.levels - array.droppedLevels > 1 &&
+                (std::max(array.width, array.height) >> (array.droppedLevels + 1)) >= TEXTURE_MIN_RESIDENT_SIZE;
+            if (idle && canDrop && !array.restoring && (victim == nullptr || array.lastUsed < victim->lastUsed))
+                victim = &array;
+        }
+        if (victim == nullptr)
+            return false;
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]); // Activates the buffer
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+        UResizeMaterialArray(*victim, victim->capacity, victim->droppedLevels + 1);
+        ++manager.droppedLevels;
+    }
+    return true;
+}
 
-    // Strides between vertex coordinates
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+// Reloads the full mip chain of every layer of an array from the texture cache on the thread pool
+void URequestTextureRestore(TextureManager& manager, MaterialLibrary& library, GLuint index)
+{
+    std::vector<std::pair<GLuint, std::string>> layers;
+    for (const Material& material : library.materials)
+    {
+        if (material.array == index)
+            layers.emplace_back(material.layer, material.file);
+    }
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    library.arrays[index].restoring = true;
+    USubmitTask(gThreadPool, [&manager, index, layers]()
+    {
+        PROFILE_ZONE("UReloadTextureLevels");
+        TextureRestore restore;
+        restore.array = index;
+        for (const auto& layer : layers)
+        {
+            restore.layers.emplace_back(layer.first, CookedTexture());
+            if (!ULoadTextureData(layer.second, restore.layers.back().second))
+            {
+                restore.failed = true;
+                break;
+            }
+        }
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+        std::lock_guard<std::mutex> lock(manager.mutex);
+        manager.restores.push_back(std::move(restore));
+    });
 }
 
-void UCreateBoxMesh(GLMesh& mesh)
+
+// Reallocates a reduced array at full resolution and uploads the reloaded top levels of every layer
+void UApplyTextureRestore(TextureManager& manager, MaterialLibrary& library, const TextureRestore& restore)
 {
-    // Position and Color data
-    GLfloat verts[] = {
-        //Positions				//Normals
-        // ------------------------------------------------------
-
-        //Back Face				//Negative Z Normal  Texture Coords.
-        0.5f, 0.5f, -0.5f,		0.0f,  0.0f, -1.0f,  0.0f, 1.0f,   //0
-        0.5f, -0.5f, -0.5f,		0.0f,  0.0f, -1.0f,  0.0f, 0.0f,   //1
-        -0.5f, -0.5f, -0.5f,	0.0f,  0.0f, -1.0f,  1.0f, 0.0f,   //2
-        -0.5f, 0.5f, -0.5f,		0.0f,  0.0f, -1.0f,  1.0f, 1.0f,   //3
-
-        //Bottom Face			//Negative Y Normal
-        -0.5f, -0.5f, 0.5f,		0.0f, -1.0f,  0.0f,  0.0f, 1.0f,  //4
-        -0.5f, -0.5f, -0.5f,	0.0f, -1.0f,  0.0f,  0.0f, 0.0f,  //5
-        0.5f, -0.5f, -0.5f,		0.0f, -1.0f,  0.0f,  1.0f, 0.0f,  //6
-        0.5f, -0.5f,  0.5f,		0.0f, -1.0f,  0.0f,  1.0f, 1.0f, //7
-
-        //Left Face				//Negative X Normal
-        -0.5f, 0.5f, -0.5f,		1.0f,  0.0f,  0.0f,  0.0f, 1.0f,      //8
-        -0.5f, -0.5f,  -0.5f,	1.0f,  0.0f,  0.0f,  0.0f, 0.0f,  //9
-        -0.5f,  -0.5f,  0.5f,	1.0f,  0.0f,  0.0f,  1.0f, 0.0f,  //10
-        -0.5f,  0.5f,  0.5f,	1.0f,  0.0f,  0.0f,  1.0f, 1.0f,  //11
-
-        //Right Face			//Positive X Normal
-        0.5f,  0.5f,  0.5f,		1.0f,  0.0f,  0.0f,  0.0f, 1.0f,  //12
-        0.5f,  -0.5f, 0.5f,		1.0f,  0.0f,  0.0f,  0.0f, 0.0f,  //13
-        0.5f, -0.5f, -0.5f,		1.0f,  0.0f,  0.0f,  1.0f, 0.0f,  //14
-        0.5f, 0.5f, -0.5f,		1.0f,  0.0f,  0.0f,  1.0f, 1.0f,  //15
-
-        //Top Face				//Positive Y Normal
-        -0.5f,  0.5f, -0.5f,	0.0f,  1.0f,  0.0f,  0.0f, 1.0f, //16
-        -0.5f,  0.5f, 0.5f,		0.0f,  1.0f,  0.0f,  0.0f, 0.0f, //17
-        0.5f,  0.5f,  0.5f,		0.0f,  1.0f,  0.0f,  1.0f, 0.0f, //18
-        0.5f,  0.5f,  -0.5f,	0.0f,  1.0f,  0.0f,  1.0f, 1.0f, //19
-
-        //Front Face			//Positive Z Normal
-        -0.5f, 0.5f,  0.5f,	    0.0f,  0.0f,  1.0f,  0.0f, 1.0f, //20
-        -0.5f, -0.5f,  0.5f,	0.0f,  0.0f,  1.0f,  0.0f, 0.0f, //21
-        0.5f,  -0.5f,  0.5f,	0.0f,  0.0f,  1.0f,  1.0f, 0.0f, //22
-        0.5f,  0.5f,  0.5f,		0.0f,  0.0f,  1.0f,  1.0f, 1.0f, //23
-    };
-
-    // Index data
-    GLuint indices[] = {
-        0,1,2,
-        0,3,2,
-        4,5,6,
-        4,7,6,
-        8,9,10,
-        8,11,10,
-        12,13,14,
-        12,15,14,
-        16,17,18,
-        16,19,18,
-        20,21,22,
-        20,23,22
-    };
-
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
-
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.nIndices = sizeof(indices) / sizeof(indices[0]);
-
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    MaterialArray& array = library.arrays[restore.array];
+    array.restoring = false;
+    if (restore.failed)
+    {
+        // Stays reduced, and sheddable, until the retry
+        array.retryFrame = manager.frame + TEXTURE_IDLE_FRAMES;
+        cout << "Could not reload the dropped levels of texture array " << restore.array << "; retrying in "
+            << TEXTURE_IDLE_FRAMES << " frames" << endl;
+        return;
+    }
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(2, mesh.vbos);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbos[0]); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    if ((GLsizei)restore.layers.size() != array.layerCount)
+        return;     // A layer arrived meanwhile; the next frame asks again with it included
+    for (const auto& layer : restore.layers)
+    {
+        if ((GLsizei)layer.second.levels.size() != array.levels)
+            return;
+    }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vbos[1]); // Activates the buffer
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+    const GLsizei dropped = array.droppedLevels;
+    UResizeMaterialArray(array, array.capacity, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+    for (const auto& layer : restore.layers)
+        UUploadMaterialLevels(array, (GLint)layer.first, layer.second, 0, dropped);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    manager.restoredLevels += dropped;
+}
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+// Frame start: applies finished reloads, restores reduced arrays drawn last frame when their full size
+// fits the budget, and sheds levels from idle arrays while over it
+void UUpdateTextureBudget(TextureManager& manager, MaterialLibrary& library)
+{
+    PROFILE_ZONE("UUpdateTextureBudget");
+    ++manager.frame;
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    std::vector<TextureRestore> restores;
+    {
+        std::lock_guard<std::mutex> lock(manager.mutex);
+        restores.swap(manager.restores);
+    }
+    for (const TextureRestore& restore : restores)
+        UApplyTextureRestore(manager, library, restore);
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    for (size_t index = 1; index < library.arrays.size(); ++index)
+    {
+        MaterialArray& array = library.arrays[index];
+        if (array.droppedLevels == 0 || array.restoring || array.lastUsed + 1 < manager.frame || manager.frame < array.retryFrame)
+            continue;
+
+        // Idle arrays make room first; the drawn one comes back only if it then fits
+        const size_t extraBytes = UTextureBytes(array.format, array.width, array.height, array.capacity, array.levels) -
+            UTextureBytes(array.format, std::max(1, array.width >> array.droppedLevels), std::max(1, array.height >> array.droppedLevels),
+                array.capacity, array.levels - array.droppedLevels);
+        if (UShedTextureLevels(manager, library, manager.budgetBytes > extraBytes ? manager.budgetBytes - extraBytes : 0))
+            URequestTextureRestore(manager, library, (GLuint)index);
+    }
+
+    UShedTextureLevels(manager, library, manager.budgetBytes);
 }
 
-void UDestroyMesh(GLMesh& mesh)
+
+void UDestroyTexture(GLuint textureId)
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(2, mesh.vbos);
+    UUntrackTexture(gTextureManager, textureId);
+    glDeleteTextures(1, &textureId);
 }
 
-/*Generate and load the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// Passes the body's #version line, the shared chunks and the rest of the body as separate strings
+void UShaderSource(GLuint shader, const ShaderSource& source)
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    const GLchar* afterVersion = strchr(source.body, '\n') + 1;
+    std::vector<const GLchar*> strings(1, source.body);
+    std::vector<GLint> lengths(1, (GLint)(afterVersion - source.body));
+    for (const GLchar* chunk : source.chunks)
     {
-        flipImageVertically(image, width, height, channels);
-
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+        strings.push_back(chunk);
+        lengths.push_back(-1);  // Null-terminated
+    }
+    strings.push_back(afterVersion);
+    lengths.push_back(-1);
+    glShaderSource(shader, (GLsizei)strings.size(), strings.data(), lengths.data());
+}
 
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
-        {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
-        }
-        
-        glGenerateMipmap(GL_TEXTURE_2D);
+// Submits compilation and linking without querying any status, so drivers with parallel shader
+// compilation can work on several programs while the caller does other startup work
+void UBeginShaderProgram(const ShaderSource& vertexSource, const ShaderSource& fragmentSource, ShaderProgram& program)
+{
+    PROFILE_ZONE("UBeginShaderProgram");
+    // Create a Shader program object.
+    program.id = glCreateProgram();
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+    // Create the vertex and fragment shader objects
+    program.vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    program.fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
 
-        return true;
-    }
+    // Retrive the shader source
+    UShaderSource(program.vertexShader, vertexSource);
+    UShaderSource(program.fragmentShader, fragmentSource);
 
-    // Error loading the image
-    return false;
-}
+    glCompileShader(program.vertexShader);
+    glCompileShader(program.fragmentShader);
 
+    // Attached compiled shaders to the shader program
+    glAttachShader(program.id, program.vertexShader);
+    glAttachShader(program.id, program.fragmentShader);
 
-void UDestroyTexture(GLuint textureId)
-{
-    glGenTextures(1, &textureId);
+    glLinkProgram(program.id);  // links the shader program
 }
 
-// Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+
+// Waits for the program begun by UBeginShaderProgram, reports compilation and linkage errors (if any)
+// and records its uniforms and block bindings
+bool UFinishShaderProgram(ShaderProgram& program)
 {
+    PROFILE_ZONE("UFinishShaderProgram");
     // Compilation and linkage error reporting
     int success = 0;
     char infoLog[512];
+    GLuint programId = program.id;
 
-    // Create a Shader program object.
-    programId = glCreateProgram();
-
-    // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
-
-    // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
-
-    // Compile the vertex shader, and print compilation errors (if any)
-    glCompileShader(vertexShaderId); // compile the vertex shader
     // check for shader compile errors
-    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
+    glGetShaderiv(program.vertexShader, GL_COMPILE_STATUS, &success);
     if (!success)
     {
-        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
+        glGetShaderInfoLog(program.vertexShader, 512, NULL, infoLog);
         std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
 
         return false;
     }
 
-    glCompileShader(fragmentShaderId); // compile the fragment shader
     // check for shader compile errors
-    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
+    glGetShaderiv(program.fragmentShader, GL_COMPILE_STATUS, &success);
     if (!success)
     {
-        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
+        glGetShaderInfoLog(program.fragmentShader, sizeof(infoLog), NULL, infoLog);
         std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
 
         return false;
     }
 
-    // Attached compiled shaders to the shader program
-    glAttachShader(programId, vertexShaderId);
-    glAttachShader(programId, fragmentShaderId);
-
-    glLinkProgram(programId);   // links the shader program
     // check for linking errors
     glGetProgramiv(programId, GL_LINK_STATUS, &success);
     if (!success)
@@ -1973,13 +6896,306 @@ bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSou
         return false;
     }
 
+    // The linked program keeps its own copy of the code
+    glDeleteShader(program.vertexShader);
+    glDeleteShader(program.fragmentShader);
+    program.vertexShader = 0;
+    program.fragmentShader = 0;
+
+    // Record every active uniform and block now so rendering never looks them up by name
+    UReflectShaderProgram(program);
+
+    // Programs that read per-frame data get the shared buffer's binding point
+    auto frameBlock = program.blocks.find("FrameData");
+    if (frameBlock != program.blocks.end())
+        glUniformBlockBinding(programId, frameBlock->second, FRAME_DATA_BINDING);
+
+    // Likewise for the per-object data ring and the clustered light lists
+    const std::pair<const char*, GLuint> storageBindings[] = {
+        { "ObjectBuffer", OBJECT_DATA_BINDING },
+        { "LightBuffer", LIGHT_DATA_BINDING },
+        { "ClusterBuffer", CLUSTER_DATA_BINDING },
+        { "LightIndexBuffer", LIGHT_INDEX_BINDING },
+        { "PageTableBuffer", PAGE_TABLE_BINDING },
+        { "VirtualMaterialBuffer", VIRTUAL_MATERIAL_BINDING },
+        { "MeshBuffer", MESH_DATA_BINDING },
+    };
+    for (const auto& binding : storageBindings)
+    {
+        auto block = program.storageBlocks.find(binding.first);
+        if (block != program.storageBlocks.end())
+            glShaderStorageBlockBinding(programId, block->second, binding.second);
+    }
+
     glUseProgram(programId);    // Uses the shader program
 
     return true;
 }
 
 
-void UDestroyShaderProgram(GLuint programId)
+// Queries the linked program for its active uniforms, uniform blocks and shader storage blocks.
+// Members of uniform blocks have no location and are left out of the uniform table.
+void UReflectShaderProgram(ShaderProgram& program)
+{
+    program.uniforms.clear();
+    program.blocks.clear();
+    program.storageBlocks.clear();
+
+    GLint uniformCount = 0;
+    GLint maxNameLength = 0;
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORMS, &uniformCount);
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+
+    std::vector<GLchar> name(maxNameLength > 0 ? maxNameLength : 1);
+    for (GLint i = 0; i < uniformCount; ++i)
+    {
+        GLsizei length = 0;
+        GLint size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(program.id, (GLuint)i, (GLsizei)name.size(), &length, &size, &type, name.data());
+
+        GLint location = glGetUniformLocation(program.id, name.data());
+        if (location < 0)
+            continue;
+
+        // Arrays are reported as "name[0]"; store them under the plain name as well
+        std::string uniformName(name.data(), length);
+        program.uniforms[uniformName] = location;
+        size_t bracket = uniformName.find('[');
+        if (bracket != std::string::npos)
+            program.uniforms[uniformName.substr(0, bracket)] = location;
+    }
+
+    GLint blockCount = 0;
+    GLint maxBlockNameLength = 0;
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+    glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxBlockNameLength);
+
+    name.resize(maxBlockNameLength > 0 ? maxBlockNameLength : 1);
+    for (GLint i = 0; i < blockCount; ++i)
+    {
+        GLsizei length = 0;
+        glGetActiveUniformBlockName(program.id, (GLuint)i, (GLsizei)name.size(), &length, name.data());
+        program.blocks[std::string(name.data(), length)] = (GLuint)i;
+    }
+
+    GLint storageBlockCount = 0;
+    GLint maxStorageNameLength = 0;
+    glGetProgramInterfaceiv(program.id, GL_SHADER_STORAGE_BLOCK, GL_ACTIVE_RESOURCES, &storageBlockCount);
+    glGetProgramInterfaceiv(program.id, GL_SHADER_STORAGE_BLOCK, GL_MAX_NAME_LENGTH, &maxStorageNameLength);
+
+    name.resize(maxStorageNameLength > 0 ? maxStorageNameLength : 1);
+    for (GLint i = 0; i < storageBlockCount; ++i)
+    {
+        GLsizei length = 0;
+        glGetProgramResourceName(program.id, GL_SHADER_STORAGE_BLOCK, (GLuint)i, (GLsizei)name.size(), &length, name.data());
+        program.storageBlocks[std::string(name.data(), length)] = (GLuint)i;
+    }
+}
+
+
+// Returns the reflected location of a uniform, or -1 when the program has no such active uniform
+GLint UGetUniformLocation(const ShaderProgram& program, const std::string& name)
+{
+    auto uniform = program.uniforms.find(name);
+    return uniform != program.uniforms.end() ? uniform->second : -1;
+}
+
+
+// Creates the uniform buffer behind the FrameData block and attaches it to its binding point
+void UCreateFrameUniformBuffer()
+{
+    glGenBuffers(1, &gFrameUniformBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameUniformBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, gFrameUniformBuffer);
+}
+
+
+// Uploads this frame's camera, light and material constants in a single buffer update
+void UUpdateFrameUniforms(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& lightPosition)
+{
+    FrameData frame;
+    frame.view = view;
+    frame.projection = projection;
+    frame.viewPosition = glm::vec4(gCamera.Position, 1.0f);
+    frame.lightPosition = glm::vec4(lightPosition, 1.0f);
+    frame.lightColor = glm::vec4(gLightColor, 1.0f);
+    frame.objectColor = glm::vec4(gObjectColor, 1.0f);
+    frame.uvScale = glm::vec4(gUVScale.x, gUVScale.y, 0.0f, 0.0f);
+
+    // Slice = log(depth) * Z / log(far / near) - Z * log(near) / log(far / near)
+    int width, height;
+    UGetFramebufferSize(width, height);
+    const float sliceScale = CLUSTER_COUNT_Z / logf(FAR_PLANE / NEAR_PLANE);
+    frame.clusterScale = glm::vec4((float)CLUSTER_COUNT_X / std::max(width, 1), (float)CLUSTER_COUNT_Y / std::max(height, 1),
+        sliceScale, -sliceScale * logf(NEAR_PLANE));
+    frame.clusterGrid = glm::uvec4(CLUSTER_COUNT_X, CLUSTER_COUNT_Y, CLUSTER_COUNT_Z, (GLuint)gPointLights.size());
+
+    frame.lightViewProjection = gShadowMaps.lightViewProjection;
+    frame.shadowParams = glm::vec4((float)gLampLight, 0.0005f, 1.0f / SHADOW_MAP_SIZE, gShadowMaps.current != 0 ? 1.0f : 0.0f);
+
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameUniformBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &frame);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+
+// Adds a point light and returns its index
+int UAddPointLight(const glm::vec3& position, const glm::vec3& color, float intensity, float radius)
+{
+    PointLight light;
+    light.positionRadius = glm::vec4(position, radius);
+    light.color = glm::vec4(color, intensity);
+    gPointLights.push_back(light);
+    return (int)gPointLights.size() - 1;
+}
+
+
+// Creates the light, cluster and index storage buffers and attaches them to their binding points
+void UCreateLightClusters(LightClusters& clusters)
+{
+    const size_t clusterCount = (size_t)CLUSTER_COUNT_X * CLUSTER_COUNT_Y * CLUSTER_COUNT_Z;
+    clusters.counts.resize(clusterCount);
+    clusters.slots.resize(clusterCount * MAX_LIGHTS_PER_CLUSTER);
+    clusters.grid.resize(clusterCount * 2);
+
+    glGenBuffers(3, clusters.buffers);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_DATA_BINDING, clusters.buffers[0]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_DATA_BINDING, clusters.buffers[1]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_INDEX_BINDING, clusters.buffers[2]);
+}
+
+
+// Computes the view-space box of every cluster. Each tile corner is unprojected to a ray from the
+// near to the far plane and cut at the slice depths, which handles perspective and orthographic alike.
+void UBuildClusterBounds(LightClusters& clusters, const glm::mat4& projection)
+{
+    const size_t clusterCount = (size_t)CLUSTER_COUNT_X * CLUSTER_COUNT_Y * CLUSTER_COUNT_Z;
+    clusters.boundsMin.resize(clusterCount);
+    clusters.boundsMax.resize(clusterCount);
+    clusters.projection = projection;
+
+    const glm::mat4 inverseProjection = glm::inverse(projection);
+    auto unproject = [&inverseProjection](float x, float y, float z)
+    {
+        glm::vec4 point = inverseProjection * glm::vec4(x, y, z, 1.0f);
+        return glm::vec3(point.x / point.w, point.y / point.w, point.z / point.w);
+    };
+
+    for (int z = 0; z < CLUSTER_COUNT_Z; ++z)
+    {
+        const float sliceNear = NEAR_PLANE * powf(FAR_PLANE / NEAR_PLANE, (float)z / CLUSTER_COUNT_Z);
+        const float sliceFar = NEAR_PLANE * powf(FAR_PLANE / NEAR_PLANE, (float)(z + 1) / CLUSTER_COUNT_Z);
+
+        for (int y = 0; y < CLUSTER_COUNT_Y; ++y)
+        {
+            for (int x = 0; x < CLUSTER_COUNT_X; ++x)
+            {
+                glm::vec3 boundsMin(1e30f, 1e30f, 1e30f);
+                glm::vec3 boundsMax(-1e30f, -1e30f, -1e30f);
+
+                for (int corner = 0; corner < 4; ++corner)
+                {
+                    float ndcX = (float)(x + (corner & 1)) / CLUSTER_COUNT_X * 2.0f - 1.0f;
+                    float ndcY = (float)(y + (corner >> 1)) / CLUSTER_COUNT_Y * 2.0f - 1.0f;
+                    glm::vec3 rayNear = unproject(ndcX, ndcY, -1.0f);
+                    glm::vec3 rayFar = unproject(ndcX, ndcY, 1.0f);
+
+                    // View space looks down -z
+                    for (float depth : { sliceNear, sliceFar })
+                    {
+                        float t = (depth + rayNear.z) / (rayNear.z - rayFar.z);
+                        glm::vec3 point = rayNear + (rayFar - rayNear) * t;
+                        boundsMin = glm::min(boundsMin, point);
+                        boundsMax = glm::max(boundsMax, point);
+                    }
+                }
+
+                const size_t cluster = x + CLUSTER_COUNT_X * (y + CLUSTER_COUNT_Y * (size_t)z);
+                clusters.boundsMin[cluster] = boundsMin;
+                clusters.boundsMax[cluster] = boundsMax;
+            }
+        }
+    }
+}
+
+
+// Bins the lights into clusters and uploads the light, cluster and index buffers. Depth slices are
+// assigned on the worker pool; each slice writes only its own clusters' slots.
+void UAssignLightsToClusters(LightClusters& clusters, const std::vector<PointLight>& lights, const glm::mat4& view, const glm::mat4& projection)
+{
+    PROFILE_ZONE("UAssignLightsToClusters");
+    // Cluster bounds only depend on the projection (zoom, aspect, perspective toggle)
+    if (clusters.boundsMin.empty() || projection != clusters.projection)
+        UBuildClusterBounds(clusters, projection);
+
+    clusters.viewLights.resize(lights.size());
+    for (size_t i = 0; i < lights.size(); ++i)
+    {
+        glm::vec4 position = view * glm::vec4(lights[i].positionRadius.x, lights[i].positionRadius.y, lights[i].positionRadius.z, 1.0f);
+        clusters.viewLights[i] = glm::vec4(position.x, position.y, position.z, lights[i].positionRadius.w);
+    }
+
+    const size_t clustersPerSlice = (size_t)CLUSTER_COUNT_X * CLUSTER_COUNT_Y;
+    UParallelFor(gThreadPool, CLUSTER_COUNT_Z, [&](size_t slice)
+    {
+        for (size_t cluster = slice * clustersPerSlice; cluster < (slice + 1) * clustersPerSlice; ++cluster)
+        {
+            const glm::vec3& boundsMin = clusters.boundsMin[cluster];
+            const glm::vec3& boundsMax = clusters.boundsMax[cluster];
+            GLuint* slots = clusters.slots.data() + cluster * MAX_LIGHTS_PER_CLUSTER;
+            GLuint count = 0;
+
+            for (size_t i = 0; i < clusters.viewLights.size() && count < (GLuint)MAX_LIGHTS_PER_CLUSTER; ++i)
+            {
+                // Sphere against box: distance from the center to the closest point of the box
+                const glm::vec4& light = clusters.viewLights[i];
+                glm::vec3 center(light.x, light.y, light.z);
+                glm::vec3 closest = glm::clamp(center, boundsMin, boundsMax);
+                glm::vec3 offset = center - closest;
+                if (glm::dot(offset, offset) <= light.w * light.w)
+                    slots[count++] = (GLuint)i;
+            }
+            clusters.counts[cluster] = count;
+        }
+    });
+
+    // Compact the per-cluster slots into one index list
+    clusters.indices.clear();
+    for (size_t cluster = 0; cluster < clusters.counts.size(); ++cluster)
+    {
+        const GLuint* slots = clusters.slots.data() + cluster * MAX_LIGHTS_PER_CLUSTER;
+        clusters.grid[cluster * 2] = (GLuint)clusters.indices.size();
+        clusters.grid[cluster * 2 + 1] = clusters.counts[cluster];
+        clusters.indices.insert(clusters.indices.end(), slots, slots + clusters.counts[cluster]);
+    }
+
+    // Orphan and refill each buffer; never allocate zero bytes so the bindings stay valid
+    auto upload = [](GLuint buffer, const void* data, size_t size)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(size, (size_t)16), nullptr, GL_STREAM_DRAW);
+        if (size > 0)
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data);
+    };
+    upload(clusters.buffers[0], lights.data(), sizeof(PointLight) * lights.size());
+    upload(clusters.buffers[1], clusters.grid.data(), sizeof(GLuint) * clusters.grid.size());
+    upload(clusters.buffers[2], clusters.indices.data(), sizeof(GLuint) * clusters.indices.size());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+void UDestroyLightClusters(LightClusters& clusters)
+{
+    glDeleteBuffers(3, clusters.buffers);
+}
+
+
+void UDestroyShaderProgram(ShaderProgram& program)
 {
-    glDeleteProgram(programId);
+    glDeleteProgram(program.id);
+    program.id = 0;
 }